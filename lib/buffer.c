@@ -0,0 +1,78 @@
+/* buffer.c */
+
+#include "buffer.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RING_MASK (RING_SIZE - 1)
+
+ssize_t ring_read(struct ring *r, int fd)
+{
+    struct iovec iov[2];
+    uint32_t t = r->tail & RING_MASK, space = RING_SIZE - ring_len(r);
+    ssize_t n;
+    int cnt = 1;
+
+    iov[0].iov_base = r->data + t;
+    iov[0].iov_len = RING_SIZE - t;
+
+    if (iov[0].iov_len >= space) {
+        iov[0].iov_len = space;
+    } else {
+        iov[1].iov_base = r->data;
+        iov[1].iov_len = space - iov[0].iov_len;
+        cnt = 2;
+    }
+
+    n = readv(fd, iov, cnt);
+    if (n > 0)
+        r->tail += n;
+
+    return n;
+}
+
+ssize_t ring_write(struct ring *r, int fd)
+{
+    struct iovec iov[2];
+    uint32_t h = r->head & RING_MASK, len = ring_len(r);
+    ssize_t n;
+    int cnt = 1;
+
+    iov[0].iov_base = r->data + h;
+    iov[0].iov_len = RING_SIZE - h;
+
+    if (iov[0].iov_len >= len) {
+        iov[0].iov_len = len;
+    } else {
+        iov[1].iov_base = r->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+        cnt = 2;
+    }
+
+    n = writev(fd, iov, cnt);
+    if (n > 0)
+        r->head += n;
+
+    return n;
+}
+
+uint32_t ring_put(struct ring *r, const void *buf, uint32_t len)
+{
+    uint32_t t = r->tail & RING_MASK, space = RING_SIZE - ring_len(r), n;
+
+    if (len > space)
+        len = space;
+
+    n = RING_SIZE - t;
+    if (n > len)
+        n = len;
+
+    memcpy(r->data + t, buf, n);
+    memcpy(r->data, (const char *)buf + n, len - n);
+    r->tail += len;
+
+    return len;
+}
@@ -0,0 +1,45 @@
+/* buffer.h */
+
+#ifndef _PW_BUFFER_H
+#define _PW_BUFFER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define RING_SIZE 16384 /* must be a power of 2 */
+
+/* Single producer, single consumer byte ring used by the relay. */
+struct ring {
+    uint32_t head; /* read position, free running */
+    uint32_t tail; /* write position, free running */
+    char data[RING_SIZE];
+};
+
+static inline void ring_init(struct ring *r)
+{
+    r->head = r->tail = 0;
+}
+
+static inline uint32_t ring_len(const struct ring *r)
+{
+    return r->tail - r->head;
+}
+
+static inline int ring_empty(const struct ring *r)
+{
+    return r->tail == r->head;
+}
+
+static inline int ring_full(const struct ring *r)
+{
+    return ring_len(r) == RING_SIZE;
+}
+
+/* read from fd into the free space, returns the read(2) result. */
+ssize_t ring_read(struct ring *r, int fd);
+/* write the buffered bytes to fd, returns the write(2) result. */
+ssize_t ring_write(struct ring *r, int fd);
+/* copy as much of buf as fits into the free space, returns the count. */
+uint32_t ring_put(struct ring *r, const void *buf, uint32_t len);
+
+#endif /* buffer.h */
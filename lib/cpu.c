@@ -0,0 +1,151 @@
+/* cpu.c */
+
+#include "cpu.h"
+
+#ifdef __linux__
+#    include <linux/mempolicy.h>
+#    include <sys/syscall.h>
+#    include <sched.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int node = 0;
+
+    /* the cpu directory links the node it belongs to, as nodeN. */
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return 0;
+
+    while ((d = readdir(dir))) {
+        if (strncmp(d->d_name, "node", 4) == 0 && d->d_name[4] >= '0' &&
+            d->d_name[4] <= '9') {
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return node;
+}
+
+static int cpu_list_parse(struct cpu_list *list, const char *spec)
+{
+    const char *p = spec;
+    char *end;
+    long lo, hi;
+
+    while (*p) {
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= CPU_MAX)
+            return -1;
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo || hi >= CPU_MAX)
+                return -1;
+            p = end;
+        }
+        for (; lo <= hi && list->n < CPU_MAX; lo++)
+            list->cpu[list->n++] = lo;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+
+    return list->n ? 0 : -1;
+}
+
+int cpu_list_get(struct cpu_list *list, const char *spec)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    int i, j, cpu, node;
+
+    list->n = 0;
+
+    if (spec && *spec) {
+        if (cpu_list_parse(list, spec) == -1) {
+            pw_debug("bad cpu list: %s\n", spec);
+            return -1;
+        }
+    } else {
+        if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+            pw_error("sched_getaffinity");
+            return -1;
+        }
+        for (i = 0; i < CPU_SETSIZE && i < CPU_MAX; i++) {
+            if (CPU_ISSET(i, &set))
+                list->cpu[list->n++] = i;
+        }
+    }
+
+    for (i = 0; i < list->n; i++)
+        list->node[i] = cpu_node(list->cpu[i]);
+
+    /* an explicit list is taken in the order it was given. */
+    if (spec && *spec)
+        return 0;
+
+    /* insertion sort by node, stable so that cpus keep their order. */
+    for (i = 1; i < list->n; i++) {
+        cpu = list->cpu[i];
+        node = list->node[i];
+        for (j = i; j > 0 && list->node[j - 1] > node; j--) {
+            list->cpu[j] = list->cpu[j - 1];
+            list->node[j] = list->node[j - 1];
+        }
+        list->cpu[j] = cpu;
+        list->node[j] = node;
+    }
+
+    return list->n ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int cpu_pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    /* pid 0 is the calling thread, not the whole process. */
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        pw_error("sched_setaffinity");
+        return -1;
+    }
+
+    /**
+     * Allocations fault in on the node of the thread touching them first,
+     * MPOL_LOCAL makes sure a policy inherited from numactl(8) does not
+     * place them elsewhere.
+     */
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 &&
+        errno != ENOSYS)
+        pw_error("set_mempolicy");
+
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
@@ -0,0 +1,26 @@
+/* cpu.h */
+
+#ifndef _PW_CPU_H
+#define _PW_CPU_H
+
+#define CPU_MAX 1024
+
+struct cpu_list {
+    int n;
+    int cpu[CPU_MAX];
+    int node[CPU_MAX]; /* NUMA node of cpu[i], 0 without NUMA */
+};
+
+/**
+ * The CPUs of spec, like "0-3,8,10-11", in the order given, or those the
+ * process may run on when spec is NULL or empty, ordered by NUMA node so
+ * that neighbouring workers share a node. Returns -1 on a malformed spec
+ * or where affinity is not supported.
+ */
+int cpu_list_get(struct cpu_list *list, const char *spec);
+/* the NUMA node of cpu, 0 if unknown. */
+int cpu_node(int cpu);
+/* pin the calling thread to cpu and allocate its memory on the local node. */
+int cpu_pin(int cpu);
+
+#endif /* cpu.h */
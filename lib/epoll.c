@@ -7,11 +7,9 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
-#include <assert.h>
 
 #include "ev.h"
 #include "debug.h"
-#include "ev_hash.h"
 
 struct epoll_op {
     struct epoll_event *events;
@@ -20,10 +18,12 @@ struct epoll_op {
 };
 
 int op_init(struct event_base *base);
-int op_add(struct event_base *base, int fd, uint16_t flags);
-int op_delete(struct event_base *base, int fd, uint16_t flags);
+int op_add(struct event_base *base, struct event *ev, uint16_t flags);
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags);
+int op_modify(struct event_base *base, struct event *ev);
 int op_poll_wait(struct event_base *base, const struct timeval *tv);
 int op_destroy(struct event_base *base);
+void ev_active(struct event_base *base, struct event *ev, uint16_t flags);
 
 int op_init(struct event_base *base)
 {
@@ -59,22 +59,21 @@ err:
     return -1;
 }
 
-int op_add(struct event_base *base, int fd, uint16_t flags)
+/* register ev->flags of ev->fd with ctl. */
+static int epoll_ctl_ev(struct epoll_op *op, int ctl, struct event *ev)
 {
-    struct epoll_op *op = base->op;
     struct epoll_event ee = {};
 
     ee.events = EPOLLET;
-    ee.data.fd = fd;
+    ee.data.ptr = ev;
 
-    if (flags & EV_READ)
+    if (ev->flags & EV_READ)
         ee.events |= EPOLLIN;
 
-    if (flags & EV_WRITE)
+    if (ev->flags & EV_WRITE)
         ee.events |= EPOLLOUT;
 
-    /* TODO: handle modify */
-    if (epoll_ctl(op->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+    if (epoll_ctl(op->epfd, ctl, ev->fd, &ee) == -1) {
         pw_error("epoll_ctl");
         return -1;
     }
@@ -82,33 +81,30 @@ int op_add(struct event_base *base, int fd, uint16_t flags)
     return 0;
 }
 
-int op_delete(struct event_base *base, int fd, uint16_t flags)
+/* ev is new, flags are all of ev->flags. */
+int op_add(struct event_base *base, struct event *ev, uint16_t flags)
 {
-    struct epoll_op *op = base->op;
-    struct epoll_event ee = {};
-
-    ee.events = EPOLLET;
-    ee.data.fd = fd;
-
-    if (flags & EV_READ)
-        ee.events |= EPOLLIN;
-
-    if (flags & EV_WRITE)
-        ee.events |= EPOLLOUT;
+    return epoll_ctl_ev(base->op, EPOLL_CTL_ADD, ev);
+}
 
-    if (epoll_ctl(op->epfd, EPOLL_CTL_DEL, fd, &ee) == -1) {
-        pw_error("epoll_ctl");
-        return -1;
-    }
+/* nothing is left of ev->flags. */
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags)
+{
+    return epoll_ctl_ev(base->op, EPOLL_CTL_DEL, ev);
+}
 
-    return 0;
+/* the flags of ev changed since the last poll, an ET re-arm as well. */
+int op_modify(struct event_base *base, struct event *ev)
+{
+    return epoll_ctl_ev(base->op, EPOLL_CTL_MOD, ev);
 }
 
 int op_poll_wait(struct event_base *base, const struct timeval *tv)
 {
     struct epoll_op *op = base->op;
+    struct epoll_event *ee;
     int i, nfds;
-    struct event *ev;
+    uint16_t flags;
     int timeout = -1;
 
     if (tv)
@@ -124,9 +120,16 @@ again:
     }
 
     for (i = 0; i < nfds; i++) {
-        ev = ev_hash_get(base, op->events[i].data.fd);
-        assert(ev);
-        ev->fn(base, ev->fd, ev->flags, ev->data);
+        ee = &op->events[i];
+        flags = EV_NONE;
+
+        /* errors and hangups are reported to both directions. */
+        if (ee->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            flags |= EV_READ;
+        if (ee->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            flags |= EV_WRITE;
+
+        ev_active(base, ee->data.ptr, flags);
     }
 
     return nfds;
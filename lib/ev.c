@@ -13,12 +13,77 @@
 
 #include "debug.h"
 #include "ev_hash.h"
+#include "ev_post.h"
+#include "ev_timer.h"
+#include "pool.h"
 
 int op_init(struct event_base *base);
-int op_add(struct event_base *base, int fd, uint16_t flags);
-int op_delete(struct event_base *base, int fd, uint16_t flags);
+int op_add(struct event_base *base, struct event *ev, uint16_t flags);
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags);
+int op_modify(struct event_base *base, struct event *ev);
 int op_poll_wait(struct event_base *base, const struct timeval *tv);
 int op_destroy(struct event_base *base);
+void ev_active(struct event_base *base, struct event *ev, uint16_t flags);
+
+static void ev_free_closed(struct event_base *base);
+
+/**
+ * Interest changes of a registered fd are queued and applied right before
+ * the next poll, from ev->kflags to whatever ev->flags ended up as: write
+ * interest turned on and off again within a round costs no syscall. New
+ * fds are added and fds left with no flags removed at once, the caller may
+ * close them right away and the fd number be reused before the next poll.
+ */
+static int ev_change(struct event_base *base, struct event *ev)
+{
+    struct event **changes;
+    uint32_t size;
+
+    if (ev->changed)
+        return 0;
+
+    if (base->nchanges == base->changes_size) {
+        size = base->changes_size ? base->changes_size * 2 : 64;
+        changes = realloc(base->changes, size * sizeof(struct event *));
+        if (!changes) {
+            pw_error("realloc");
+            return -1;
+        }
+        base->changes = changes;
+        base->changes_size = size;
+    }
+
+    base->changes[base->nchanges++] = ev;
+    ev->changed = 1;
+    ev->count++; /* kept until ev_flush_changes, even when deleted */
+
+    return 0;
+}
+
+static void ev_flush_changes(struct event_base *base)
+{
+    struct event *ev;
+    uint32_t i;
+
+    for (i = 0; i < base->nchanges; i++) {
+        ev = base->changes[i];
+        ev->changed = 0;
+        ev->count--;
+
+        /* deleted since, or back to what is registered */
+        if (ev->fd == -1 || (ev->flags == ev->kflags && !ev->rearm)) {
+            ev->rearm = 0;
+            continue;
+        }
+
+        /* the backend logs a failure, the old interest stays */
+        if (op_modify(base, ev) == 0)
+            ev->kflags = ev->flags;
+        ev->rearm = 0;
+    }
+
+    base->nchanges = 0;
+}
 
 struct event_base *event_base_new(uint32_t events_size)
 {
@@ -32,13 +97,24 @@ struct event_base *event_base_new(uint32_t events_size)
 
     base->event_num = 0;
     base->events_size = events_size;
+    base->post_fd[0] = base->post_fd[1] = -1;
+
+    base->pool = pool_new(sizeof(struct event), events_size);
+    if (!base->pool)
+        goto err;
 
     if (ev_hash_new(base) == -1)
         goto err;
 
+    if (ev_timer_new(base) == -1)
+        goto err;
+
     if (op_init(base) == -1)
         goto err;
 
+    if (ev_post_init(base) == -1)
+        goto err;
+
     return base;
 err:
     if (base)
@@ -56,26 +132,31 @@ int event_base_add(struct event_base *base, int fd, uint16_t flags,
 
     ev = ev_hash_get(base, fd);
     if (ev) {
-        ev->flags |= flags;
-        if (op_add(base, fd, flags) == -1)
+        flags &= ~ev->flags; /* only what is not registered yet */
+        if (flags != EV_NONE && ev_change(base, ev) == -1)
             return -1;
+        ev->flags |= flags;
     } else {
-        ev = calloc(1, sizeof(struct event));
-        if (!ev) {
-            pw_error("calloc");
+        ev = pool_alloc(base->pool);
+        if (!ev)
             return -1;
-        }
 
+        memset(ev, 0, sizeof(struct event));
         ev->fd = fd;
         ev->flags = flags;
 
-        ev_hash_set(base, fd, ev);
+        if (ev_hash_set(base, fd, ev) == -1) {
+            pool_free(base->pool, ev);
+            return -1;
+        }
 
-        if (op_add(base, fd, flags) == -1) {
+        if (op_add(base, ev, flags) == -1) {
             ev_hash_delete(base, fd);
+            pool_free(base->pool, ev);
             return -1;
         }
 
+        ev->kflags = flags;
         base->event_num++;
     }
 
@@ -96,32 +177,144 @@ int event_base_delete(struct event_base *base, int fd, int flags)
     if (!ev)
         return -1;
 
-    ev->flags &= ~flags;
+    flags &= ev->flags; /* only what is registered */
+    if (flags == EV_NONE)
+        return 0;
+
+    /* others stay registered, see ev_change */
+    if (ev->flags != flags) {
+        if (ev_change(base, ev) == -1)
+            return -1;
+        ev->flags &= ~flags;
+        return 0;
+    }
+
+    ev->flags = EV_NONE;
+
+    if (op_delete(base, ev, flags) == -1)
+        return -1;
+    ev->kflags = EV_NONE;
+
+    /**
+     * The backend may still hold a pointer to ev in the ready list of the
+     * current batch, so it is only marked dead here and freed once the
+     * batch has been dispatched.
+     */
+    ev_hash_delete(base, fd);
+    ev->fd = -1;
+    ev->next = base->closed;
+    base->closed = ev;
+
+    if (!ev->unref)
+        base->event_num--;
+
+    return 0;
+}
+
+int event_base_rearm(struct event_base *base, int fd)
+{
+    struct event *ev;
 
-    if (op_delete(base, fd, flags) == -1)
+    if (!base || fd < 0)
         return -1;
 
-    if (ev->flags == EV_NONE)
-        ev_hash_delete(base, fd);
+    ev = ev_hash_get(base, fd);
+    if (!ev || ev_change(base, ev) == -1)
+        return -1;
 
-    base->event_num--;
+    ev->rearm = 1;
 
     return 0;
 }
 
+void event_base_unref(struct event_base *base, int fd)
+{
+    struct event *ev;
+
+    ev = ev_hash_get(base, fd);
+    if (ev && !ev->unref) {
+        ev->unref = 1;
+        base->event_num--;
+    }
+}
+
 int event_base_loop(struct event_base *base, const struct timeval *tv)
 {
+    struct timeval timeout;
+    int64_t next;
+    int ret;
+
     if (!base)
         return -1;
 
-    return op_poll_wait(base, tv);
+    /* sleep no longer than until the next timer is due. */
+    next = ev_timer_next(base, ev_timer_now());
+    if (next >= 0 &&
+        (!tv || next < (int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000)) {
+        timeout.tv_sec = next / 1000;
+        timeout.tv_usec = (next % 1000) * 1000;
+        tv = &timeout;
+    }
+
+    base->dispatch_start = 0;
+
+    ev_flush_changes(base);
+
+    ret = op_poll_wait(base, tv);
+    if (ret != -1)
+        ret += ev_timer_run(base, ev_timer_now());
+
+    ev_free_closed(base);
+
+    /* the wait is left out, the clock is only read on busy wakeups. */
+    base->dispatch_us =
+        base->dispatch_start ? ev_timer_now_us() - base->dispatch_start : 0;
+
+    return ret;
 }
 
 void event_base_destroy(struct event_base *base)
 {
     if (base) {
         ev_hash_destroy(base);
+        if (base->timers)
+            ev_timer_destroy(base);
         op_destroy(base);
+        ev_post_destroy(base);
+        pool_destroy(base->pool); /* releases the live events as well */
+        free(base->changes);
         free(base);
     }
 }
+
+/* Called by the backend for every ready event of a batch. */
+void ev_active(struct event_base *base, struct event *ev, uint16_t flags)
+{
+    /* deleted earlier in this batch, e.g. the peer fd of a closed conn. */
+    if (ev->fd == -1)
+        return;
+
+    flags &= ev->flags;
+    if (flags == EV_NONE)
+        return;
+
+    if (!base->dispatch_start)
+        base->dispatch_start = ev_timer_now_us();
+
+    ev->fn(base, ev->fd, flags, ev->data);
+}
+
+static void ev_free_closed(struct event_base *base)
+{
+    struct event **p = &base->closed, *ev;
+
+    while (*p) {
+        ev = *p;
+        if (ev->count) { /* the backend still references it */
+            p = &ev->next;
+            continue;
+        }
+        *p = ev->next;
+        pool_free(base->pool, ev);
+    }
+}
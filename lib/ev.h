@@ -16,30 +16,104 @@ enum {
 
 struct event_base;
 struct ev_hash;
+struct ev_wheel;
+struct ev_signals;
+struct event_task;
+struct pool;
 
 typedef void event_handler_t(struct event_base *, int, uint16_t, void *);
+typedef void event_timer_handler_t(struct event_base *, void *);
+typedef void event_task_handler_t(struct event_base *, void *);
+typedef void event_signal_handler_t(struct event_base *, int, void *);
 
 struct event {
-    int fd;
+    struct event *next; /* closed list, see event_base_loop */
+    int fd;             /* -1 once deleted (tombstone) */
     uint16_t flags;
     event_handler_t *fn;
     void *data;
-    uint8_t count;
+    uint8_t count;   /* backend references, freed only at 0 */
+    uint8_t unref;   /* not counted in event_num */
+    uint8_t changed; /* queued in base->changes */
+    uint8_t rearm;   /* registered anew at the flush, see event_base_rearm */
+    uint16_t kflags; /* the interest the backend has registered */
+};
+
+/* embedded in the owner's struct, no allocation per timer */
+struct event_timer {
+    struct event_timer *next;
+    struct event_timer **pprev; /* NULL unless pending */
+    uint64_t expire;            /* ms, see ev_timer_now */
+    event_timer_handler_t *fn;
+    void *data;
 };
 
 struct event_base {
     struct ev_hash *events;
+    struct ev_wheel *timers;
+    struct event *closed; /* deleted events, freed after dispatch */
+    struct pool *pool;    /* struct event allocator */
+    struct event **changes; /* events whose interest changed, see ev.c */
+    uint32_t nchanges;
+    uint32_t changes_size;
     uint32_t events_size;
-    uint32_t event_num;
+    uint32_t event_num; /* registered fds, but the unref'd ones */
+    struct event_task *posted; /* see event_base_post */
+    int post_fd[2];            /* wakeup of the loop, eventfd on Linux */
+    struct ev_signals *signals;
+    uint64_t dispatch_start; /* us the first handler of a wakeup ran */
+    uint64_t dispatch_us;    /* time the last wakeup spent in handlers */
     void *op;
 };
 
 struct event_base *event_base_new(uint32_t events_size);
+/**
+ * Register flags for fd, or add them to those registered. Changing the
+ * flags of a registered fd takes effect at the next poll, the changes of
+ * a round are coalesced into one per fd, none if they cancel out.
+ */
 int event_base_add(struct event_base *base, int fd, uint16_t flags,
                    event_handler_t *fn, void *data);
+/* the fd is unregistered at once when no flags are left, it may be closed. */
 int event_base_delete(struct event_base *base, int fd, int flags);
-/* error return -1, timeout return 0. */
+/**
+ * Have the backend report the edge triggered fd again at the next poll if
+ * it is still ready, for a handler that left work behind, e.g. out of its
+ * budget. Applied with the interest changes, -1 if fd is not registered.
+ */
+int event_base_rearm(struct event_base *base, int fd);
+/**
+ * The event of fd does not keep the loop busy any more, it is left out of
+ * event_num, like the fds a library keeps for itself.
+ */
+void event_base_unref(struct event_base *base, int fd);
+/**
+ * Run fn(base, arg) from the loop of base. Safe to call from any thread, but
+ * not from a signal handler, see event_base_signal for signals.
+ */
+int event_base_post(struct event_base *base, event_task_handler_t *fn,
+                    void *arg);
+/**
+ * Deliver signo as an event of base, through signalfd on Linux. signo is
+ * blocked in the calling thread, other threads of the process have to
+ * block it as well, e.g. by creating them afterwards.
+ */
+int event_base_signal(struct event_base *base, int signo,
+                      event_signal_handler_t *fn, void *arg);
+/**
+ * Wait at most tv (NULL forever) for events, or less if a timer is due.
+ * error return -1, timeout return 0, else the number of handlers run.
+ */
 int event_base_loop(struct event_base *base, const struct timeval *tv);
+/* call fn(base, data) once, ms from now. A pending t is rescheduled. */
+void event_base_timer_add(struct event_base *base, struct event_timer *t,
+                          uint32_t ms, event_timer_handler_t *fn, void *data);
+void event_base_timer_cancel(struct event_base *base, struct event_timer *t);
+
+static inline int event_timer_pending(const struct event_timer *t)
+{
+    return t->pprev != NULL;
+}
 void event_base_destroy(struct event_base *base);
 
 #endif /* ev.h */
@@ -7,6 +7,7 @@
 
 #include "ev.h"
 #include "debug.h"
+#include "pool.h"
 
 struct entry {
     struct entry *next;
@@ -15,6 +16,7 @@ struct entry {
 
 struct ev_hash {
     struct entry **table;
+    struct pool *pool; /* struct entry allocator */
     uint32_t size;
 };
 
@@ -39,12 +41,17 @@ int ev_hash_new(struct event_base *base)
     if (!hash)
         goto err;
 
-    hash->table = calloc(base->events_size, sizeof(struct entry));
+    base->events = hash;
+
+    hash->table = calloc(base->events_size, sizeof(struct entry *));
     if (!hash->table)
         goto err;
 
+    hash->pool = pool_new(sizeof(struct entry), base->events_size);
+    if (!hash->pool)
+        goto err;
+
     hash->size = base->events_size;
-    base->events = hash;
 
     return 0;
 err:
@@ -83,24 +90,18 @@ int ev_hash_set(struct event_base *base, int fd, struct event *ev)
 
     while (p) {
         if (p->ev->fd == fd) {
-            free(p->ev);
             p->ev = ev;
             return 0;
         }
         p = p->next;
     }
 
-    n = calloc(1, sizeof(struct entry));
-    if (!n) {
-        pw_error("calloc");
+    n = pool_alloc(hash->pool);
+    if (!n)
         return -1;
-    }
 
     n->ev = ev;
-
-    p = hash->table[i];
-    if (p)
-        n->next = p;
+    n->next = hash->table[i];
 
     hash->table[i] = n;
 
@@ -120,15 +121,13 @@ int ev_hash_delete(struct event_base *base, int fd)
         if (c->ev->fd == fd) {
             if (p) {
                 p->next = c->next;
-                free(c->ev);
-                free(c);
+                pool_free(hash->pool, c);
             } else {
                 if (c->next)
                     hash->table[i] = c->next;
                 else
                     hash->table[i] = NULL;
-                free(c->ev);
-                free(c);
+                pool_free(hash->pool, c);
             }
             return 0;
         }
@@ -142,22 +141,12 @@ int ev_hash_delete(struct event_base *base, int fd)
 void ev_hash_destroy(struct event_base *base)
 {
     struct ev_hash *hash = base->events;
-    struct entry *p, *n;
-    int i;
 
+    /* entries live in the pool, the events are owned by event_base. */
     if (hash) {
-        if (hash->table) {
-            for (i = 0; i < hash->size; i++) {
-                p = hash->table[i];
-                while (p) {
-                    n = p->next;
-                    free(p->ev);
-                    free(p);
-                    p = n;
-                }
-            }
+        if (hash->table)
             free(hash->table);
-        }
+        pool_destroy(hash->pool);
         free(base->events);
         base->events = NULL;
     }
@@ -0,0 +1,275 @@
+/* ev_post.c */
+
+#include "ev_post.h"
+
+#include <sys/types.h>
+#ifdef __linux__
+#    include <sys/eventfd.h>
+#    include <sys/signalfd.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ev.h"
+#include "misc.h"
+
+/**
+ * Tasks of other threads reach a loop through base->posted, a lock-free
+ * stack producers push onto with CAS. The loop takes the whole stack with
+ * one exchange and runs it in posting order, so neither side ever waits.
+ * Only a push onto an empty stack writes to the wakeup fd.
+ */
+
+struct event_task {
+    struct event_task *next;
+    event_task_handler_t *fn;
+    void *arg;
+};
+
+struct ev_signals {
+    int fd; /* signalfd, or the read end of the self-pipe */
+#ifdef __linux__
+    sigset_t mask;
+#else
+    int pipe_wr;
+#endif
+    event_signal_handler_t *fn[NSIG];
+    void *arg[NSIG];
+};
+
+static void ev_post_read(struct event_base *base, int fd, uint16_t flags,
+                         void *data)
+{
+    struct event_task *list, *next, *fifo = NULL;
+    uint64_t buf[8];
+
+    /* reset the wakeup before taking the stack, a later post wakes again. */
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    list = __atomic_exchange_n(&base->posted, NULL, __ATOMIC_ACQUIRE);
+
+    /* newest first, reverse to run the tasks in posting order. */
+    while (list) {
+        next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while ((list = fifo)) {
+        fifo = list->next;
+        list->fn(base, list->arg);
+        free(list);
+    }
+}
+
+int ev_post_init(struct event_base *base)
+{
+#ifdef __linux__
+    base->post_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (base->post_fd[0] == -1) {
+        pw_error("eventfd");
+        return -1;
+    }
+    base->post_fd[1] = base->post_fd[0];
+#else
+    if (pipe(base->post_fd) == -1) {
+        pw_error("pipe");
+        return -1;
+    }
+    set_nonblocking(base->post_fd[0], 1);
+    set_nonblocking(base->post_fd[1], 1);
+#endif
+
+    if (event_base_add(base, base->post_fd[0], EV_READ, ev_post_read, NULL) ==
+        -1)
+        return -1;
+
+    event_base_unref(base, base->post_fd[0]);
+
+    return 0;
+}
+
+int event_base_post(struct event_base *base, event_task_handler_t *fn,
+                    void *arg)
+{
+    struct event_task *t, *head;
+    uint64_t one = 1;
+
+    t = malloc(sizeof(struct event_task));
+    if (!t) {
+        pw_error("malloc");
+        return -1;
+    }
+
+    t->fn = fn;
+    t->arg = arg;
+
+    head = __atomic_load_n(&base->posted, __ATOMIC_RELAXED);
+    do {
+        t->next = head;
+    } while (!__atomic_compare_exchange_n(&base->posted, &head, t, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* a full pipe or eventfd counter wakes the loop all the same. */
+    if (!head && write(base->post_fd[1], &one, sizeof(one)) == -1 &&
+        errno != EAGAIN) {
+        pw_error("write");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ev_signal_dispatch(struct event_base *base, int signo)
+{
+    struct ev_signals *s = base->signals;
+
+    if (signo > 0 && signo < NSIG && s->fn[signo])
+        s->fn[signo](base, signo, s->arg[signo]);
+}
+
+static void ev_signal_read(struct event_base *base, int fd, uint16_t flags,
+                           void *data)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+        ev_signal_dispatch(base, si.ssi_signo);
+#else
+    unsigned char c;
+
+    while (read(fd, &c, 1) == 1)
+        ev_signal_dispatch(base, c);
+#endif
+}
+
+#ifndef __linux__
+static int ev_signal_pipe = -1; /* write end, for the handler below */
+
+static void ev_signal_catch(int signo)
+{
+    unsigned char c = signo;
+    int saved = errno;
+
+    if (write(ev_signal_pipe, &c, 1) == -1) {
+        /* the pipe is full, the signal is coalesced like a pending one */
+    }
+    errno = saved;
+}
+#endif
+
+int event_base_signal(struct event_base *base, int signo,
+                      event_signal_handler_t *fn, void *arg)
+{
+    struct ev_signals *s = base->signals;
+#ifdef __linux__
+    int fd;
+#else
+    struct sigaction action = {};
+    int fds[2];
+#endif
+
+    if (signo <= 0 || signo >= NSIG || !fn)
+        return -1;
+
+    if (!s) {
+        s = calloc(1, sizeof(struct ev_signals));
+        if (!s) {
+            pw_error("calloc");
+            return -1;
+        }
+        s->fd = -1;
+#ifdef __linux__
+        sigemptyset(&s->mask);
+#else
+        s->pipe_wr = -1;
+#endif
+        base->signals = s;
+    }
+
+#ifdef __linux__
+    sigaddset(&s->mask, signo);
+
+    /* a blocked signal stays pending for signalfd to read. */
+    errno = pthread_sigmask(SIG_BLOCK, &s->mask, NULL);
+    if (errno != 0) {
+        pw_error("pthread_sigmask");
+        return -1;
+    }
+
+    fd = signalfd(s->fd, &s->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        pw_error("signalfd");
+        return -1;
+    }
+    s->fd = fd;
+#else
+    if (s->fd == -1) {
+        if (pipe(fds) == -1) {
+            pw_error("pipe");
+            return -1;
+        }
+        set_nonblocking(fds[0], 1);
+        set_nonblocking(fds[1], 1);
+        s->fd = fds[0];
+        s->pipe_wr = fds[1];
+    }
+
+    ev_signal_pipe = s->pipe_wr;
+
+    action.sa_handler = ev_signal_catch;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    if (sigaction(signo, &action, NULL) == -1) {
+        pw_error("sigaction");
+        return -1;
+    }
+#endif
+
+    s->fn[signo] = fn;
+    s->arg[signo] = arg;
+
+    if (event_base_add(base, s->fd, EV_READ, ev_signal_read, NULL) == -1)
+        return -1;
+
+    event_base_unref(base, s->fd);
+
+    return 0;
+}
+
+void ev_post_destroy(struct event_base *base)
+{
+    struct event_task *t;
+    struct ev_signals *s = base->signals;
+
+    while ((t = base->posted)) {
+        base->posted = t->next;
+        free(t);
+    }
+
+    if (base->post_fd[0] != -1)
+        close(base->post_fd[0]);
+    if (base->post_fd[1] != -1 && base->post_fd[1] != base->post_fd[0])
+        close(base->post_fd[1]);
+
+    if (s) {
+        if (s->fd != -1)
+            close(s->fd);
+#ifndef __linux__
+        if (s->pipe_wr != -1)
+            close(s->pipe_wr);
+#endif
+        free(s);
+        base->signals = NULL;
+    }
+}
@@ -0,0 +1,13 @@
+/* ev_post.h */
+
+#ifndef _PW_EV_POST_H
+#define _PW_EV_POST_H
+
+struct event_base;
+
+/* the wakeup fd of event_base_post, registered on base. */
+int ev_post_init(struct event_base *base);
+/* drop the tasks never run, close the wakeup and signal fds. */
+void ev_post_destroy(struct event_base *base);
+
+#endif /* ev_post.h */
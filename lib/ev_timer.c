@@ -0,0 +1,221 @@
+/* ev_timer.c */
+
+#include "ev_timer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "ev.h"
+
+/**
+ * Hierarchical timing wheel with a 1 ms tick. Level 0 has a slot per tick
+ * for the next 64 ms, every higher level has 64 slots each covering a whole
+ * rotation of the level below: 64 ms, 4 s, 4.4 min, 4.7 h and 12.4 days.
+ * Adding and cancelling is O(1), a timer is moved down a level at most once
+ * per level when the slot it sits in comes up (cascade).
+ */
+
+#define EV_WHEEL_BITS 6
+#define EV_WHEEL_SIZE (1 << EV_WHEEL_BITS)
+#define EV_WHEEL_MASK (EV_WHEEL_SIZE - 1)
+#define EV_WHEEL_LEVELS 5
+#define EV_WHEEL_MAX ((1ULL << (EV_WHEEL_BITS * EV_WHEEL_LEVELS)) - 1)
+
+struct ev_wheel {
+    uint64_t tick;  /* next tick to run */
+    uint32_t count; /* pending timers */
+    struct event_timer *slots[EV_WHEEL_LEVELS][EV_WHEEL_SIZE];
+};
+
+uint64_t ev_timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t ev_timer_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int ev_timer_new(struct event_base *base)
+{
+    struct ev_wheel *w;
+
+    w = calloc(1, sizeof(struct ev_wheel));
+    if (!w) {
+        pw_error("calloc");
+        return -1;
+    }
+
+    w->tick = ev_timer_now();
+    base->timers = w;
+
+    return 0;
+}
+
+static void ev_wheel_link(struct ev_wheel *w, struct event_timer *t)
+{
+    uint64_t delta;
+    struct event_timer **slot;
+    int level;
+
+    if (t->expire < w->tick)
+        t->expire = w->tick; /* late, runs on the next tick */
+
+    delta = t->expire - w->tick;
+    if (delta > EV_WHEEL_MAX) {
+        delta = EV_WHEEL_MAX;
+        t->expire = w->tick + delta;
+    }
+
+    for (level = 0; level < EV_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (EV_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    slot = &w->slots[level]
+                    [(t->expire >> (EV_WHEEL_BITS * level)) & EV_WHEEL_MASK];
+
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void ev_wheel_unlink(struct event_timer *t)
+{
+    if (t->next)
+        t->next->pprev = t->pprev;
+    *t->pprev = t->next;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void event_base_timer_add(struct event_base *base, struct event_timer *t,
+                          uint32_t ms, event_timer_handler_t *fn, void *data)
+{
+    struct ev_wheel *w = base->timers;
+
+    if (event_timer_pending(t))
+        event_base_timer_cancel(base, t);
+
+    t->fn = fn;
+    t->data = data;
+    t->expire = ev_timer_now() + ms;
+
+    ev_wheel_link(w, t);
+    w->count++;
+}
+
+void event_base_timer_cancel(struct event_base *base, struct event_timer *t)
+{
+    struct ev_wheel *w = base->timers;
+
+    if (event_timer_pending(t)) {
+        ev_wheel_unlink(t);
+        w->count--;
+    }
+}
+
+int64_t ev_timer_next(struct event_base *base, uint64_t now)
+{
+    struct ev_wheel *w = base->timers;
+    uint64_t pos, next = UINT64_MAX, when;
+    int level, k, first;
+
+    if (w->count == 0)
+        return -1;
+
+    /**
+     * The first occupied slot of each level, a timer in a higher level is
+     * due no earlier than the start of its slot, when it is cascaded. The
+     * current slot of a higher level was cascaded already, unless the next
+     * tick is the one to do it.
+     */
+    for (level = 0; level < EV_WHEEL_LEVELS; level++) {
+        pos = w->tick >> (EV_WHEEL_BITS * level);
+        first = level && (w->tick & ((1ULL << (EV_WHEEL_BITS * level)) - 1));
+        for (k = first; k <= EV_WHEEL_SIZE; k++) {
+            if (w->slots[level][(pos + k) & EV_WHEEL_MASK]) {
+                when = (pos + k) << (EV_WHEEL_BITS * level);
+                if (when < next)
+                    next = when;
+                break;
+            }
+        }
+    }
+
+    return (next > now) ? (int64_t)(next - now) : 0;
+}
+
+/* move the timers of a slot to the levels below. */
+static void ev_wheel_cascade(struct ev_wheel *w, int level)
+{
+    struct event_timer **slot, *t;
+
+    slot = &w->slots[level]
+                    [(w->tick >> (EV_WHEEL_BITS * level)) & EV_WHEEL_MASK];
+
+    while ((t = *slot)) {
+        ev_wheel_unlink(t);
+        ev_wheel_link(w, t);
+    }
+}
+
+int ev_timer_run(struct event_base *base, uint64_t now)
+{
+    struct ev_wheel *w = base->timers;
+    struct event_timer *expired, *t;
+    int level, n = 0;
+
+    /* nothing to walk through, skip the idle ticks. */
+    if (w->count == 0) {
+        if (now >= w->tick)
+            w->tick = now + 1;
+        return 0;
+    }
+
+    while (w->tick <= now) {
+        for (level = 1; level < EV_WHEEL_LEVELS; level++) {
+            if ((w->tick >> (EV_WHEEL_BITS * (level - 1))) & EV_WHEEL_MASK)
+                break;
+            ev_wheel_cascade(w, level);
+        }
+
+        /**
+         * Detach the slot and move on before the handlers run, a timer they
+         * add for this tick goes to the next one. They may still cancel any
+         * timer of the detached list.
+         */
+        expired = w->slots[0][w->tick & EV_WHEEL_MASK];
+        w->slots[0][w->tick & EV_WHEEL_MASK] = NULL;
+        if (expired)
+            expired->pprev = &expired;
+        w->tick++;
+
+        while ((t = expired)) {
+            ev_wheel_unlink(t);
+            w->count--;
+            t->fn(base, t->data);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+void ev_timer_destroy(struct event_base *base)
+{
+    free(base->timers);
+    base->timers = NULL;
+}
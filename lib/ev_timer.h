@@ -0,0 +1,21 @@
+/* ev_timer.h */
+
+#ifndef _PW_EV_TIMER_H
+#define _PW_EV_TIMER_H
+
+#include <stdint.h>
+
+struct event_base;
+
+/* milliseconds of CLOCK_MONOTONIC, the time base of all timers. */
+uint64_t ev_timer_now(void);
+/* the same clock in microseconds. */
+uint64_t ev_timer_now_us(void);
+int ev_timer_new(struct event_base *base);
+/* ms until the wheel needs to run again, -1 without timers. */
+int64_t ev_timer_next(struct event_base *base, uint64_t now);
+/* fire the timers expired by now, returns their number. */
+int ev_timer_run(struct event_base *base, uint64_t now);
+void ev_timer_destroy(struct event_base *base);
+
+#endif /* ev_timer.h */
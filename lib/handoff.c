@@ -0,0 +1,238 @@
+/* handoff.c */
+
+#include "handoff.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "misc.h"
+
+/* a cache line per worker, publishing does not disturb the readers. */
+struct handoff_slot {
+    struct handoff_load load;
+    char pad[64 - sizeof(struct handoff_load)];
+};
+
+struct handoff {
+    size_t size; /* of the mapping */
+    uint32_t n;
+    int (*fds)[2]; /* [0] receives, [1] sends, per worker */
+    struct handoff_slot slots[];
+};
+
+struct handoff *handoff_new(uint32_t n)
+{
+    struct handoff *h;
+    size_t size;
+    uint32_t i;
+
+    size = sizeof(struct handoff) + n * sizeof(struct handoff_slot);
+
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+             -1, 0);
+    if (h == MAP_FAILED) {
+        pw_error("mmap");
+        return NULL;
+    }
+
+    h->size = size;
+    h->n = n;
+
+    /* not shared, the fds are inherited and the same in every process. */
+    h->fds = calloc(n, sizeof(int[2]));
+    if (!h->fds) {
+        pw_error("calloc");
+        goto err;
+    }
+
+    for (i = 0; i < n; i++)
+        h->fds[i][0] = h->fds[i][1] = -1;
+
+    for (i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, h->fds[i]) == -1) {
+            pw_error("socketpair");
+            goto err;
+        }
+        set_nonblocking(h->fds[i][0], 1);
+        set_nonblocking(h->fds[i][1], 1);
+        /* a master exec'ing its upgrade keeps only the listeners */
+        fcntl(h->fds[i][0], F_SETFD, FD_CLOEXEC);
+        fcntl(h->fds[i][1], F_SETFD, FD_CLOEXEC);
+    }
+
+    return h;
+err:
+    handoff_destroy(h);
+    return NULL;
+}
+
+int handoff_fd(struct handoff *h, uint32_t i)
+{
+    return h->fds[i][0];
+}
+
+void handoff_publish(struct handoff *h, uint32_t i, uint32_t conns,
+                     uint32_t queue)
+{
+    struct handoff_load *l = &h->slots[i].load;
+
+    __atomic_store_n(&l->conns, conns, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->queue, queue, __ATOMIC_RELAXED);
+}
+
+void handoff_alive(struct handoff *h, uint32_t i, int alive)
+{
+    __atomic_store_n(&h->slots[i].load.alive, alive, __ATOMIC_RELAXED);
+}
+
+static uint32_t handoff_weight(const struct handoff_load *l)
+{
+    return __atomic_load_n(&l->conns, __ATOMIC_RELAXED) +
+           __atomic_load_n(&l->queue, __ATOMIC_RELAXED);
+}
+
+int handoff_pick(struct handoff *h, uint32_t i)
+{
+    uint32_t j, w, self, min = UINT32_MAX;
+    int to = -1;
+
+    self = handoff_weight(&h->slots[i].load);
+    if (self < HANDOFF_SLACK)
+        return -1;
+
+    for (j = 0; j < h->n; j++) {
+        if (j == i || !__atomic_load_n(&h->slots[j].load.alive,
+                                       __ATOMIC_RELAXED))
+            continue;
+        w = handoff_weight(&h->slots[j].load);
+        if (w < min) {
+            min = w;
+            to = j;
+        }
+    }
+
+    /* a quarter over the least loaded, not to bounce conns back and forth. */
+    if (to == -1 || self < min + min / 4 + HANDOFF_SLACK)
+        return -1;
+
+    return to;
+}
+
+int handoff_send(struct handoff *h, uint32_t i, uint32_t to, int fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t from = i;
+
+    iov.iov_base = &from;
+    iov.iov_len = sizeof(from);
+
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(h->fds[to][1], &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            pw_error("sendmsg");
+        return -1;
+    }
+
+    /* counts for to until it publishes again, spreads a burst of handoffs. */
+    __atomic_add_fetch(&h->slots[to].load.queue, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int handoff_recv(struct handoff *h, uint32_t i)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {};
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t from;
+    int fd = -1, flags = 0;
+    ssize_t n;
+
+#ifdef __linux__
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+
+    iov.iov_base = &from;
+    iov.iov_len = sizeof(from);
+
+    for (;;) {
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        n = recvmsg(h->fds[i][0], &msg, flags);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                pw_error("recvmsg");
+            return -1;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            break;
+        }
+        /* no fd attached, nothing to take over, try the next one */
+    }
+
+    /* O_NONBLOCK is a file status flag, it travels with the fd. */
+#ifndef __linux__
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+    return fd;
+}
+
+void handoff_destroy(struct handoff *h)
+{
+    uint32_t i;
+
+    if (!h)
+        return;
+
+    if (h->fds) {
+        for (i = 0; i < h->n; i++) {
+            if (h->fds[i][0] != -1)
+                close(h->fds[i][0]);
+            if (h->fds[i][1] != -1)
+                close(h->fds[i][1]);
+        }
+        free(h->fds);
+    }
+
+    munmap(h, h->size);
+}
@@ -0,0 +1,43 @@
+/* handoff.h */
+
+#ifndef _PW_HANDOFF_H
+#define _PW_HANDOFF_H
+
+#include <stdint.h>
+
+/* conns over the least loaded sibling before a worker hands off at all. */
+#define HANDOFF_SLACK 16
+
+/* load figures a worker publishes, read by all of them. */
+struct handoff_load {
+    uint32_t conns;    /* events registered, about two per conn */
+    uint32_t queue;    /* events ready on the last wakeup */
+    uint32_t alive;    /* the worker is running and takes conns */
+};
+
+struct handoff;
+
+/**
+ * Load table of n workers in an anonymous shared mapping, and a datagram
+ * socket per worker to pass it accepted conns with SCM_RIGHTS. Create it
+ * before fork(2), every process may then hand a conn to any worker.
+ */
+struct handoff *handoff_new(uint32_t n);
+/* the socket worker i receives conns on. */
+int handoff_fd(struct handoff *h, uint32_t i);
+void handoff_publish(struct handoff *h, uint32_t i, uint32_t conns,
+                     uint32_t queue);
+/* mark worker i as (not) taking conns. */
+void handoff_alive(struct handoff *h, uint32_t i, int alive);
+/* the worker i should hand a new conn to, -1 to keep it. */
+int handoff_pick(struct handoff *h, uint32_t i);
+/**
+ * Pass fd from worker i to worker to, the caller closes its copy after.
+ * Returns -1 with a full socket too, the conn stays with the caller.
+ */
+int handoff_send(struct handoff *h, uint32_t i, uint32_t to, int fd);
+/* a conn handed to worker i, -1 with errno EAGAIN when none is left. */
+int handoff_recv(struct handoff *h, uint32_t i);
+void handoff_destroy(struct handoff *h);
+
+#endif /* handoff.h */
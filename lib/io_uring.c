@@ -0,0 +1,333 @@
+/* io_uring.c */
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ev.h"
+#include "debug.h"
+
+/**
+ * Readiness backend on top of io_uring multishot poll. Interest changes
+ * are queued as SQEs and submitted together with the wait for completions
+ * in a single io_uring_enter, instead of one epoll_ctl per change.
+ *
+ * Every armed poll holds a reference on its struct event (ev->count), a
+ * deleted event is only freed after the kernel posted the final CQE of
+ * its poll, see ev_free_closed.
+ */
+
+struct uring_op {
+    int fd;
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit; /* queued SQEs not yet seen by the kernel */
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* mappings */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+int op_init(struct event_base *base);
+int op_add(struct event_base *base, struct event *ev, uint16_t flags);
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags);
+int op_modify(struct event_base *base, struct event *ev);
+int op_poll_wait(struct event_base *base, const struct timeval *tv);
+int op_destroy(struct event_base *base);
+void ev_active(struct event_base *base, struct event *ev, uint16_t flags);
+
+static int uring_enter(struct uring_op *op, unsigned min_complete,
+                       const struct timeval *tv);
+
+static inline uint32_t uring_poll_mask(uint16_t flags)
+{
+    uint32_t mask = 0;
+
+    if (flags & EV_READ)
+        mask |= POLLIN;
+    if (flags & EV_WRITE)
+        mask |= POLLOUT;
+
+    return mask;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_op *op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    /* the ring is full, hand the queued SQEs to the kernel first. */
+    if (op->to_submit == op->sq_entries && uring_enter(op, 0, NULL) == -1)
+        return NULL;
+
+    tail = *op->sq_tail;
+    idx = tail & *op->sq_mask;
+    sqe = &op->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    op->sq_array[idx] = idx;
+    __atomic_store_n(op->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    op->to_submit++;
+
+    return sqe;
+}
+
+static int uring_poll_add(struct uring_op *op, struct event *ev)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(op);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ev->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = uring_poll_mask(ev->flags);
+    sqe->user_data = (uint64_t)(uintptr_t)ev;
+
+    ev->count++; /* released by the final CQE of this poll */
+
+    return 0;
+}
+
+/* update the mask of the armed poll of ev, or remove it for EV_NONE. */
+static int uring_poll_update(struct uring_op *op, struct event *ev)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(op);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ev;
+    sqe->user_data = 0; /* the completion of the update itself is ignored */
+
+    if (ev->flags != EV_NONE) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = uring_poll_mask(ev->flags);
+    }
+
+    return 0;
+}
+
+int op_init(struct event_base *base)
+{
+    struct io_uring_params p = {};
+    struct uring_op *op;
+    char *sq, *cq;
+
+    op = calloc(1, sizeof(struct uring_op));
+    if (!op) {
+        pw_error("calloc");
+        return -1;
+    }
+
+    op->fd = -1;
+    base->op = op;
+
+    op->fd = syscall(__NR_io_uring_setup, base->events_size, &p);
+    if (op->fd == -1) {
+        pw_error("io_uring_setup");
+        goto err;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        pw_debug("io_uring without IORING_FEAT_EXT_ARG is not supported\n");
+        goto err;
+    }
+
+    op->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    op->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    op->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    op->sq_ring = mmap(NULL, op->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, op->fd, IORING_OFF_SQ_RING);
+    if (op->sq_ring == MAP_FAILED) {
+        op->sq_ring = NULL;
+        pw_error("mmap");
+        goto err;
+    }
+
+    op->cq_ring = mmap(NULL, op->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, op->fd, IORING_OFF_CQ_RING);
+    if (op->cq_ring == MAP_FAILED) {
+        op->cq_ring = NULL;
+        pw_error("mmap");
+        goto err;
+    }
+
+    op->sqes = mmap(NULL, op->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, op->fd, IORING_OFF_SQES);
+    if (op->sqes == MAP_FAILED) {
+        op->sqes = NULL;
+        pw_error("mmap");
+        goto err;
+    }
+
+    sq = op->sq_ring;
+    op->sq_head = (unsigned *)(sq + p.sq_off.head);
+    op->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    op->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    op->sq_array = (unsigned *)(sq + p.sq_off.array);
+    op->sq_entries = p.sq_entries;
+
+    cq = op->cq_ring;
+    op->cq_head = (unsigned *)(cq + p.cq_off.head);
+    op->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    op->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    op->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+err:
+    op_destroy(base);
+    return -1;
+}
+
+/* ev is new, flags are all of ev->flags. */
+int op_add(struct event_base *base, struct event *ev, uint16_t flags)
+{
+    return uring_poll_add(base->op, ev);
+}
+
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags)
+{
+    return uring_poll_update(base->op, ev);
+}
+
+int op_modify(struct event_base *base, struct event *ev)
+{
+    return uring_poll_update(base->op, ev);
+}
+
+static int uring_enter(struct uring_op *op, unsigned min_complete,
+                       const struct timeval *tv)
+{
+    struct io_uring_getevents_arg arg = {};
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    int ret;
+
+    if (min_complete)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    if (tv) {
+        ts.tv_sec = tv->tv_sec;
+        ts.tv_nsec = tv->tv_usec * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+again:
+    ret = syscall(__NR_io_uring_enter, op->fd, op->to_submit, min_complete,
+                  flags, &arg, sizeof(arg));
+    if (ret == -1) {
+        if (errno == EINTR)
+            goto again;
+        if (errno == ETIME) {
+            op->to_submit = 0; /* submission happens before the wait */
+            return 0;
+        }
+        pw_error("io_uring_enter");
+        return -1;
+    }
+
+    op->to_submit -= ret;
+
+    return 0;
+}
+
+int op_poll_wait(struct event_base *base, const struct timeval *tv)
+{
+    struct uring_op *op = base->op;
+    struct io_uring_cqe *cqe;
+    struct event *ev;
+    unsigned head, tail;
+    uint16_t flags;
+    int n = 0;
+
+    /* submit the queued changes and wait in the same syscall. */
+    if (uring_enter(op, 1, tv) == -1)
+        return -1;
+
+    head = *op->cq_head;
+    tail = __atomic_load_n(op->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        cqe = &op->cqes[head & *op->cq_mask];
+        ev = (struct event *)(uintptr_t)cqe->user_data;
+
+        if (!ev) /* completion of a poll update or remove */
+            continue;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            /* the poll is gone, re-arm it if ev is still wanted. */
+            ev->count--;
+            if (cqe->res != -ECANCELED && ev->fd != -1 &&
+                ev->flags != EV_NONE && uring_poll_add(op, ev) == 0)
+                ev->kflags = ev->flags; /* a queued change is moot */
+        }
+
+        if (cqe->res <= 0)
+            continue;
+
+        flags = EV_NONE;
+        if (cqe->res & (POLLIN | POLLHUP | POLLERR))
+            flags |= EV_READ;
+        if (cqe->res & (POLLOUT | POLLHUP | POLLERR))
+            flags |= EV_WRITE;
+
+        /* the CQ slot is released before the handler runs. */
+        __atomic_store_n(op->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        ev_active(base, ev, flags);
+        n++;
+    }
+
+    __atomic_store_n(op->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+int op_destroy(struct event_base *base)
+{
+    struct uring_op *op = base->op;
+
+    if (op) {
+        if (op->sqes)
+            munmap(op->sqes, op->sqes_size);
+        if (op->cq_ring)
+            munmap(op->cq_ring, op->cq_ring_size);
+        if (op->sq_ring)
+            munmap(op->sq_ring, op->sq_ring_size);
+        if (op->fd != -1)
+            close(op->fd);
+        free(op);
+        base->op = NULL;
+    }
+    return 0;
+}
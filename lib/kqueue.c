@@ -8,23 +8,26 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <assert.h>
 
 #include "ev.h"
 #include "debug.h"
-#include "ev_hash.h"
 
 struct kqueue_op {
     struct kevent *events;
     uint32_t events_size;
+    struct kevent *changes; /* submitted with the next wait */
+    uint32_t nchanges;
+    uint32_t changes_size;
     int kq;
 };
 
 int op_init(struct event_base *base);
-int op_add(struct event_base *base, int fd, uint16_t flags);
-int op_delete(struct event_base *base, int fd, uint16_t flags);
+int op_add(struct event_base *base, struct event *ev, uint16_t flags);
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags);
+int op_modify(struct event_base *base, struct event *ev);
 int op_poll_wait(struct event_base *base, const struct timeval *tv);
 int op_destroy(struct event_base *base);
+void ev_active(struct event_base *base, struct event *ev, uint16_t flags);
 
 int op_init(struct event_base *base)
 {
@@ -60,21 +63,23 @@ err:
     return -1;
 }
 
-int op_add(struct event_base *base, int fd, uint16_t flags)
+/* ev is new, flags are all of ev->flags. */
+int op_add(struct event_base *base, struct event *ev, uint16_t flags)
 {
     struct kqueue_op *op = base->op;
-    uint16_t mask = 0;
-    struct kevent ke;
+    struct kevent ke[2];
+    int n = 0;
 
+    /* kqueue filters are not a bit mask, each one is a separate change. */
     if (flags & EV_READ)
-        mask |= EVFILT_READ;
+        EV_SET(&ke[n++], ev->fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR,
+               0, 0, ev);
 
     if (flags & EV_WRITE)
-        mask |= EVFILT_WRITE;
+        EV_SET(&ke[n++], ev->fd, EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_CLEAR,
+               0, 0, ev);
 
-    EV_SET(&ke, fd, mask, EV_ADD | EV_ENABLE, 0, 0, NULL);
-
-    if (kevent(op->kq, &ke, 1, NULL, 0, NULL) == -1) {
+    if (kevent(op->kq, ke, n, NULL, 0, NULL) == -1) {
         pw_error("kevent");
         return -1;
     }
@@ -82,21 +87,20 @@ int op_add(struct event_base *base, int fd, uint16_t flags)
     return 0;
 }
 
-int op_delete(struct event_base *base, int fd, uint16_t flags)
+/* nothing is left of ev->flags, the filters still registered go. */
+int op_delete(struct event_base *base, struct event *ev, uint16_t flags)
 {
     struct kqueue_op *op = base->op;
-    uint16_t mask = 0;
-    struct kevent ke;
+    struct kevent ke[2];
+    int n = 0;
 
-    if (flags & EV_READ)
-        mask |= EVFILT_READ;
+    if (ev->kflags & EV_READ)
+        EV_SET(&ke[n++], ev->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
 
-    if (flags & EV_WRITE)
-        mask |= EVFILT_WRITE;
+    if (ev->kflags & EV_WRITE)
+        EV_SET(&ke[n++], ev->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
 
-    EV_SET(&ke, fd, mask, EV_DELETE | EV_DISABLE, 0, 0, NULL);
-
-    if (kevent(op->kq, &ke, 1, NULL, 0, NULL) == -1) {
+    if (kevent(op->kq, ke, n, NULL, 0, NULL) == -1) {
         pw_error("kevent");
         return -1;
     }
@@ -104,13 +108,52 @@ int op_delete(struct event_base *base, int fd, uint16_t flags)
     return 0;
 }
 
+/* queue the filters that changed, they go with the wait in one kevent. */
+int op_modify(struct event_base *base, struct event *ev)
+{
+    struct kqueue_op *op = base->op;
+    struct kevent *changes;
+    uint16_t add = ev->flags & ~ev->kflags, del = ev->kflags & ~ev->flags;
+    uint32_t size;
+
+    /* EV_ADD of a registered filter checks it again, see event_base_rearm */
+    if (ev->rearm)
+        add = ev->flags;
+
+    if (op->nchanges + 2 > op->changes_size) {
+        size = op->changes_size ? op->changes_size * 2 : 64;
+        changes = realloc(op->changes, size * sizeof(struct kevent));
+        if (!changes) {
+            pw_error("realloc");
+            return -1;
+        }
+        op->changes = changes;
+        op->changes_size = size;
+    }
+
+    if (add & EV_READ)
+        EV_SET(&op->changes[op->nchanges++], ev->fd, EVFILT_READ,
+               EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, ev);
+    if (add & EV_WRITE)
+        EV_SET(&op->changes[op->nchanges++], ev->fd, EVFILT_WRITE,
+               EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, ev);
+    if (del & EV_READ)
+        EV_SET(&op->changes[op->nchanges++], ev->fd, EVFILT_READ, EV_DELETE,
+               0, 0, NULL);
+    if (del & EV_WRITE)
+        EV_SET(&op->changes[op->nchanges++], ev->fd, EVFILT_WRITE, EV_DELETE,
+               0, 0, NULL);
+
+    return 0;
+}
+
 int op_poll_wait(struct event_base *base, const struct timeval *tv)
 {
     struct kqueue_op *op = base->op;
     struct timespec timeout = {}, *tp = NULL;
-    struct event *ev;
+    struct kevent *ke;
     int nev, i;
-    uint16_t flags = 0;
+    uint16_t flags;
 
     if (tv) {
         timeout.tv_sec = tv->tv_sec;
@@ -119,7 +162,10 @@ int op_poll_wait(struct event_base *base, const struct timeval *tv)
     }
 
 again:
-    nev = kevent(op->kq, NULL, 0, op->events, op->events_size, tp);
+    nev = kevent(op->kq, op->changes, op->nchanges, op->events,
+                 op->events_size, tp);
+    /* applied, also when interrupted. A failed one comes as EV_ERROR. */
+    op->nchanges = 0;
     if (nev == -1) {
         if (errno == EINTR)
             goto again;
@@ -128,19 +174,19 @@ again:
     }
 
     for (i = 0; i < nev; i++) {
-        if (op->events[i].flags == EV_ERROR) {
+        ke = &op->events[i];
+        if (ke->flags & EV_ERROR) {
             /* TODO */
             continue;
         }
-        ev = ev_hash_get(base, op->events[i].ident);
-        assert(ev);
-        if (op->events[i].filter == EVFILT_READ) {
-            flags |= EV_READ;
-        }
-        if (op->events[i].filter == EVFILT_WRITE) {
-            flags |= EV_WRITE;
-        }
-        ev->fn(base, ev->fd, ev->flags, ev->data);
+
+        flags = EV_NONE;
+        if (ke->filter == EVFILT_READ)
+            flags = EV_READ;
+        else if (ke->filter == EVFILT_WRITE)
+            flags = EV_WRITE;
+
+        ev_active(base, (struct event *)ke->udata, flags);
     }
 
     return nev;
@@ -153,6 +199,7 @@ int op_destroy(struct event_base *base)
     if (op) {
         if (op->events)
             free(op->events);
+        free(op->changes);
         if (op->kq != -1)
             close(op->kq);
         free(op);
@@ -2,6 +2,9 @@
 
 #include "misc.h"
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -32,6 +35,97 @@ int set_nonblocking(int fd, int nonblocking)
     return 0;
 }
 
+int tcp_listen(const char *host, uint16_t port)
+{
+    struct sockaddr_storage ss;
+    socklen_t len;
+    int fd, opt = 1;
+
+    if (tcp_addr(host, port, &ss, &len) == -1) {
+        pw_debug("invalid host %s\n", host);
+        return -1;
+    }
+
+    fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        pw_error("socket");
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&opt, sizeof(opt));
+
+    if (bind(fd, (struct sockaddr *)&ss, len) == -1) {
+        pw_error("bind");
+        goto err;
+    }
+
+    if (listen(fd, SOMAXCONN) == -1) {
+        pw_error("listen");
+        goto err;
+    }
+
+    if (set_nonblocking(fd, 1) == -1)
+        goto err;
+
+    return fd;
+err:
+    close(fd);
+    return -1;
+}
+
+int tcp_addr(const char *host, uint16_t port, struct sockaddr_storage *ss,
+             socklen_t *len)
+{
+    struct sockaddr_in *si = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *si6 = (struct sockaddr_in6 *)ss;
+
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+
+    if (strchr(host, ':')) {
+        si6->sin6_family = AF_INET6;
+        si6->sin6_port = htons(port);
+        *len = sizeof(struct sockaddr_in6);
+        return inet_pton(AF_INET6, host, &si6->sin6_addr) == 1 ? 0 : -1;
+    }
+
+    si->sin_family = AF_INET;
+    si->sin_port = htons(port);
+    *len = sizeof(struct sockaddr_in);
+    return inet_pton(AF_INET, host, &si->sin_addr) == 1 ? 0 : -1;
+}
+
+int tcp_bound(int fd, const char *host, uint16_t port)
+{
+    struct sockaddr_storage want, ss;
+    struct sockaddr_in *a = (struct sockaddr_in *)&want;
+    struct sockaddr_in *b = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&want;
+    struct sockaddr_in6 *b6 = (struct sockaddr_in6 *)&ss;
+    socklen_t len = sizeof(ss), optlen = sizeof(int);
+    int opt = 0;
+
+    if (tcp_addr(host, port, &want, &len) == -1)
+        return 0;
+
+    len = sizeof(ss);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &opt, &optlen) == -1 ||
+        getsockname(fd, (struct sockaddr *)&ss, &len) == -1) {
+        pw_error("getsockname");
+        return 0;
+    }
+
+    if (!opt || ss.ss_family != want.ss_family)
+        return 0;
+
+    if (ss.ss_family == AF_INET6)
+        return a6->sin6_port == b6->sin6_port &&
+               memcmp(&a6->sin6_addr, &b6->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+
+    return a->sin_port == b->sin_port &&
+           a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
 void daemonize(void)
 {
     pid_t pid;
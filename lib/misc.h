@@ -3,7 +3,17 @@
 #ifndef _PW_MISC_H
 #define _PW_MISC_H
 
+#include <sys/socket.h>
+#include <stdint.h>
+
 int set_nonblocking (int fd, int nonblocking);
+/* a non-blocking listening TCP socket on host:port. */
+int tcp_listen (const char *host, uint16_t port);
+/* the address of host:port, an IPv6 host when it has a ':'. */
+int tcp_addr (const char *host, uint16_t port, struct sockaddr_storage *ss,
+              socklen_t *len);
+/* 1 if fd listens on exactly host:port, 0 if not or on error. */
+int tcp_bound (int fd, const char *host, uint16_t port);
 void daemonize (void);
 
 #endif /* misc.h */
@@ -0,0 +1,117 @@
+/* pool.c */
+
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "debug.h"
+
+#define POOL_ALIGN 16
+
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+/* keep the objects behind the slab header aligned. */
+#define POOL_SLAB_HDR \
+    ((sizeof(struct pool_slab) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+static int pool_grow(struct pool *p)
+{
+    struct pool_slab *slab;
+
+    slab = malloc(POOL_SLAB_HDR + p->size * p->count);
+    if (!slab) {
+        pw_error("malloc");
+        return -1;
+    }
+
+    slab->next = p->slabs;
+    p->slabs = slab;
+
+    /**
+     * Objects are handed out from the slab as needed instead of being
+     * threaded onto the freelist here, so large objects do not fault in
+     * every page of the slab up front.
+     */
+    p->fresh = (char *)slab + POOL_SLAB_HDR;
+    p->left = p->count;
+
+    return 0;
+}
+
+struct pool *pool_new(size_t size, uint32_t count)
+{
+    struct pool *p;
+
+    p = calloc(1, sizeof(struct pool));
+    if (!p) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    p->count = count ? count : 1;
+
+    if (pool_grow(p) == -1) {
+        free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+void *pool_alloc(struct pool *p)
+{
+    void *obj;
+
+    if (p->free) {
+        obj = p->free;
+        p->free = *(void **)obj;
+        p->hits++;
+    } else {
+        /* a never used object of the newest slab is neither */
+        if (p->left == 0) {
+            p->misses++;
+            if (pool_grow(p) == -1)
+                return NULL;
+        }
+        obj = p->fresh;
+        p->fresh += p->size;
+        p->left--;
+    }
+
+    if (++p->used > p->high)
+        p->high = p->used;
+
+    return obj;
+}
+
+void pool_free(struct pool *p, void *ptr)
+{
+    if (!ptr)
+        return;
+
+    *(void **)ptr = p->free;
+    p->free = ptr;
+    p->used--;
+}
+
+void pool_destroy(struct pool *p)
+{
+    struct pool_slab *slab;
+
+    if (p) {
+        while (p->slabs) {
+            slab = p->slabs;
+            p->slabs = slab->next;
+            free(slab);
+        }
+        free(p);
+    }
+}
@@ -0,0 +1,36 @@
+/* pool.h */
+
+#ifndef _PW_POOL_H
+#define _PW_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool_slab;
+
+/**
+ * Fixed-size object pool. Objects are carved out of slabs of `count`
+ * objects on demand and recycled through a freelist; slabs are only
+ * released by pool_destroy. A pool is not thread safe, every worker owns
+ * its own.
+ */
+struct pool {
+    struct pool_slab *slabs;
+    void *free;      /* freelist of released objects */
+    char *fresh;     /* never used objects of the newest slab */
+    uint32_t left;   /* number of objects at fresh */
+    size_t size;     /* object size, rounded up for alignment */
+    uint32_t count;  /* objects per slab */
+    uint64_t hits;   /* allocations served from the freelist */
+    uint64_t misses; /* allocations that needed a new slab */
+    uint32_t used;   /* objects currently handed out */
+    uint32_t high;   /* high-water mark of used */
+};
+
+struct pool *pool_new(size_t size, uint32_t count);
+/* the returned object is not zeroed. */
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *ptr);
+void pool_destroy(struct pool *p);
+
+#endif /* pool.h */
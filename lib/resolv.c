@@ -0,0 +1,775 @@
+/* resolv.c */
+
+#include "resolv.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "debug.h"
+#include "ev.h"
+#include "misc.h"
+#include "pool.h"
+
+#define RESOLV_TIMEOUT 2000 /* ms per try, options timeout: */
+#define RESOLV_ATTEMPTS 2   /* rounds over all servers, options attempts: */
+#define RESOLV_PACKET 1500  /* receive buffer, answers are at most 512 */
+
+/**
+ * +----+-------+---------+---------+---------+---------+
+ * | ID | FLAGS | QDCOUNT | ANCOUNT | NSCOUNT | ARCOUNT |
+ * +----+-------+---------+---------+---------+---------+
+ * | 2  |   2   |    2    |    2    |    2    |    2    |
+ * +----+-------+---------+---------+---------+---------+
+ */
+#define DNS_HDR_SIZE 12
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_MASK 0x000f
+#define DNS_CLASS_IN 1
+
+enum {
+    DNS_NOERROR = 0,
+    DNS_FORMERR = 1,
+    DNS_SERVFAIL = 2,
+    DNS_NXDOMAIN = 3,
+};
+
+struct resolv_host {
+    struct resolv_host *next;
+    struct resolv_addr addr;
+    char name[RESOLV_MAX_NAME + 1];
+};
+
+/* a UDP socket, open until the queries sent from it are done. */
+struct resolv_sock {
+    struct resolv *r;
+    int fd;
+    uint32_t sent;    /* queries sent, it is retired at RESOLV_ROTATE */
+    uint32_t pending; /* queries whose answer is due on it */
+};
+
+struct resolv_query {
+    struct resolv_query *prev; /* pending list, ordered by deadline */
+    struct resolv_query *next;
+    struct resolv_sock *sock; /* sent from, NULL if the send failed */
+    uint64_t deadline;        /* ms, see resolv_now */
+    resolv_cb_t *cb;
+    void *arg;
+    uint16_t id;
+    uint16_t type;
+    uint8_t server; /* nameserver asked last */
+    uint8_t tries;
+    char name[RESOLV_MAX_NAME + 1];
+};
+
+struct resolv {
+    struct event_base *base;
+    struct sockaddr_storage ns[RESOLV_MAX_NS];
+    socklen_t ns_len[RESOLV_MAX_NS];
+    uint8_t ns_count;
+    uint8_t attempts;
+    uint32_t timeout;
+    struct resolv_sock *sock4; /* current sockets, created on first use */
+    struct resolv_sock *sock6;
+    struct event_timer timer; /* deadline of the oldest pending query */
+    struct resolv_query *head;
+    struct resolv_query *tail;
+    struct resolv_query **ids; /* pending queries by DNS id */
+    struct resolv_host *hosts;
+    struct pool *pool;
+    uint32_t seed;
+};
+
+static void resolv_read(struct event_base *base, int fd, uint16_t flags,
+                        void *data);
+static void resolv_timeout(struct event_base *base, void *data);
+static void resolv_retry(struct resolv *r, struct resolv_query *q);
+
+static uint64_t resolv_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t resolv_rand(struct resolv *r)
+{
+    /* xorshift32, DNS ids only need to be hard to guess off-path. */
+    r->seed ^= r->seed << 13;
+    r->seed ^= r->seed >> 17;
+    r->seed ^= r->seed << 5;
+    return r->seed >> 16;
+}
+
+/* arm the timer for the oldest pending query. */
+static void resolv_arm(struct resolv *r)
+{
+    uint64_t now, ms = 0;
+
+    if (!r->head) {
+        event_base_timer_cancel(r->base, &r->timer);
+        return;
+    }
+
+    now = resolv_now();
+    if (r->head->deadline > now)
+        ms = r->head->deadline - now;
+
+    event_base_timer_add(r->base, &r->timer, ms, resolv_timeout, r);
+}
+
+static void resolv_link(struct resolv *r, struct resolv_query *q)
+{
+    q->next = NULL;
+    q->prev = r->tail;
+    if (r->tail)
+        r->tail->next = q;
+    else
+        r->head = q;
+    r->tail = q;
+}
+
+static void resolv_unlink(struct resolv *r, struct resolv_query *q)
+{
+    if (q->prev)
+        q->prev->next = q->next;
+    else
+        r->head = q->next;
+    if (q->next)
+        q->next->prev = q->prev;
+    else
+        r->tail = q->prev;
+    q->prev = q->next = NULL;
+}
+
+/* the kernel binds it to a random ephemeral port on the first send. */
+static struct resolv_sock *resolv_socket(struct resolv *r, int family)
+{
+    struct resolv_sock *s;
+
+    s = calloc(1, sizeof(struct resolv_sock));
+    if (!s) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    s->r = r;
+    s->fd = socket(family, SOCK_DGRAM, 0);
+    if (s->fd == -1) {
+        pw_error("socket");
+        free(s);
+        return NULL;
+    }
+
+    set_nonblocking(s->fd, 1);
+
+    if (event_base_add(r->base, s->fd, EV_READ, resolv_read, s) == -1) {
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+
+    /* an idle resolver does not keep a draining worker alive. */
+    event_base_unref(r->base, s->fd);
+
+    return s;
+}
+
+static void resolv_socket_close(struct resolv_sock *s)
+{
+    event_base_delete(s->r->base, s->fd, EV_READ);
+    close(s->fd);
+    free(s);
+}
+
+/* the socket of family to send a query from, a new one once it is used up. */
+static struct resolv_sock *resolv_socket_get(struct resolv *r, int family)
+{
+    struct resolv_sock **cur = (family == AF_INET) ? &r->sock4 : &r->sock6;
+    struct resolv_sock *s = *cur;
+
+    if (s && s->sent < RESOLV_ROTATE)
+        return s;
+
+    s = resolv_socket(r, family);
+    if (!s)
+        return *cur; /* keep using the old port rather than fail */
+
+    /* the retired one is closed when its last answer is in */
+    if (*cur && (*cur)->pending == 0)
+        resolv_socket_close(*cur);
+    *cur = s;
+
+    return s;
+}
+
+static void resolv_socket_release(struct resolv *r, struct resolv_sock *s)
+{
+    if (--s->pending == 0 && s != r->sock4 && s != r->sock6)
+        resolv_socket_close(s);
+}
+
+/* the query no longer waits for an answer on the socket it was sent from. */
+static void resolv_socket_put(struct resolv *r, struct resolv_query *q)
+{
+    if (q->sock) {
+        resolv_socket_release(r, q->sock);
+        q->sock = NULL;
+    }
+}
+
+int resolv_add_nameserver(struct resolv *r, const char *ip, uint16_t port)
+{
+    struct sockaddr_in *si;
+    struct sockaddr_in6 *si6;
+    int i = r->ns_count;
+
+    if (i == RESOLV_MAX_NS)
+        return -1;
+
+    memset(&r->ns[i], 0, sizeof(r->ns[i]));
+    si = (struct sockaddr_in *)&r->ns[i];
+    si6 = (struct sockaddr_in6 *)&r->ns[i];
+
+    if (inet_pton(AF_INET, ip, &si->sin_addr) == 1) {
+        si->sin_family = AF_INET;
+        si->sin_port = htons(port);
+        r->ns_len[i] = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, ip, &si6->sin6_addr) == 1) {
+        si6->sin6_family = AF_INET6;
+        si6->sin6_port = htons(port);
+        r->ns_len[i] = sizeof(struct sockaddr_in6);
+    } else {
+        pw_debug("bad nameserver: %s\n", ip);
+        return -1;
+    }
+
+    r->ns_count++;
+
+    return 0;
+}
+
+struct resolv *resolv_new(struct event_base *base)
+{
+    struct resolv *r;
+
+    r = calloc(1, sizeof(struct resolv));
+    if (!r) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    r->base = base;
+    r->timeout = RESOLV_TIMEOUT;
+    r->attempts = RESOLV_ATTEMPTS;
+    r->seed = (uint32_t)resolv_now() ^ ((uint32_t)getpid() << 16) ^
+              (uint32_t)(uintptr_t)r;
+    if (r->seed == 0)
+        r->seed = 1;
+
+    r->ids = calloc(UINT16_MAX + 1, sizeof(struct resolv_query *));
+    if (!r->ids) {
+        pw_error("calloc");
+        goto err;
+    }
+
+    r->pool = pool_new(sizeof(struct resolv_query), 64);
+    if (!r->pool)
+        goto err;
+
+    return r;
+err:
+    resolv_destroy(r);
+    return NULL;
+}
+
+int resolv_load_conf(struct resolv *r, const char *path)
+{
+    char line[512], *key, *val, *save;
+    FILE *fp;
+    int n;
+
+    fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            key = strtok_r(line, " \t\r\n", &save);
+            if (!key || key[0] == '#' || key[0] == ';')
+                continue;
+
+            if (strcmp(key, "nameserver") == 0) {
+                val = strtok_r(NULL, " \t\r\n", &save);
+                if (val)
+                    resolv_add_nameserver(r, val, 53);
+            } else if (strcmp(key, "options") == 0) {
+                while ((val = strtok_r(NULL, " \t\r\n", &save))) {
+                    if (sscanf(val, "timeout:%d", &n) == 1 && n > 0)
+                        r->timeout = n * 1000;
+                    else if (sscanf(val, "attempts:%d", &n) == 1 && n > 0)
+                        r->attempts = n;
+                }
+            }
+        }
+        fclose(fp);
+    } else {
+        pw_error("fopen");
+    }
+
+    /* like the libc resolver, fall back to a local server. */
+    if (r->ns_count == 0)
+        resolv_add_nameserver(r, "127.0.0.1", 53);
+
+    return fp ? 0 : -1;
+}
+
+int resolv_load_hosts(struct resolv *r, const char *path)
+{
+    char line[1024], *tok, *save;
+    struct resolv_addr addr;
+    struct resolv_host *h;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        pw_error("fopen");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "#")] = '\0';
+
+        tok = strtok_r(line, " \t\r\n", &save);
+        if (!tok)
+            continue;
+
+        memset(&addr, 0, sizeof(addr));
+        if (inet_pton(AF_INET, tok, &addr.in.v4) == 1)
+            addr.family = AF_INET;
+        else if (inet_pton(AF_INET6, tok, &addr.in.v6) == 1)
+            addr.family = AF_INET6;
+        else
+            continue;
+
+        while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+            if (strlen(tok) > RESOLV_MAX_NAME)
+                continue;
+            h = calloc(1, sizeof(struct resolv_host));
+            if (!h) {
+                pw_error("calloc");
+                break;
+            }
+            h->addr = addr;
+            strcpy(h->name, tok);
+            h->next = r->hosts;
+            r->hosts = h;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+int resolv_lookup_local(struct resolv *r, const char *name, uint16_t type,
+                        struct resolv_answer *ans)
+{
+    int family = (type == RESOLV_AAAA) ? AF_INET6 : AF_INET;
+    struct resolv_host *h;
+
+    memset(ans, 0, sizeof(struct resolv_answer));
+
+    ans->addrs[0].family = family;
+    if (inet_pton(family, name, &ans->addrs[0].in) == 1) {
+        ans->count = 1;
+        return 0;
+    }
+
+    for (h = r->hosts; h && ans->count < RESOLV_MAX_ADDRS; h = h->next) {
+        if (h->addr.family == family && strcasecmp(h->name, name) == 0)
+            ans->addrs[ans->count++] = h->addr;
+    }
+
+    return ans->count ? 0 : -1;
+}
+
+static int resolv_encode(uint8_t *buf, uint16_t id, const char *name,
+                         uint16_t type)
+{
+    /**
+     * +--------------+-------+--------+
+     * |    QNAME     | QTYPE | QCLASS |
+     * +--------------+-------+--------+
+     * | len label... |   2   |   2    |
+     * +--------------+-------+--------+
+     */
+    uint8_t *p = buf + DNS_HDR_SIZE;
+    size_t n;
+
+    memset(buf, 0, DNS_HDR_SIZE);
+    buf[0] = id >> 8;
+    buf[1] = id;
+    buf[2] = DNS_FLAG_RD >> 8;
+    buf[5] = 1; /* QDCOUNT */
+
+    while (*name) {
+        n = strcspn(name, ".");
+        if (n == 0 || n > 63)
+            return -1;
+        *p++ = n;
+        memcpy(p, name, n);
+        p += n;
+        name += n;
+        if (*name == '.')
+            name++;
+    }
+
+    *p++ = 0;
+    *p++ = type >> 8;
+    *p++ = type;
+    *p++ = 0;
+    *p++ = DNS_CLASS_IN;
+
+    return p - buf;
+}
+
+static int resolv_send(struct resolv *r, struct resolv_query *q)
+{
+    uint8_t buf[DNS_HDR_SIZE + RESOLV_MAX_NAME + 2 + 4];
+    struct resolv_sock *s;
+    int n;
+
+    /* an answer to an earlier try is not taken any more */
+    resolv_socket_put(r, q);
+
+    n = resolv_encode(buf, q->id, q->name, q->type);
+    if (n == -1)
+        return -1;
+
+    s = resolv_socket_get(r, r->ns[q->server].ss_family);
+    if (!s)
+        return -1;
+
+    s->sent++;
+    if (sendto(s->fd, buf, n, 0, (struct sockaddr *)&r->ns[q->server],
+               r->ns_len[q->server]) == -1) {
+        pw_error("sendto");
+        return -1;
+    }
+
+    s->pending++;
+    q->sock = s;
+
+    return 0;
+}
+
+static void resolv_finish(struct resolv *r, struct resolv_query *q, int status,
+                          const struct resolv_answer *ans)
+{
+    resolv_unlink(r, q);
+    resolv_socket_put(r, q);
+    r->ids[q->id] = NULL;
+
+    q->cb(r->base, status, ans, q->arg);
+
+    pool_free(r->pool, q);
+}
+
+struct resolv_query *resolv_query(struct resolv *r, const char *name,
+                                  uint16_t type, resolv_cb_t *cb, void *arg)
+{
+    struct resolv_query *q;
+    uint16_t id;
+    uint32_t i;
+    int was_empty = !r->head;
+
+    if (r->ns_count == 0 || strlen(name) > RESOLV_MAX_NAME)
+        return NULL;
+
+    q = pool_alloc(r->pool);
+    if (!q)
+        return NULL;
+
+    memset(q, 0, sizeof(struct resolv_query));
+    strcpy(q->name, name);
+    q->type = type;
+    q->cb = cb;
+    q->arg = arg;
+
+    /* every id in flight: fail instead of probing forever. */
+    for (i = 0, id = resolv_rand(r); r->ids[id]; i++, id++) {
+        if (i == UINT16_MAX) {
+            pool_free(r->pool, q);
+            return NULL;
+        }
+    }
+    q->id = id;
+    r->ids[id] = q;
+
+    q->server = q->id % r->ns_count;
+    q->tries = 1;
+    q->deadline = resolv_now() + r->timeout;
+    resolv_link(r, q);
+
+    /* a failed send is retried on the next server once it times out. */
+    resolv_send(r, q);
+
+    if (was_empty)
+        resolv_arm(r);
+
+    return q;
+}
+
+void resolv_cancel(struct resolv *r, struct resolv_query *q)
+{
+    if (q) {
+        resolv_unlink(r, q);
+        resolv_socket_put(r, q);
+        r->ids[q->id] = NULL;
+        pool_free(r->pool, q);
+    }
+}
+
+/* ask the next server, or give up after attempts rounds. */
+static void resolv_retry(struct resolv *r, struct resolv_query *q)
+{
+    if (q->tries >= r->attempts * r->ns_count) {
+        pw_debug("resolve %s timeout\n", q->name);
+        resolv_finish(r, q, RESOLV_TIMEOUT, NULL);
+        return;
+    }
+
+    q->tries++;
+    q->server = (q->server + 1) % r->ns_count;
+    q->deadline = resolv_now() + r->timeout;
+
+    resolv_unlink(r, q);
+    resolv_link(r, q);
+
+    resolv_send(r, q);
+}
+
+static void resolv_timeout(struct event_base *base, void *data)
+{
+    struct resolv *r = data;
+    uint64_t now;
+
+    now = resolv_now();
+
+    /* retried queries go to the tail with a later deadline. */
+    while (r->head && r->head->deadline <= now)
+        resolv_retry(r, r->head);
+
+    resolv_arm(r);
+}
+
+/* offset behind the name at off, -1 if malformed. */
+static int resolv_skip_name(const uint8_t *buf, int len, int off)
+{
+    while (off < len) {
+        if (buf[off] == 0)
+            return off + 1;
+        if ((buf[off] & 0xc0) == 0xc0) /* compression pointer */
+            return (off + 2 <= len) ? off + 2 : -1;
+        if (buf[off] & 0xc0)
+            return -1;
+        off += buf[off] + 1;
+    }
+    return -1;
+}
+
+/* compare the uncompressed question name at off with name. */
+static int resolv_name_eq(const uint8_t *buf, int len, int off,
+                          const char *name)
+{
+    int n;
+
+    while (off < len && buf[off] != 0) {
+        n = buf[off++];
+        if (off + n > len ||
+            strncasecmp((const char *)buf + off, name, (size_t)n))
+            return 0;
+        off += n;
+        name += n;
+        if (*name == '.')
+            name++;
+        else if (*name != '\0')
+            return 0;
+    }
+
+    return off < len && *name == '\0';
+}
+
+static int resolv_same_addr(const struct sockaddr_storage *a,
+                            const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4 = (const void *)a, *b4 = (const void *)b;
+    const struct sockaddr_in6 *a6 = (const void *)a, *b6 = (const void *)b;
+
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    if (a->ss_family == AF_INET)
+        return a4->sin_port == b4->sin_port &&
+               a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+
+    return a6->sin6_port == b6->sin6_port &&
+           memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+}
+
+static void resolv_answer(struct resolv *r, struct resolv_sock *s,
+                          const uint8_t *buf, int len,
+                          const struct sockaddr_storage *from)
+{
+    struct resolv_answer ans = {};
+    struct resolv_addr *a;
+    struct resolv_query *q;
+    uint16_t flags, qdcount, ancount, type, class, rdlen;
+    uint32_t ttl;
+    int off, i;
+
+    if (len < DNS_HDR_SIZE)
+        return;
+
+    q = r->ids[(buf[0] << 8) | buf[1]];
+    if (!q || q->sock != s || !resolv_same_addr(from, &r->ns[q->server]))
+        return; /* late, duplicate or spoofed */
+
+    flags = (buf[2] << 8) | buf[3];
+    qdcount = (buf[4] << 8) | buf[5];
+    ancount = (buf[6] << 8) | buf[7];
+
+    if (!(flags & DNS_FLAG_QR) || qdcount != 1 ||
+        !resolv_name_eq(buf, len, DNS_HDR_SIZE, q->name))
+        return;
+
+    off = resolv_skip_name(buf, len, DNS_HDR_SIZE);
+    if (off == -1 || off + 4 > len ||
+        ((buf[off] << 8) | buf[off + 1]) != q->type)
+        return;
+    off += 4;
+
+    switch (flags & DNS_RCODE_MASK) {
+    case DNS_NOERROR:
+        break;
+    case DNS_NXDOMAIN:
+        resolv_finish(r, q, RESOLV_NOTFOUND, NULL);
+        return;
+    default: /* SERVFAIL, REFUSED, ... try the next server right away */
+        resolv_retry(r, q);
+        resolv_arm(r);
+        return;
+    }
+
+    ans.ttl = UINT32_MAX;
+
+    for (i = 0; i < ancount; i++) {
+        off = resolv_skip_name(buf, len, off);
+        if (off == -1 || off + 10 > len)
+            break;
+
+        type = (buf[off] << 8) | buf[off + 1];
+        class = (buf[off + 2] << 8) | buf[off + 3];
+        ttl = ((uint32_t)buf[off + 4] << 24) | (buf[off + 5] << 16) |
+              (buf[off + 6] << 8) | buf[off + 7];
+        rdlen = (buf[off + 8] << 8) | buf[off + 9];
+        off += 10;
+
+        if (off + rdlen > len)
+            break;
+
+        if (class == DNS_CLASS_IN && type == q->type &&
+            ans.count < RESOLV_MAX_ADDRS) {
+            a = &ans.addrs[ans.count];
+            if (type == RESOLV_A && rdlen == 4) {
+                a->family = AF_INET;
+                memcpy(&a->in.v4, buf + off, 4);
+                ans.count++;
+            } else if (type == RESOLV_AAAA && rdlen == 16) {
+                a->family = AF_INET6;
+                memcpy(&a->in.v6, buf + off, 16);
+                ans.count++;
+            }
+        }
+
+        /* CNAMEs of the chain count for the lifetime as well. */
+        if (class == DNS_CLASS_IN && ttl < ans.ttl)
+            ans.ttl = ttl;
+
+        off += rdlen;
+    }
+
+    if (ans.count == 0) {
+        resolv_finish(r, q, (flags & DNS_FLAG_TC) ? RESOLV_FAIL : RESOLV_NOTFOUND,
+                      NULL);
+        return;
+    }
+
+    resolv_finish(r, q, RESOLV_OK, &ans);
+}
+
+static void resolv_read(struct event_base *base, int fd, uint16_t flags,
+                        void *data)
+{
+    struct resolv_sock *s = data;
+    struct resolv *r = s->r;
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    uint8_t buf[RESOLV_PACKET];
+    ssize_t n;
+
+    /* the last answer due on a retired s must not close it under us. */
+    s->pending++;
+
+    while (1) {
+        fromlen = sizeof(from);
+        n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                     &fromlen);
+        if (n == -1) {
+            /* ICMP port unreachable of an earlier send, try again. */
+            if (errno == EINTR || errno == ECONNREFUSED)
+                continue;
+            if (errno != EAGAIN)
+                pw_error("recvfrom");
+            break;
+        }
+        resolv_answer(r, s, buf, n, &from);
+    }
+
+    resolv_socket_release(r, s);
+}
+
+void resolv_destroy(struct resolv *r)
+{
+    struct resolv_host *h;
+
+    if (r) {
+        while (r->head)
+            resolv_cancel(r, r->head);
+        /* the retired sockets went with their last query */
+        if (r->sock4)
+            resolv_socket_close(r->sock4);
+        if (r->sock6)
+            resolv_socket_close(r->sock6);
+        event_base_timer_cancel(r->base, &r->timer);
+        while (r->hosts) {
+            h = r->hosts;
+            r->hosts = h->next;
+            free(h);
+        }
+        pool_destroy(r->pool);
+        free(r->ids);
+        free(r);
+    }
+}
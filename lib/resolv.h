@@ -0,0 +1,73 @@
+/* resolv.h */
+
+#ifndef _PW_RESOLV_H
+#define _PW_RESOLV_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define RESOLV_CONF "/etc/resolv.conf"
+#define RESOLV_HOSTS "/etc/hosts"
+
+#define RESOLV_MAX_NS 3     /* like MAXNS of resolv.h */
+#define RESOLV_MAX_ADDRS 8  /* addresses kept per answer */
+#define RESOLV_MAX_NAME 255 /* max length of a domain name */
+#define RESOLV_ROTATE 16    /* queries sent from a source port */
+
+/* query types */
+enum {
+    RESOLV_A = 1,
+    RESOLV_AAAA = 28,
+};
+
+/* status of a completed query */
+enum {
+    RESOLV_OK = 0,
+    RESOLV_NOTFOUND = 1, /* NXDOMAIN, or no record of the type */
+    RESOLV_TIMEOUT = 2,  /* no server answered */
+    RESOLV_FAIL = 3,     /* servers failed or answered garbage */
+};
+
+struct resolv_addr {
+    int family; /* AF_INET or AF_INET6 */
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } in;
+};
+
+struct resolv_answer {
+    uint32_t ttl; /* smallest TTL of the records, seconds */
+    uint16_t count;
+    struct resolv_addr addrs[RESOLV_MAX_ADDRS];
+};
+
+struct event_base;
+struct resolv;
+struct resolv_query;
+
+typedef void resolv_cb_t(struct event_base *, int, const struct resolv_answer *,
+                         void *);
+
+/**
+ * Non-blocking stub resolver. Queries go out over UDP to the configured
+ * nameservers from a socket registered on base, answers are delivered to
+ * the callback from the event loop. Every RESOLV_ROTATE queries the socket
+ * is replaced by one on a new random port, so a spoofed answer has to hit
+ * the port as well as the DNS id.
+ */
+struct resolv *resolv_new(struct event_base *base);
+/* nameserver, options timeout: and attempts: of a resolv.conf file. */
+int resolv_load_conf(struct resolv *r, const char *path);
+int resolv_load_hosts(struct resolv *r, const char *path);
+int resolv_add_nameserver(struct resolv *r, const char *ip, uint16_t port);
+/* answer literal addresses and hosts entries, returns -1 if not found. */
+int resolv_lookup_local(struct resolv *r, const char *name, uint16_t type,
+                        struct resolv_answer *ans);
+/* cb is called exactly once, unless the query is cancelled first. */
+struct resolv_query *resolv_query(struct resolv *r, const char *name,
+                                  uint16_t type, resolv_cb_t *cb, void *arg);
+void resolv_cancel(struct resolv *r, struct resolv_query *q);
+void resolv_destroy(struct resolv *r);
+
+#endif /* resolv.h */
@@ -0,0 +1,264 @@
+/* resolv_cache.c */
+
+#include "resolv_cache.h"
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+/* yields a lock is waited for before its owner is looked at. */
+#define RESOLV_CACHE_SPINS 1000
+
+struct resolv_cache_entry {
+    uint32_t hash; /* 0 marks a free slot */
+    uint16_t type;
+    uint8_t status;
+    uint8_t refreshing; /* a refresh was handed out */
+    uint32_t hits;
+    uint32_t ttl;    /* lifetime it was stored with, seconds */
+    uint64_t expire; /* ms, CLOCK_MONOTONIC is the same for all processes */
+    struct resolv_answer ans;
+    char name[RESOLV_MAX_NAME + 1];
+};
+
+struct resolv_cache_set {
+    uint32_t lock; /* pid of the owner, 0 when open */
+    struct resolv_cache_entry way[RESOLV_CACHE_WAYS];
+};
+
+struct resolv_cache {
+    size_t size; /* of the mapping */
+    uint32_t mask;
+    uint32_t ttl_min;
+    uint32_t ttl_max;
+    uint64_t hits;
+    uint64_t misses;
+    struct resolv_cache_set sets[];
+};
+
+static uint64_t resolv_cache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a of the lower-cased name and the type, never 0. */
+static uint32_t resolv_cache_hash(const char *name, uint16_t type)
+{
+    uint32_t h = 2166136261u ^ type;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)name; *p; p++) {
+        h ^= (*p >= 'A' && *p <= 'Z') ? *p + 32 : *p;
+        h *= 16777619u;
+    }
+
+    return h ? h : 1;
+}
+
+/**
+ * The critical sections are a few hundred bytes of copying. A worker killed
+ * in one would leave the set locked for good, so a waiter that spun too long
+ * takes the lock over from a dead owner, with the set emptied as its entries
+ * may be half written. With the owner alive it gives up, returns -1 and the
+ * caller goes without the cache.
+ */
+static int resolv_cache_lock(struct resolv_cache_set *set)
+{
+    uint32_t self = getpid(), owner;
+    int spins = 0;
+
+    while (1) {
+        owner = 0;
+        if (__atomic_compare_exchange_n(&set->lock, &owner, self, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+        if (spins >= RESOLV_CACHE_SPINS)
+            break;
+        while ((owner = __atomic_load_n(&set->lock, __ATOMIC_RELAXED)) &&
+               ++spins < RESOLV_CACHE_SPINS)
+            sched_yield();
+    }
+
+    if (kill(owner, 0) == -1 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&set->lock, &owner, self, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        pw_debug("dns cache lock of dead process %u taken over\n", owner);
+        memset(set->way, 0, sizeof(set->way));
+        return 0;
+    }
+
+    return -1;
+}
+
+static void resolv_cache_unlock(struct resolv_cache_set *set)
+{
+    __atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+struct resolv_cache *resolv_cache_new(uint32_t entries, uint32_t ttl_min,
+                                      uint32_t ttl_max)
+{
+    struct resolv_cache *rc;
+    uint32_t sets = 1;
+    size_t size;
+
+    while (sets * RESOLV_CACHE_WAYS < entries)
+        sets <<= 1;
+
+    size = sizeof(struct resolv_cache) + sets * sizeof(struct resolv_cache_set);
+
+    /* zero filled, all slots free and all locks open. */
+    rc = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+              -1, 0);
+    if (rc == MAP_FAILED) {
+        pw_error("mmap");
+        return NULL;
+    }
+
+    rc->size = size;
+    rc->mask = sets - 1;
+    rc->ttl_min = ttl_min;
+    rc->ttl_max = ttl_max > ttl_min ? ttl_max : ttl_min;
+
+    return rc;
+}
+
+static struct resolv_cache_entry *
+resolv_cache_find(struct resolv_cache_set *set, uint32_t hash, const char *name,
+                  uint16_t type)
+{
+    struct resolv_cache_entry *e;
+    int i;
+
+    for (i = 0; i < RESOLV_CACHE_WAYS; i++) {
+        e = &set->way[i];
+        if (e->hash == hash && e->type == type && strcasecmp(e->name, name) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+int resolv_cache_get(struct resolv_cache *rc, const char *name, uint16_t type,
+                     int *status, struct resolv_answer *ans)
+{
+    uint32_t hash = resolv_cache_hash(name, type);
+    struct resolv_cache_set *set = &rc->sets[hash & rc->mask];
+    struct resolv_cache_entry *e;
+    uint64_t now = resolv_cache_now(), left;
+    int ret = RESOLV_CACHE_MISS;
+
+    if (resolv_cache_lock(set) == -1) {
+        __atomic_fetch_add(&rc->misses, 1, __ATOMIC_RELAXED);
+        return RESOLV_CACHE_MISS;
+    }
+
+    e = resolv_cache_find(set, hash, name, type);
+    if (e && e->expire > now) {
+        left = e->expire - now;
+        *status = e->status;
+        *ans = e->ans;
+        ans->ttl = left / 1000;
+        e->hits++;
+        ret = RESOLV_CACHE_HIT;
+
+        /* refresh names in use within the last tenth of their lifetime. */
+        if (!e->refreshing && e->hits > 1 && left * 10 <= e->ttl * 1000ULL) {
+            e->refreshing = 1;
+            ret = RESOLV_CACHE_REFRESH;
+        }
+    }
+
+    resolv_cache_unlock(set);
+
+    __atomic_fetch_add(ret == RESOLV_CACHE_MISS ? &rc->misses : &rc->hits, 1,
+                       __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+void resolv_cache_put(struct resolv_cache *rc, const char *name, uint16_t type,
+                      int status, const struct resolv_answer *ans)
+{
+    uint32_t hash = resolv_cache_hash(name, type), ttl, hits = 0;
+    struct resolv_cache_set *set = &rc->sets[hash & rc->mask];
+    struct resolv_cache_entry *e, *victim;
+    uint64_t now = resolv_cache_now();
+    int i;
+
+    if (status == RESOLV_OK && ans && ans->count)
+        ttl = ans->ttl;
+    else if (status == RESOLV_NOTFOUND)
+        ttl = RESOLV_CACHE_NEG_TTL;
+    else
+        return; /* timeouts and failures are not an answer */
+
+    if (ttl < rc->ttl_min)
+        ttl = rc->ttl_min;
+    if (ttl > rc->ttl_max)
+        ttl = rc->ttl_max;
+    if (ttl == 0 || strlen(name) > RESOLV_MAX_NAME)
+        return;
+
+    if (resolv_cache_lock(set) == -1)
+        return;
+
+    e = resolv_cache_find(set, hash, name, type);
+    if (e) {
+        hits = e->hits; /* a refresh keeps the entry hot */
+    } else {
+        /* a free or expired slot, else the one expiring first. */
+        victim = &set->way[0];
+        for (i = 0; i < RESOLV_CACHE_WAYS; i++) {
+            e = &set->way[i];
+            if (e->hash == 0 || e->expire <= now) {
+                victim = e;
+                break;
+            }
+            if (e->expire < victim->expire)
+                victim = e;
+        }
+        e = victim;
+    }
+
+    e->hash = hash;
+    e->type = type;
+    e->status = status;
+    e->refreshing = 0;
+    e->hits = hits;
+    e->ttl = ttl;
+    e->expire = now + ttl * 1000ULL;
+    if (status == RESOLV_OK)
+        e->ans = *ans;
+    else
+        memset(&e->ans, 0, sizeof(e->ans));
+    e->ans.ttl = ttl;
+    strcpy(e->name, name);
+
+    resolv_cache_unlock(set);
+}
+
+void resolv_cache_stats(struct resolv_cache *rc, uint64_t *hits,
+                        uint64_t *misses)
+{
+    *hits = __atomic_load_n(&rc->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&rc->misses, __ATOMIC_RELAXED);
+}
+
+void resolv_cache_destroy(struct resolv_cache *rc)
+{
+    if (rc)
+        munmap(rc, rc->size);
+}
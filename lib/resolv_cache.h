@@ -0,0 +1,45 @@
+/* resolv_cache.h */
+
+#ifndef _PW_RESOLV_CACHE_H
+#define _PW_RESOLV_CACHE_H
+
+#include <stdint.h>
+
+#include "resolv.h"
+
+#define RESOLV_CACHE_WAYS 4     /* entries per set */
+#define RESOLV_CACHE_NEG_TTL 30 /* seconds for NXDOMAIN, before floor/cap */
+
+/* result of resolv_cache_get */
+enum {
+    RESOLV_CACHE_MISS = -1,
+    RESOLV_CACHE_HIT = 0,
+    RESOLV_CACHE_REFRESH = 1, /* hit, but the caller should re-resolve */
+};
+
+struct resolv_cache;
+
+/**
+ * Answer cache in an anonymous shared mapping, create it before fork(2) and
+ * all processes see each other's entries. Positive and negative (NXDOMAIN)
+ * answers are kept for their TTL clamped to [ttl_min, ttl_max]. A process
+ * that dies holding a lock costs the entries of one set, not a deadlock.
+ */
+struct resolv_cache *resolv_cache_new(uint32_t entries, uint32_t ttl_min,
+                                      uint32_t ttl_max);
+/**
+ * Look up name, on a hit status and ans (TTL left) are filled in. A hot
+ * entry close to expiry returns RESOLV_CACHE_REFRESH once, to a single
+ * caller, who is expected to resolve it again and put the answer.
+ */
+int resolv_cache_get(struct resolv_cache *rc, const char *name, uint16_t type,
+                     int *status, struct resolv_answer *ans);
+/* store the outcome of a query, only RESOLV_OK and RESOLV_NOTFOUND stick. */
+void resolv_cache_put(struct resolv_cache *rc, const char *name, uint16_t type,
+                      int status, const struct resolv_answer *ans);
+/* hits and misses of all processes. */
+void resolv_cache_stats(struct resolv_cache *rc, uint64_t *hits,
+                        uint64_t *misses);
+void resolv_cache_destroy(struct resolv_cache *rc);
+
+#endif /* resolv_cache.h */
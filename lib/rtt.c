@@ -0,0 +1,107 @@
+/* rtt.c */
+
+#include "rtt.h"
+
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ev_timer.h"
+
+struct rtt_table *rtt_table_new(uint32_t size)
+{
+    struct rtt_table *t;
+    uint32_t n = 1;
+
+    while (n < size)
+        n <<= 1;
+
+    t = calloc(1, sizeof(struct rtt_table));
+    if (!t) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    t->slots = calloc(n, sizeof(struct rtt_entry));
+    if (!t->slots) {
+        pw_error("calloc");
+        free(t);
+        return NULL;
+    }
+    t->size = n;
+
+    return t;
+}
+
+static uint32_t rtt_hash(const struct resolv_addr *addr)
+{
+    const uint8_t *p;
+    uint32_t hash = 2166136261u, i, len;
+
+    if (addr->family == AF_INET) {
+        p = (const uint8_t *)&addr->in.v4;
+        len = sizeof(addr->in.v4);
+    } else {
+        p = (const uint8_t *)&addr->in.v6;
+        len = sizeof(addr->in.v6);
+    }
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+static int rtt_same(const struct resolv_addr *a, const struct resolv_addr *b)
+{
+    if (a->family != b->family)
+        return 0;
+    if (a->family == AF_INET)
+        return a->in.v4.s_addr == b->in.v4.s_addr;
+    return memcmp(&a->in.v6, &b->in.v6, sizeof(a->in.v6)) == 0;
+}
+
+uint32_t rtt_get(struct rtt_table *t, const struct resolv_addr *addr)
+{
+    struct rtt_entry *e = &t->slots[rtt_hash(addr) & (t->size - 1)];
+
+    if (e->srtt == 0 || !rtt_same(&e->addr, addr) ||
+        ev_timer_now() - e->updated > RTT_TTL)
+        return 0;
+
+    return e->srtt;
+}
+
+void rtt_update(struct rtt_table *t, const struct resolv_addr *addr,
+                uint32_t us)
+{
+    struct rtt_entry *e = &t->slots[rtt_hash(addr) & (t->size - 1)];
+    uint64_t now = ev_timer_now();
+
+    if (us == 0)
+        us = 1;
+
+    if (e->srtt == 0 || !rtt_same(&e->addr, addr) ||
+        now - e->updated > RTT_TTL) {
+        e->addr = *addr;
+        e->srtt = us;
+    } else if (us == RTT_FAILED || e->srtt == RTT_FAILED) {
+        /* a failure is not averaged away, nor does it linger */
+        e->srtt = us;
+    } else {
+        /* srtt = 7/8 srtt + 1/8 sample, RFC 6298 */
+        e->srtt = e->srtt - (e->srtt >> 3) + (us >> 3);
+    }
+    e->updated = now;
+}
+
+void rtt_table_destroy(struct rtt_table *t)
+{
+    if (t) {
+        free(t->slots);
+        free(t);
+    }
+}
@@ -0,0 +1,38 @@
+/* rtt.h */
+
+#ifndef _PW_RTT_H
+#define _PW_RTT_H
+
+#include <stdint.h>
+
+#include "resolv.h"
+
+#define RTT_FAILED 3000000 /* us, what a failed connect counts as */
+#define RTT_TTL 600000     /* ms a sample is trusted */
+
+/**
+ * Smoothed connect RTT per remote address, like the srtt of TCP, to try the
+ * fastest known address of a name first. A table of fixed size, addresses
+ * that hash to the same slot replace each other. Not thread safe, every
+ * worker owns its own.
+ */
+struct rtt_entry {
+    struct resolv_addr addr;
+    uint32_t srtt;    /* us, 0 for an empty slot */
+    uint64_t updated; /* ms, ev_timer_now */
+};
+
+struct rtt_table {
+    struct rtt_entry *slots;
+    uint32_t size; /* a power of 2 */
+};
+
+struct rtt_table *rtt_table_new(uint32_t size);
+/* the smoothed RTT to addr in us, 0 if unknown or too old. */
+uint32_t rtt_get(struct rtt_table *t, const struct resolv_addr *addr);
+/* a connect to addr took us, RTT_FAILED for one that failed. */
+void rtt_update(struct rtt_table *t, const struct resolv_addr *addr,
+                uint32_t us);
+void rtt_table_destroy(struct rtt_table *t);
+
+#endif /* rtt.h */
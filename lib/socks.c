@@ -3,17 +3,28 @@
 #include "socks.h"
 
 #include <sys/socket.h>
-#include <sys/select.h> /* connect timeout */
 #include <sys/types.h>
+#ifdef __linux__
+#    include <linux/filter.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h> /* splice */
 #include <stdint.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <netdb.h>
+#include <string.h>
 
 #include "debug.h"
+#include "ev.h"
+#include "ev_timer.h"
+#include "misc.h"
+#include "pool.h"
+#include "rtt.h"
+#include "splice.h"
 
 /**
  * X'00' succeeded
@@ -39,43 +50,92 @@ enum {
     SOCKS_ADDRESS_TYPE_NOT_SUPPORTED = 0x08,
 };
 
-static int socks_replies(struct socks_conn *c, uint8_t rep, uint8_t atyp,
-                         const char *addr, int addrlen, uint16_t port);
-static int socks_ip_connect(struct socks_conn *c, in_addr_t addr,
-                            in_port_t port);
-static int socks_domain_connect(struct socks_conn *c, const char *domain,
-                                in_port_t port);
+static int socks_replies(struct socks_conn *c, uint8_t rep,
+                         const struct sockaddr_storage *bnd);
+static int socks_race_literal(struct socks_conn *c,
+                              const struct resolv_addr *addr);
+static int socks_serve_start(struct socks_conn *c);
+static int socks_relay(struct socks_conn *c, int from, uint8_t *from_ready,
+                       int to, uint8_t *to_ready, struct ring *r, uint8_t dir);
+#ifdef __linux__
+static int socks_splice(struct socks_conn *c, int from, uint8_t *from_ready,
+                        int to, uint8_t *to_ready, int pipe[2], uint32_t *len,
+                        uint8_t dir);
+#endif
 
-struct socks *socks_create(const char *host, uint16_t port, const char *u,
-                           const char *p)
+static struct socks *socks_new(const char *u, const char *p)
 {
-    struct sockaddr_in si = {};
     struct socks *s;
-#ifndef NDEBUG
-    int opt;
-#endif
 
     s = calloc(1, sizeof(struct socks));
     if (!s) {
         pw_error("calloc");
-        goto err;
+        return NULL;
     }
 
+    s->fd = -1;
     if (u && p) {
         memcpy(s->user, u, strlen(u));
         memcpy(s->passwd, p, strlen(p));
         s->use_auth = 1;
     }
 
-    s->fd = socket(PF_INET, SOCK_STREAM, 0);
+    return s;
+}
+
+/* TCP Fast Open on the listener, see SOCKS_FASTOPEN. */
+static int socks_fastopen(struct socks *s)
+{
+#ifdef TCP_FASTOPEN
+    int opt;
+
+#    ifdef __APPLE__
+    opt = 1; /* a switch, not a queue length */
+#    else
+    opt = SOCKS_FASTOPEN_QLEN;
+#    endif
+    if (setsockopt(s->fd, IPPROTO_TCP, TCP_FASTOPEN, (const void *)&opt,
+                   sizeof(opt)) == -1) {
+        pw_error("setsockopt");
+        return -1;
+    }
+    s->fastopen = 1;
+#else
+    pw_debug("no TCP Fast Open on this system\n");
+#endif
+    return 0;
+}
+
+struct socks *socks_create(const char *host, uint16_t port, const char *u,
+                           const char *p, int flags)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    struct socks *s;
+    int opt;
+
+    s = socks_new(u, p);
+    if (!s)
+        goto err;
+
+    /* an IPv6 host like :: listens on both families. */
+    if (tcp_addr(host, port, &ss, &sslen) == -1)
+        goto bad_host;
+
+    s->fd = socket(ss.ss_family, SOCK_STREAM, 0);
     if (s->fd == -1) {
         pw_error("socket");
         goto err;
     }
 
-    si.sin_addr.s_addr = inet_addr(host);
-    si.sin_port = htons(port);
-    si.sin_family = AF_INET;
+    if (ss.ss_family == AF_INET6) {
+        opt = 0;
+        if (setsockopt(s->fd, IPPROTO_IPV6, IPV6_V6ONLY, (const void *)&opt,
+                       sizeof(opt)) == -1) {
+            pw_error("setsockopt");
+            goto err;
+        }
+    }
 
 #ifndef NDEBUG
     opt = 1;
@@ -83,7 +143,19 @@ struct socks *socks_create(const char *host, uint16_t port, const char *u,
                sizeof(opt));
 #endif
 
-    if (bind(s->fd, (struct sockaddr *)&si, sizeof(si)) == -1) {
+    if (flags & SOCKS_REUSEPORT) {
+        opt = 1;
+        if (setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&opt,
+                       sizeof(opt)) == -1) {
+            pw_error("setsockopt");
+            goto err;
+        }
+    }
+
+    if ((flags & SOCKS_FASTOPEN) && socks_fastopen(s) == -1)
+        goto err;
+
+    if (bind(s->fd, (struct sockaddr *)&ss, sslen) == -1) {
         pw_error("bind");
         goto err;
     }
@@ -93,13 +165,93 @@ struct socks *socks_create(const char *host, uint16_t port, const char *u,
         goto err;
     }
 
+    /* workers race for connections, accept must not block the loser. */
+    if (set_nonblocking(s->fd, 1) == -1)
+        goto err;
+
     return s;
+bad_host:
+    pw_debug("invalid host %s\n", host);
 err:
     if (s)
         socks_close(s);
     return NULL;
 }
 
+struct socks *socks_inherit(int fd, const char *host, uint16_t port,
+                            const char *u, const char *p, int flags)
+{
+    socklen_t optlen = sizeof(int);
+    struct socks *s;
+    int opt = 0;
+
+    s = socks_new(u, p);
+    if (!s) {
+        close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+
+    if (!tcp_bound(fd, host, port)) {
+        pw_debug("fd %d is not listening on %s:%d\n", fd, host, port);
+        goto err;
+    }
+
+    /* a reuseport group cannot be joined or left once bound. */
+    if (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, &optlen) == -1) {
+        pw_error("getsockopt");
+        goto err;
+    }
+    if (!opt != !(flags & SOCKS_REUSEPORT)) {
+        pw_debug("fd %d is %sin a reuseport group\n", fd, opt ? "" : "not ");
+        goto err;
+    }
+
+    /* the options of the listener go with it, but Fast Open may be new */
+    if ((flags & SOCKS_FASTOPEN) && socks_fastopen(s) == -1)
+        goto err;
+
+    if (set_nonblocking(fd, 1) == -1)
+        goto err;
+
+    return s;
+err:
+    socks_close(s);
+    return NULL;
+}
+
+int socks_steer_cpu(struct socks *s, uint16_t n)
+{
+#ifdef __linux__
+    struct sock_filter code[] = {
+        /* A = raw_smp_processor_id() */
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        /* A = A % n */
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, n},
+        /* index into the group, out of range falls back to the hash */
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (n == 0)
+        return -1;
+
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) == -1) {
+        pw_error("setsockopt");
+        return -1;
+    }
+
+    return 0;
+#else
+    pw_debug("SO_ATTACH_REUSEPORT_CBPF is only supported on Linux\n");
+    return -1;
+#endif
+}
+
 void socks_close(struct socks *s)
 {
     if (s) {
@@ -109,66 +261,198 @@ void socks_close(struct socks *s)
     }
 }
 
-struct socks_conn *socks_accept_conn(struct socks *s)
+int socks_accept(struct socks *s, struct sockaddr_storage *addr,
+                 socklen_t *addrlen)
 {
-    struct socks_conn *c;
+    int fd;
+
+    *addrlen = sizeof(struct sockaddr_storage);
+#ifdef __linux__
+    fd = accept4(s->fd, (struct sockaddr *)addr, addrlen,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    fd = accept(s->fd, (struct sockaddr *)addr, addrlen);
+    if (fd != -1)
+        set_nonblocking(fd, 1);
+#endif
+    if (fd == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            pw_error("accept");
+        }
+        return -1; /* errno is left for the caller */
+    }
 
-    c = calloc(1, sizeof(struct socks_conn));
-    if (!c) {
-        pw_error("calloc");
+    return fd;
+}
+
+struct socks_conn *socks_accept_conn(struct socks *s, struct pool *pool)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+
+    /* accept first, an empty backlog costs no allocation. */
+    fd = socks_accept(s, &addr, &addrlen);
+    if (fd == -1)
         return NULL;
+
+    return socks_conn_new(s, pool, fd, &addr, addrlen);
+}
+
+/* whether the SYN of fd carried data that the peer, or we, accepted. */
+static int socks_syn_data(int fd)
+{
+#ifdef TCPI_OPT_SYN_DATA
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+        return (ti.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#endif
+    return 0;
+}
+
+struct socks_conn *socks_conn_new(struct socks *s, struct pool *pool, int fd,
+                                  const struct sockaddr_storage *addr,
+                                  socklen_t addrlen)
+{
+    struct socks_conn *c;
+
+    if (pool) {
+        c = pool_alloc(pool);
+        if (!c) {
+            close(fd);
+            return NULL;
+        }
+        memset(c, 0, offsetof(struct socks_conn, in));
+    } else {
+        c = calloc(1, sizeof(struct socks_conn));
+        if (!c) {
+            pw_error("calloc");
+            close(fd);
+            return NULL;
+        }
     }
 
     c->socks = s;
+    c->pool = pool;
     c->state = SOCKS_METHOD;
+    c->srcfd = fd;
     c->dstfd = -1;
-    c->addrlen = sizeof(c->addr);
-
-    c->srcfd = accept(s->fd, (struct sockaddr *)&c->addr, &c->addrlen);
-    if (c->srcfd == -1) {
-        if (errno != EINTR) {
-            pw_error("accept");
-        }
-        return NULL;
-    }
+    c->tfo_fd = -1;
+    if (s && s->fastopen && socks_syn_data(fd))
+        c->fastopen |= SOCKS_TFO_IN;
+    memcpy(&c->addr, addr, addrlen);
+    c->addrlen = addrlen;
+    c->up_pipe[0] = c->up_pipe[1] = -1;
+    c->down_pipe[0] = c->down_pipe[1] = -1;
+    ring_init(&c->up);
+    ring_init(&c->down);
 
     return c;
 }
 
 void socks_close_conn(struct socks_conn *c)
 {
+    int i;
+
     if (c) {
+        for (i = 0; i < c->nrace; i++)
+            close(c->race[i]);
         if (c->dstfd != -1)
             close(c->dstfd);
         if (c->srcfd != -1)
             close(c->srcfd);
-        free(c);
+        socks_udp_close(c->udp);
+#ifdef __linux__
+        if (c->pipes) {
+            pipe_pool_put(c->pipes, c->up_pipe, c->up_len == 0);
+            pipe_pool_put(c->pipes, c->down_pipe, c->down_len == 0);
+        }
+#endif
+        if (c->pool)
+            pool_free(c->pool, c);
+        else
+            free(c);
     }
 }
 
-int socks_get_method(struct socks_conn *c)
+int socks_handshake(struct socks_conn *c)
 {
-    char *methods, buf[512] = {};
-    int n, i;
-    uint8_t n_methods;
+    ssize_t n;
+    int used;
+
+    while (1) {
+        switch (c->state) {
+        case SOCKS_METHOD:
+            used = socks_get_method(c);
+            break;
+        case SOCKS_AUTH:
+            used = socks_authenticate(c);
+            break;
+        case SOCKS_CMD:
+            used = socks_command(c);
+            break;
+        default:
+            return -1;
+        }
+
+        if (used == -1)
+            return -1;
 
-    n = read(c->srcfd, buf, sizeof(buf));
-    if (n <= 0) {
+        if (used > 0) {
+            c->in_len -= used;
+            c->in_used = 0;
+            memmove(c->in, c->in + used, c->in_len);
+            return 1;
+        }
+
+        /* every message fits, a client filling it up is not speaking SOCKS5 */
+        if (c->in_len == sizeof(c->in))
+            return -1;
+
+        n = read(c->srcfd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n == 0)
+            return -1;
         if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
             pw_error("read");
+            return -1;
         }
-        return -1;
+        c->in_len += n;
     }
+}
 
-    /* pw_debug("version: %d, n_methods: %d\n", buf[0], buf[1]); */
+int socks_get_method(struct socks_conn *c)
+{
+    /**
+     * +----+----------+----------+
+     * |VER | NMETHODS | METHODS  |
+     * +----+----------+----------+
+     * | 1  |    1     | 1 to 255 |
+     * +----+----------+----------+
+     */
+    uint8_t *methods, buf[2];
+    int i, n_methods;
 
-    if (buf[0] != SOCKS_VER) {
-        pw_debug("Version %d is not supported\n", buf[0]);
+    if (c->in_len < 2)
+        return 0;
+
+    if (c->in[0] != SOCKS_VER) {
+        pw_debug("Version %d is not supported\n", c->in[0]);
         return -1;
     }
 
-    n_methods = buf[1];
-    methods = buf + 2;
+    n_methods = c->in[1];
+    methods = c->in + 2;
+
+    if (c->in_len < 2 + n_methods)
+        return 0;
+
+    c->method = 0xff; /* NO ACCEPTABLE METHODS */
 
     for (i = 0; i < n_methods; i++) {
         if (methods[i] == 0x00 && !c->socks->use_auth) {
@@ -177,15 +461,13 @@ int socks_get_method(struct socks_conn *c)
         } else if (methods[i] == 0x02 && c->socks->use_auth) {
             c->method = 0x02; /* X'02' USERNAME/PASSWORD */
             break;
-        } else {
-            /**
-             * X'01' GSSAPI
-             * X'03' to X'7F' IANA ASSIGNED
-             * X'80' to X'FE' RESERVED FOR PRIVATE METHODS
-             * X'FF' NO ACCEPTABLE METHODS
-             */
-            c->method = 0xff; /* NO ACCEPTABLE METHODS */
         }
+        /**
+         * X'01' GSSAPI
+         * X'03' to X'7F' IANA ASSIGNED
+         * X'80' to X'FE' RESERVED FOR PRIVATE METHODS
+         * X'FF' NO ACCEPTABLE METHODS
+         */
     }
 
     buf[0] = SOCKS_VER;
@@ -206,35 +488,41 @@ int socks_get_method(struct socks_conn *c)
     else
         c->state = SOCKS_AUTH;
 
-    return 0;
+    return 2 + n_methods;
 }
 
 int socks_authenticate(struct socks_conn *c)
 {
-    uint8_t ver, ulen, plen;
-    char buf[512] = {};
-    char *u, *p;
-    int n, i;
+    /**
+     * +----+------+----------+------+----------+
+     * |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+     * +----+------+----------+------+----------+
+     * | 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+     * +----+------+----------+------+----------+
+     */
+    uint8_t ulen, plen, buf[2];
+    uint8_t *u, *p;
 
-    n = read(c->srcfd, buf, sizeof(buf));
-    if (n <= 0) {
-        if (n == -1) {
-            pw_error("read");
-        }
-        return -1;
-    }
+    if (c->in_len < 2)
+        return 0;
 
-    ver = buf[0];
-    ulen = buf[1];
-    plen = buf[2 + ulen];
+    ulen = c->in[1];
+    if (c->in_len < 3 + ulen)
+        return 0;
 
-    u = buf + 2;
-    p = buf + 3 + ulen;
+    plen = c->in[2 + ulen];
+    if (c->in_len < 3 + ulen + plen)
+        return 0;
 
+    u = c->in + 2;
+    p = c->in + 3 + ulen;
+
+    buf[0] = c->in[0];
     buf[1] = 1;
 
-    if (memcmp(c->socks->user, u, strlen(c->socks->user)) == 0 &&
-        memcmp(c->socks->passwd, p, strlen(c->socks->passwd)) == 0)
+    if (ulen == strlen(c->socks->user) && plen == strlen(c->socks->passwd) &&
+        memcmp(c->socks->user, u, ulen) == 0 &&
+        memcmp(c->socks->passwd, p, plen) == 0)
         buf[1] = 0;
 
     if (write(c->srcfd, buf, 2) == -1) {
@@ -242,12 +530,14 @@ int socks_authenticate(struct socks_conn *c)
         return -1;
     }
 
-    if (buf[1] != 0)
+    if (buf[1] != 0) {
+        c->auth_failed = 1;
         return -1;
+    }
 
     c->state = SOCKS_CMD;
 
-    return 0;
+    return 3 + ulen + plen;
 }
 
 int socks_command(struct socks_conn *c)
@@ -259,26 +549,20 @@ int socks_command(struct socks_conn *c)
      * | 1  |  1  | X'00' |  1   | Variable |    2     |
      * +----+-----+-------+------+----------+----------+
      */
-    char buf[512] = {};
+    uint8_t *buf = c->in;
     struct {
         uint8_t ver;
         uint8_t cmd;
         uint8_t rsv;
         uint8_t atyp;
     } *hdr = (void *)buf;
-    int n, ret;
-    char domain[256] = {};
+    struct resolv_addr addr = {};
     uint8_t domain_len;
-    struct in_addr addr = {};
     in_port_t port;
+    int ret;
 
-    n = read(c->srcfd, buf, sizeof(buf));
-    if (n <= 0) {
-        if (n == -1) {
-            pw_error("read");
-        }
-        return -1;
-    }
+    if (c->in_len < 4)
+        return 0;
 
     /* verify version */
     if (hdr->ver != SOCKS_VER)
@@ -293,75 +577,319 @@ int socks_command(struct socks_conn *c)
         switch (hdr->atyp) {
         case SOCKS_IPv4:
 
-            memcpy(&addr, buf + 4, 4);
+            if (c->in_len < 4 + 4 + 2)
+                return 0;
+
+            addr.family = AF_INET;
+            memcpy(&addr.in.v4, buf + 4, 4);
             memcpy(&port, buf + 8, 2);
+            c->port = ntohs(port);
 
-            pw_debug("connect to %s:%d\n", inet_ntoa(addr), ntohs(port));
+            pw_debug("connect to %s:%d\n", inet_ntoa(addr.in.v4), c->port);
 
-            ret = socks_ip_connect(c, addr.s_addr, ntohs(port));
-            if (ret == 0)
-                c->state = SOCKS_SERVE;
+            c->in_used = 4 + 4 + 2; /* what follows may go in the SYN */
+            if (socks_race_literal(c, &addr) == -1)
+                return -1;
 
-            return socks_replies(c, ret, 0, NULL, 0, 0);
+            /* reply once connected, see socks_race_won */
+            return 4 + 4 + 2;
+
+        case SOCKS_IPv6:
+
+            if (c->in_len < 4 + 16 + 2)
+                return 0;
+
+            addr.family = AF_INET6;
+            memcpy(&addr.in.v6, buf + 4, 16);
+            memcpy(&port, buf + 20, 2);
+            c->port = ntohs(port);
+
+            pw_debug("connect to [IPv6]:%d\n", c->port);
+
+            c->in_used = 4 + 16 + 2;
+            if (socks_race_literal(c, &addr) == -1)
+                return -1;
+
+            return 4 + 16 + 2;
 
         case SOCKS_DOMAIN:
 
+            if (c->in_len < 5)
+                return 0;
+
             domain_len = buf[4];
+            if (domain_len == 0)
+                return -1;
+            if (c->in_len < 5 + domain_len + 2)
+                return 0;
 
-            memcpy(domain, buf + 5, domain_len);
+            memcpy(c->domain, buf + 5, domain_len);
+            c->domain[domain_len] = '\0';
             memcpy(&port, buf + 5 + domain_len, 2);
+            c->port = ntohs(port);
 
-            pw_debug("connect to %s:%d\n", domain, ntohs(port));
+            pw_debug("connect to %s:%d\n", c->domain, c->port);
 
-            ret = socks_domain_connect(c, domain, ntohs(port));
-            if (ret == 0)
-                c->state = SOCKS_SERVE;
+            c->state = SOCKS_RESOLVING;
 
-            return socks_replies(c, ret, 0, NULL, 0, 0);
-        case SOCKS_IPv6: /* TODO */
+            /* connect once resolved, see socks_race_addrs */
+            return 5 + domain_len + 2;
         default:
             pw_debug("Unsupported address type: %c\n", hdr->atyp);
-            return socks_replies(c, SOCKS_ADDRESS_TYPE_NOT_SUPPORTED, 0, NULL,
-                                 0, 0);
+            socks_replies(c, SOCKS_ADDRESS_TYPE_NOT_SUPPORTED, NULL);
+            return -1;
         }
         break;
 
-    case SOCKS_BIND:              /* TODO */
-    case SOCKS_UDP_ASSOCIATE_UDP: /* TODO */
+    case SOCKS_UDP_ASSOCIATE_UDP:
+        /**
+         * DST.ADDR and DST.PORT are where the client might send from, it
+         * is taken from the first datagram instead, see socks_udp.h.
+         */
+        switch (hdr->atyp) {
+        case SOCKS_IPv4:
+            ret = 4 + 4 + 2;
+            break;
+        case SOCKS_IPv6:
+            ret = 4 + 16 + 2;
+            break;
+        case SOCKS_DOMAIN:
+            if (c->in_len < 5)
+                return 0;
+            ret = 5 + buf[4] + 2;
+            break;
+        default:
+            socks_replies(c, SOCKS_ADDRESS_TYPE_NOT_SUPPORTED, NULL);
+            return -1;
+        }
+        if (c->in_len < ret)
+            return 0;
+
+        c->state = SOCKS_UDP;
+
+        return ret; /* reply once the relay is up, see socks_udp_associate */
+
+    case SOCKS_BIND: /* TODO */
     default:
         pw_debug("Unsupported command: %c\n", hdr->cmd);
-        return socks_replies(c, SOCKS_COMMAND_NOT_SUPPORTED, 0, NULL, 0, 0);
+        socks_replies(c, SOCKS_COMMAND_NOT_SUPPORTED, NULL);
+        return -1;
+    }
+
+    return -1;
+}
+
+int socks_serve(struct socks_conn *c, int fd, uint16_t flags)
+{
+    if (fd == c->srcfd)
+        c->src_ready |= flags;
+    else
+        c->dst_ready |= flags;
+
+#ifdef __linux__
+    if (c->pipes) {
+        if (socks_splice(c, c->srcfd, &c->src_ready, c->dstfd, &c->dst_ready,
+                         c->up_pipe, &c->up_len, SOCKS_UP) == -1)
+            return -1;
+
+        if (socks_splice(c, c->dstfd, &c->dst_ready, c->srcfd, &c->src_ready,
+                         c->down_pipe, &c->down_len, SOCKS_DOWN) == -1)
+            return -1;
+    } else
+#endif
+    {
+        if (socks_relay(c, c->srcfd, &c->src_ready, c->dstfd, &c->dst_ready,
+                        &c->up, SOCKS_UP) == -1)
+            return -1;
+
+        if (socks_relay(c, c->dstfd, &c->dst_ready, c->srcfd, &c->src_ready,
+                        &c->down, SOCKS_DOWN) == -1)
+            return -1;
     }
 
+    /* both sides sent EOF and everything was forwarded. */
+    if (c->shut == (SOCKS_UP | SOCKS_DOWN))
+        return -1;
+
+    return 0;
+}
+
+int socks_pending(const struct socks_conn *c, uint8_t dir)
+{
+    if (c->pipes)
+        return (dir == SOCKS_UP) ? c->up_len != 0 : c->down_len != 0;
+
+    return !ring_empty((dir == SOCKS_UP) ? &c->up : &c->down);
+}
+
+static int socks_serve_start(struct socks_conn *c)
+{
+    ssize_t n;
+
+    c->state = SOCKS_SERVE;
+    /* assume both sides ready, the relay clears what would block. */
+    c->src_ready = c->dst_ready = EV_READ | EV_WRITE;
+
+#ifdef __linux__
+    if (c->pipes && (pipe_pool_get(c->pipes, c->up_pipe) == -1 ||
+                     pipe_pool_get(c->pipes, c->down_pipe) == -1)) {
+        pw_debug("no pipes, fall back to the buffered relay\n");
+        pipe_pool_put(c->pipes, c->up_pipe, 1);
+        c->pipes = NULL;
+    }
+#else
+    c->pipes = NULL;
+#endif
+
+    if (c->in_len == 0)
+        return 0;
+
+    /* what the client sent right after the CONNECT goes out first. */
+#ifdef __linux__
+    if (c->pipes) {
+        n = write(c->up_pipe[1], c->in, c->in_len);
+        if (n == -1) {
+            pw_error("write");
+            return -1;
+        }
+        c->up_len += n;
+    } else
+#endif
+    {
+        n = ring_put(&c->up, c->in, c->in_len);
+    }
+
+    c->up_bytes += n;
+    c->in_len = 0;
+
     return 0;
 }
 
-int socks_serve(struct socks_conn *c, int fd)
+/**
+ * Move bytes from -> r -> to until either side would block. Reading stops
+ * while r is full, the caller waits for EV_WRITE on `to` in that case.
+ */
+static int socks_relay(struct socks_conn *c, int from, uint8_t *from_ready,
+                       int to, uint8_t *to_ready, struct ring *r, uint8_t dir)
 {
-    char buf[1024] = {0};
-    int n;
+    ssize_t n;
 
     while (1) {
-        n = read(fd, buf, sizeof(buf));
-        if (n <= 0) {
+        while (!ring_empty(r) && (*to_ready & EV_WRITE)) {
+            n = ring_write(r, to);
             if (n == -1) {
-                if (errno == EAGAIN)
-                    break;
+                if (errno != EAGAIN) {
+                    pw_error("write");
+                    return -1;
+                }
+                *to_ready &= ~EV_WRITE;
+            }
+        }
+
+        if ((c->eof & dir) || !(*from_ready & EV_READ) || ring_full(r))
+            break;
+
+        n = ring_read(r, from);
+        if (n == 0) {
+            c->eof |= dir;
+            continue; /* flush what is left before the EOF */
+        }
+        if (n == -1) {
+            if (errno != EAGAIN) {
                 pw_error("read");
+                return -1;
             }
+            *from_ready &= ~EV_READ;
+        } else if (dir == SOCKS_UP) {
+            c->up_bytes += n;
+        } else {
+            c->down_bytes += n;
+        }
+    }
+
+    if ((c->eof & dir) && !(c->shut & dir) && ring_empty(r)) {
+        if (shutdown(to, SHUT_WR) == -1 && errno != ENOTCONN) {
+            pw_error("shutdown");
             return -1;
         }
-        if (write(fd == c->srcfd ? c->dstfd : c->srcfd, buf, n) == -1) {
-            pw_error("write");
+        c->shut |= dir;
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+/**
+ * Zero-copy variant of socks_relay: from -> pipe -> to with splice(2), the
+ * bytes never enter user space. *len tracks what is parked in the pipe.
+ */
+static int socks_splice(struct socks_conn *c, int from, uint8_t *from_ready,
+                        int to, uint8_t *to_ready, int pipe[2], uint32_t *len,
+                        uint8_t dir)
+{
+    ssize_t n;
+
+    while (1) {
+        while (*len > 0 && (*to_ready & EV_WRITE)) {
+            n = splice(pipe[0], NULL, to, NULL, *len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1) {
+                if (errno != EAGAIN) {
+                    pw_error("splice");
+                    return -1;
+                }
+                *to_ready &= ~EV_WRITE;
+            } else {
+                *len -= n;
+            }
+        }
+
+        if ((c->eof & dir) || !(*from_ready & EV_READ) ||
+            *len >= PIPE_POOL_PIPE_SIZE)
+            break;
+
+        n = splice(from, NULL, pipe[1], NULL, PIPE_POOL_PIPE_SIZE - *len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            c->eof |= dir;
+            continue;
+        }
+        if (n == -1) {
+            if (errno != EAGAIN) {
+                pw_error("splice");
+                return -1;
+            }
+            /**
+             * With bytes parked EAGAIN may also mean the pipe ran out of
+             * slots, only an empty pipe proves the socket is drained.
+             */
+            if (*len == 0)
+                *from_ready &= ~EV_READ;
+            else if (!(*to_ready & EV_WRITE))
+                break;
+            continue;
+        }
+        *len += n;
+        if (dir == SOCKS_UP)
+            c->up_bytes += n;
+        else
+            c->down_bytes += n;
+    }
+
+    if ((c->eof & dir) && !(c->shut & dir) && *len == 0) {
+        if (shutdown(to, SHUT_WR) == -1 && errno != ENOTCONN) {
+            pw_error("shutdown");
             return -1;
         }
+        c->shut |= dir;
     }
 
     return 0;
 }
+#endif
 
-static int socks_replies(struct socks_conn *c, uint8_t rep, uint8_t atyp,
-                         const char *addr, int addrlen, uint16_t port)
+static int socks_replies(struct socks_conn *c, uint8_t rep,
+                         const struct sockaddr_storage *bnd)
 {
     /**
      * +----+-----+-------+------+----------+----------+
@@ -370,106 +898,411 @@ static int socks_replies(struct socks_conn *c, uint8_t rep, uint8_t atyp,
      * | 1  |  1  | X'00' |  1   | Variable |    2     |
      * +----+-----+-------+------+----------+----------+
      */
-    char buf[] = {SOCKS_VER, rep, 0, SOCKS_IPv4, 0, 0, 0, 0, 0, 0};
+    uint8_t buf[4 + 16 + 2] = {SOCKS_VER, rep, 0, SOCKS_IPv4};
+    const struct sockaddr_in *si = (const void *)bnd;
+    const struct sockaddr_in6 *si6 = (const void *)bnd;
+    size_t len = 4 + 4 + 2; /* 0.0.0.0:0 without bnd */
+
+    c->reply = rep;
+
+    if (bnd && bnd->ss_family == AF_INET) {
+        memcpy(buf + 4, &si->sin_addr, 4);
+        memcpy(buf + 8, &si->sin_port, 2);
+    } else if (bnd && IN6_IS_ADDR_V4MAPPED(&si6->sin6_addr)) {
+        /* a dual-stack listener, the client spoke IPv4 */
+        memcpy(buf + 4, &si6->sin6_addr.s6_addr[12], 4);
+        memcpy(buf + 8, &si6->sin6_port, 2);
+    } else if (bnd) {
+        buf[3] = SOCKS_IPv6;
+        memcpy(buf + 4, &si6->sin6_addr, 16);
+        memcpy(buf + 20, &si6->sin6_port, 2);
+        len = 4 + 16 + 2;
+    }
 
-    if (write(c->srcfd, buf, sizeof(buf)) == -1) {
+    if (write(c->srcfd, buf, len) == -1) {
         pw_error("write");
         return -1;
     }
 
-#if 0
-  /* TODO */
-  char buf[1024] = {};
-  struct
-  {
-    uint8_t ver;
-    uint8_t rep;
-    uint8_t rsv;
-    uint8_t atyp;
-  } *hdr = (void *)buf;
-
-  hdr->ver = SOCKS_VER;
-  hdr->rep = rep;
-  hdr->rsv = 0;
-  hdr->atyp = atyp;
-#endif
+    return 0;
+}
+
+static uint8_t socks_errno_reply(int err)
+{
+    return (err == ENETUNREACH)    ? SOCKS_NETWORK_UNREACHABLE
+           : (err == EHOSTUNREACH) ? SOCKS_HOST_UNREACHABLE
+           : (err == ETIMEDOUT)    ? SOCKS_HOST_UNREACHABLE
+           : (err == ECONNREFUSED) ? SOCKS_CONNECTION_REFUSED
+                                   : SOCKS_FAILURE;
+}
+
+#ifdef MSG_FASTOPEN
+/**
+ * Connect with the bytes the client sent after the command in the SYN. The
+ * kernel sends them only with a cookie of the target, else it asks for one
+ * and the connect goes on as usual, EINPROGRESS like connect(2).
+ */
+static int socks_connect_fastopen(struct socks_conn *c, int fd,
+                                  const struct sockaddr *sa, socklen_t salen)
+{
+    ssize_t n;
+
+    n = sendto(fd, c->in + c->in_used, c->in_len - c->in_used, MSG_FASTOPEN,
+               sa, salen);
+    if (n == -1) {
+        /* the client side is off in net.ipv4.tcp_fastopen */
+        if (errno == EOPNOTSUPP)
+            return connect(fd, sa, salen);
+        return -1;
+    }
+
+    c->tfo_fd = fd;
+    c->tfo_len = n;
+    c->fastopen |= SOCKS_TFO_OUT;
 
     return 0;
 }
+#endif
 
-static int socks_ip_connect(struct socks_conn *c, in_addr_t addr,
-                            in_port_t port)
+/* start a non-blocking connect to addr, the result is picked up on EV_WRITE. */
+static int socks_connect_start(struct socks_conn *c,
+                               const struct resolv_addr *addr)
 {
-    struct sockaddr_in si = {
-        .sin_family = AF_INET, .sin_addr = addr, .sin_port = htons(port)};
-    int fd, ret = SOCKS_SUCCEEDED;
+    struct sockaddr_storage ss = {};
+    struct sockaddr_in *si = (struct sockaddr_in *)&ss;
+    struct sockaddr_in6 *si6 = (struct sockaddr_in6 *)&ss;
+    socklen_t sslen;
+    int fd, ret;
+
+    if (addr->family == AF_INET) {
+        si->sin_family = AF_INET;
+        si->sin_addr = addr->in.v4;
+        si->sin_port = htons(c->port);
+        sslen = sizeof(struct sockaddr_in);
+    } else {
+        si6->sin6_family = AF_INET6;
+        si6->sin6_addr = addr->in.v6;
+        si6->sin6_port = htons(c->port);
+        sslen = sizeof(struct sockaddr_in6);
+    }
 
-    fd = socket(PF_INET, SOCK_STREAM, 0);
+    fd = socket(addr->family, SOCK_STREAM, 0);
     if (fd == -1) {
+        c->race_err = errno;
         pw_error("socket");
-        ret = SOCKS_FAILURE;
-        goto end;
+        return -1;
     }
 
-    /* TODO: add connect timeout */
-
-    if (connect(fd, (struct sockaddr *)&si, sizeof(si)) == -1) {
-        ret = (errno == ENETUNREACH)    ? SOCKS_NETWORK_UNREACHABLE
-              : (errno == EHOSTUNREACH) ? SOCKS_HOST_UNREACHABLE
-              : (errno == ECONNREFUSED) ? SOCKS_CONNECTION_REFUSED
-                                        : SOCKS_FAILURE;
+    if (set_nonblocking(fd, 1) == -1) {
+        c->race_err = errno;
         close(fd);
+        return -1;
+    }
+
+#ifdef MSG_FASTOPEN
+    if (c->socks && c->socks->fastopen && c->tfo_fd == -1 &&
+        c->in_len > c->in_used)
+        ret = socks_connect_fastopen(c, fd, (struct sockaddr *)&ss, sslen);
+    else
+#endif
+        ret = connect(fd, (struct sockaddr *)&ss, sslen);
+
+    if (ret == -1 && errno != EINPROGRESS) {
+        c->race_err = errno;
         pw_error("connect");
-    } else {
-        c->dstfd = fd;
+        close(fd);
+        return -1;
     }
 
-end:
-    return ret;
+    return fd;
 }
 
-static int socks_domain_connect(struct socks_conn *c, const char *domain,
-                                in_port_t port)
+/* the single address of a CONNECT to an IPv4 or IPv6 address. */
+static int socks_race_literal(struct socks_conn *c,
+                              const struct resolv_addr *addr)
 {
-    struct addrinfo hints = {}, *addr_list, *curr;
-    int fd, ret = SOCKS_SUCCEEDED;
-    char portstr[8] = {};
+    c->addrs[0] = *addr;
+    c->naddrs = 1;
+    c->next_addr = 0;
 
-    sprintf(portstr, "%d", port);
+    if (socks_race_next(c) == -1) {
+        socks_race_fail(c);
+        return -1;
+    }
 
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    return 0;
+}
 
-    if (getaddrinfo(domain, portstr, &hints, &addr_list) == -1) {
-        pw_error("getaddrinfo");
-        return -1;
+static int socks_addr_equal(const struct resolv_addr *a,
+                            const struct resolv_addr *b)
+{
+    if (a->family != b->family)
+        return 0;
+    if (a->family == AF_INET)
+        return a->in.v4.s_addr == b->in.v4.s_addr;
+    return memcmp(&a->in.v6, &b->in.v6, sizeof(a->in.v6)) == 0;
+}
+
+/**
+ * Order the addresses not tried yet: known RTTs first, fastest first, then
+ * the unknown ones alternating between the families, IPv6 first unless it
+ * was tried last (RFC 8305 section 4), then those that failed recently.
+ */
+static void socks_race_rank(struct socks_conn *c)
+{
+    struct resolv_addr known[SOCKS_MAX_ADDRS], v6[SOCKS_MAX_ADDRS],
+        v4[SOCKS_MAX_ADDRS], failed[SOCKS_MAX_ADDRS];
+    uint32_t rtt[SOCKS_MAX_ADDRS], r;
+    int nknown = 0, n6 = 0, n4 = 0, nfailed = 0, i, j, k, six;
+
+    for (i = c->next_addr; i < c->naddrs; i++) {
+        r = c->rtts ? rtt_get(c->rtts, &c->addrs[i]) : 0;
+        if (r >= RTT_FAILED) {
+            failed[nfailed++] = c->addrs[i];
+        } else if (r > 0) {
+            /* insertion sort, there are a handful */
+            for (j = nknown; j > 0 && rtt[j - 1] > r; j--) {
+                known[j] = known[j - 1];
+                rtt[j] = rtt[j - 1];
+            }
+            known[j] = c->addrs[i];
+            rtt[j] = r;
+            nknown++;
+        } else if (c->addrs[i].family == AF_INET6) {
+            v6[n6++] = c->addrs[i];
+        } else {
+            v4[n4++] = c->addrs[i];
+        }
     }
 
-    for (curr = addr_list; curr; curr = curr->ai_next) {
-        fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
-        if (fd == -1) {
-            pw_error("socket");
-            ret = -1;
-            continue;
+    k = c->next_addr;
+    for (i = 0; i < nknown; i++)
+        c->addrs[k++] = known[i];
+
+    six = !(k > 0 && c->addrs[k - 1].family == AF_INET6);
+    for (i = 0, j = 0; i < n6 || j < n4; six = !six) {
+        if ((six && i < n6) || j >= n4)
+            c->addrs[k++] = v6[i++];
+        else
+            c->addrs[k++] = v4[j++];
+    }
+
+    for (i = 0; i < nfailed; i++)
+        c->addrs[k++] = failed[i];
+}
+
+void socks_race_addrs(struct socks_conn *c, const struct resolv_answer *ans)
+{
+    int i, j;
+
+    for (i = 0; i < ans->count && c->naddrs < SOCKS_MAX_ADDRS; i++) {
+        for (j = 0; j < c->naddrs; j++) {
+            if (socks_addr_equal(&c->addrs[j], &ans->addrs[i]))
+                break;
         }
+        if (j == c->naddrs)
+            c->addrs[c->naddrs++] = ans->addrs[i];
+    }
 
-        /* TODO: add connect timeout */
+    socks_race_rank(c);
+}
 
-        if (connect(fd, curr->ai_addr, curr->ai_addrlen) == -1) {
-            ret = (errno == ENETUNREACH)    ? SOCKS_NETWORK_UNREACHABLE
-                  : (errno == EHOSTUNREACH) ? SOCKS_HOST_UNREACHABLE
-                  : (errno == ECONNREFUSED) ? SOCKS_CONNECTION_REFUSED
-                                            : SOCKS_FAILURE;
-            pw_error("connect");
-            close(fd);
+int socks_race_more(const struct socks_conn *c)
+{
+    return c->next_addr < c->naddrs && c->nrace < SOCKS_RACE_MAX;
+}
+
+int socks_race_next(struct socks_conn *c)
+{
+    int fd;
+
+    while (socks_race_more(c)) {
+        fd = socks_connect_start(c, &c->addrs[c->next_addr]);
+        if (fd == -1) {
+            /* like no IPv6 route, move on right away */
+            if (c->rtts)
+                rtt_update(c->rtts, &c->addrs[c->next_addr], RTT_FAILED);
+            c->next_addr++;
             continue;
         }
-        break;
+
+        c->race[c->nrace] = fd;
+        c->race_addr[c->nrace] = c->next_addr++;
+        c->race_start[c->nrace] = ev_timer_now_us();
+        c->nrace++;
+        c->state = SOCKS_CONNECTING;
+
+        return fd;
+    }
+
+    return -1;
+}
+
+uint32_t socks_race_delay(const struct socks_conn *c)
+{
+    uint32_t r;
+
+    if (!c->rtts || c->nrace == 0)
+        return SOCKS_RACE_DELAY;
+
+    r = rtt_get(c->rtts, &c->addrs[c->race_addr[c->nrace - 1]]);
+    if (r == 0 || r >= RTT_FAILED)
+        return SOCKS_RACE_DELAY;
+
+    /* twice the RTT known for it, bounded like RFC 8305 section 5 says */
+    r = r * 2 / 1000;
+    if (r < SOCKS_RACE_DELAY_MIN)
+        return SOCKS_RACE_DELAY_MIN;
+    if (r > SOCKS_RACE_DELAY_MAX)
+        return SOCKS_RACE_DELAY_MAX;
+    return r;
+}
+
+static int socks_race_find(const struct socks_conn *c, int fd)
+{
+    int i;
+
+    for (i = 0; i < c->nrace; i++) {
+        if (c->race[i] == fd)
+            return i;
+    }
+
+    return -1;
+}
+
+void socks_race_drop(struct socks_conn *c, int fd)
+{
+    int i = socks_race_find(c, fd);
+
+    if (i == -1)
+        return;
+
+    /* it failed, the next connect may carry the bytes in its SYN. */
+    if (fd == c->tfo_fd) {
+        c->tfo_fd = -1;
+        c->tfo_len = 0;
     }
 
+    close(fd);
+    c->nrace--;
+    c->race[i] = c->race[c->nrace];
+    c->race_addr[i] = c->race_addr[c->nrace];
+    c->race_start[i] = c->race_start[c->nrace];
+}
+
+int socks_race_check(struct socks_conn *c, int fd)
+{
+    socklen_t len = sizeof(int);
+    uint64_t us;
+    int i, err = 0;
+
+    i = socks_race_find(c, fd);
+    if (i == -1)
+        return -1;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+
+    us = (err == 0) ? ev_timer_now_us() - c->race_start[i] : RTT_FAILED;
+    if (c->rtts)
+        rtt_update(c->rtts, &c->addrs[c->race_addr[i]],
+                   us < RTT_FAILED ? us : RTT_FAILED);
+
+    if (err == 0)
+        return 0;
+
+    c->race_err = err;
+    errno = err;
+    pw_error("connect");
+
+    socks_race_drop(c, fd);
+
+    return -1;
+}
+
+int socks_race_won(struct socks_conn *c, int fd)
+{
+    int i;
+
+    for (i = 0; i < c->nrace; i++) {
+        if (c->race[i] != fd)
+            close(c->race[i]);
+    }
+    c->nrace = 0;
     c->dstfd = fd;
-    freeaddrinfo(addr_list);
 
-    return ret;
+    /* the kernel sends what the SYN took, also if the target refused it. */
+    if (fd == c->tfo_fd) {
+        c->in_len -= c->tfo_len;
+        memmove(c->in, c->in + c->tfo_len, c->in_len);
+        c->up_bytes += c->tfo_len;
+        if (socks_syn_data(fd))
+            c->fastopen |= SOCKS_TFO_ACKED;
+    }
+
+    if (socks_serve_start(c) == -1)
+        return -1;
+
+    return socks_replies(c, SOCKS_SUCCEEDED, NULL);
+}
+
+void socks_race_fail(struct socks_conn *c)
+{
+    if (c->race_err == 0) {
+        pw_debug("resolve %s failed\n", c->domain);
+        socks_replies(c, SOCKS_HOST_UNREACHABLE, NULL);
+        return;
+    }
+
+    socks_replies(c, socks_errno_reply(c->race_err), NULL);
+}
+
+void socks_connect_timeout(struct socks_conn *c)
+{
+    int i;
+
+    /* too slow to be tried first next time */
+    for (i = 0; c->rtts && i < c->nrace; i++)
+        rtt_update(c->rtts, &c->addrs[c->race_addr[i]], RTT_FAILED);
+
+    socks_replies(c, SOCKS_TTL_EXPIRED, NULL);
+}
+
+int socks_udp_associate(struct socks_conn *c, struct socks_udp_batch *b,
+                        socks_udp_lookup_t *lookup)
+{
+    struct sockaddr_storage bnd;
+    socklen_t len = sizeof(bnd);
+
+    c->udp = socks_udp_new(c->srcfd, &c->addr, b, lookup);
+    if (!c->udp ||
+        getsockname(c->udp->fd, (struct sockaddr *)&bnd, &len) == -1) {
+        socks_replies(c, SOCKS_FAILURE, NULL);
+        return -1;
+    }
+
+    /* the control conn carries nothing from now on */
+    c->in_len = 0;
+
+    return socks_replies(c, SOCKS_SUCCEEDED, &bnd);
+}
+
+int socks_udp_control(struct socks_conn *c)
+{
+    char buf[512];
+    ssize_t n;
+
+    while (1) {
+        n = read(c->srcfd, buf, sizeof(buf));
+        if (n > 0)
+            continue; /* ignored */
+        if (n == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        pw_error("read");
+        return -1;
+    }
 }
@@ -4,15 +4,48 @@
 #define _PW_SOCKS_H
 
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <stdint.h>
 
+#include "buffer.h"
+#include "ev.h"
+#include "resolv.h"
+#include "socks_udp.h"
+
 #define SOCKS_VER 5
+/**
+ * Handshake bytes read ahead per conn. The longest message, a username and
+ * password request, is 513 bytes, the rest of a pipelined handshake and
+ * the first application bytes after a CONNECT fit along with it.
+ */
+#define SOCKS_IN_SIZE 1024
+/* addresses of the A and AAAA answers for a domain */
+#define SOCKS_MAX_ADDRS (2 * RESOLV_MAX_ADDRS)
+#define SOCKS_RACE_MAX 4     /* connects of a conn in flight at once */
+#define SOCKS_RACE_DELAY 250 /* ms to the next connect, RFC 8305 */
+#define SOCKS_RACE_DELAY_MIN 100
+#define SOCKS_RACE_DELAY_MAX 2000
+/* ms an A answer waits for the AAAA one, RFC 8305 */
+#define SOCKS_RESOLUTION_DELAY 50
+
+struct pool;
+struct pipe_pool;
+struct rtt_table;
 
 enum {
     SOCKS_METHOD = 0x01,
     SOCKS_AUTH = 0x02,
     SOCKS_CMD = 0x03,
     SOCKS_SERVE = 0x04,
+    SOCKS_CONNECTING = 0x05,
+    SOCKS_RESOLVING = 0x06,
+    SOCKS_UDP = 0x07, /* relaying the datagrams of a UDP ASSOCIATE */
+};
+
+/* relay directions, used as bits of socks_conn.eof and socks_conn.shut */
+enum {
+    SOCKS_UP = 0x01,   /* srcfd -> dstfd */
+    SOCKS_DOWN = 0x02, /* dstfd -> srcfd */
 };
 
 enum {
@@ -27,33 +60,184 @@ enum {
     SOCKS_IPv6 = 0x04,
 };
 
+/* flags of socks_create */
+enum {
+    SOCKS_REUSEPORT = 0x01, /* join the SO_REUSEPORT group of host:port */
+    SOCKS_FASTOPEN = 0x02,  /* TCP Fast Open, for clients and upstream */
+};
+
+/* SYNs with data a listener queues before falling back to a handshake */
+#define SOCKS_FASTOPEN_QLEN 256
+
+/* c->fastopen */
+enum {
+    SOCKS_TFO_IN = 0x01,    /* the client's SYN carried data, accepted */
+    SOCKS_TFO_OUT = 0x02,   /* client bytes went out in an upstream SYN */
+    SOCKS_TFO_ACKED = 0x04, /* the target took them, its cookie was valid */
+};
+
 struct socks {
     char user[256];
     char passwd[256];
     uint8_t use_auth;
+    uint8_t fastopen; /* SOCKS_FASTOPEN was given */
     int fd;
 };
 
 struct socks_conn {
     struct socks *socks;
+    struct pool *pool; /* allocator of this conn, NULL for the heap */
     uint8_t state;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen;
     int srcfd;
     int dstfd;
+    struct event_timer timer;      /* deadline, managed by the caller */
+    struct event_timer race_timer; /* next connect, managed by the caller */
+    struct resolv_query *query;  /* A lookup of domain, managed by the caller */
+    struct resolv_query *query6; /* AAAA lookup, as well */
+    char domain[RESOLV_MAX_NAME + 1]; /* DST.ADDR of a domain CONNECT */
+    in_port_t port;                   /* DST.PORT, host byte order */
+    struct resolv_addr addrs[SOCKS_MAX_ADDRS]; /* to connect to, ranked */
+    uint8_t naddrs;
+    uint8_t next_addr;         /* next one to try */
+    struct rtt_table *rtts;    /* connect RTTs to rank addrs by, or NULL */
+    int race[SOCKS_RACE_MAX];  /* connects in flight */
+    uint8_t race_addr[SOCKS_RACE_MAX];   /* their index in addrs */
+    uint64_t race_start[SOCKS_RACE_MAX]; /* us */
+    uint8_t nrace;
+    int race_err; /* errno of the last connect that failed */
+    int tfo_fd;   /* the connect whose SYN carries tfo_len bytes, or -1 */
+    uint16_t tfo_len;
+    uint8_t fastopen; /* SOCKS_TFO_* */
     uint8_t method;
     uint8_t address_type;
     uint8_t command;
+    uint8_t src_ready;  /* EV_* readiness seen on srcfd, edge triggered */
+    uint8_t dst_ready;  /* EV_* readiness seen on dstfd */
+    uint8_t src_events; /* EV_* registered for srcfd */
+    uint8_t dst_events; /* EV_* registered for dstfd */
+    uint8_t eof;        /* directions whose reader saw EOF */
+    uint8_t shut;       /* directions whose writer was shut down */
+    struct pipe_pool *pipes; /* relay with splice(2) when set */
+    int up_pipe[2];
+    int down_pipe[2];
+    uint32_t up_len;   /* bytes parked in up_pipe */
+    uint32_t down_len; /* bytes parked in down_pipe */
+    uint8_t reply;       /* REP of a failure reply sent, 0 for none */
+    uint8_t auth_failed; /* the client sent wrong credentials */
+    uint64_t up_bytes;   /* relayed srcfd -> dstfd, reset by the caller */
+    uint64_t down_bytes; /* relayed dstfd -> srcfd, reset by the caller */
+    uint64_t born;       /* accepted, us, managed by the caller */
+    uint64_t since;      /* the state was entered, us, as well */
+    uint8_t first_byte;  /* a byte came from dstfd already */
+    struct socks_udp *udp; /* the relay of a UDP ASSOCIATE */
+    uint16_t in_len;     /* bytes in `in` */
+    uint16_t in_used;    /* of them, the message being handled */
+    /* keep the buffers last, they are not cleared on accept. */
+    uint8_t in[SOCKS_IN_SIZE]; /* read ahead of the handshake */
+    struct ring up;            /* srcfd -> dstfd */
+    struct ring down; /* dstfd -> srcfd */
 };
 
 struct socks *socks_create(const char *host, uint16_t port, const char *u,
-                           const char *p);
+                           const char *p, int flags);
+/**
+ * Serve on a listening socket of a previous process, e.g. passed across
+ * exec(2) on an upgrade. fd is taken over, and closed if it does not listen
+ * on host:port or SO_REUSEPORT differs from flags, create a new one then.
+ */
+struct socks *socks_inherit(int fd, const char *host, uint16_t port,
+                            const char *u, const char *p, int flags);
+/**
+ * Steer new connections of the SO_REUSEPORT group of s by the CPU that
+ * received them, to the listener that joined the group (cpu % n)th.
+ */
+int socks_steer_cpu(struct socks *s, uint16_t n);
 void socks_close(struct socks *s);
-struct socks_conn *socks_accept_conn(struct socks *s);
+/**
+ * Accept a conn with a non-blocking srcfd, NULL with errno EAGAIN once the
+ * backlog is empty. pool may be NULL, conns are then allocated from the heap.
+ */
+struct socks_conn *socks_accept_conn(struct socks *s, struct pool *pool);
+/* the accepting half of socks_accept_conn, a non-blocking fd or -1. */
+int socks_accept(struct socks *s, struct sockaddr_storage *addr,
+                 socklen_t *addrlen);
+/* a conn in SOCKS_METHOD on fd, which it owns and closes from now on. */
+struct socks_conn *socks_conn_new(struct socks *s, struct pool *pool, int fd,
+                                  const struct sockaddr_storage *addr,
+                                  socklen_t addrlen);
 void socks_close_conn(struct socks_conn *c);
+/**
+ * Handle the next message of the handshake, from the bytes read ahead into
+ * c->in or else from srcfd, which is read until it would block. Returns 1
+ * once a message was handled, c->state tells what comes next, 0 if srcfd
+ * has no more bytes for now and -1 on failure. Clients may pipeline the
+ * handshake, call it again while it returns 1 in a handshake state.
+ *
+ * A CONNECT to an address is left in SOCKS_CONNECTING with a connect in
+ * c->race, wait for EV_WRITE, or in SOCKS_RESOLVING for a domain, resolve
+ * c->domain and see socks_race_addrs. Bytes that followed it in c->in are
+ * relayed first once connected. With SOCKS_FASTOPEN they go out in the SYN
+ * (MSG_FASTOPEN) of a connect, of only one connect of a race at a time.
+ */
+int socks_handshake(struct socks_conn *c);
+/**
+ * The message parsers behind socks_handshake, on the bytes at the head of
+ * c->in. They return its length once handled, 0 while it is incomplete.
+ */
 int socks_get_method(struct socks_conn *c);
 int socks_authenticate(struct socks_conn *c);
 int socks_command(struct socks_conn *c);
-int socks_serve(struct socks_conn *c, int fd);
+/**
+ * Happy Eyeballs (RFC 8305): connects to the addresses of a domain are
+ * started one after the other, socks_race_delay apart or as soon as one
+ * fails, and the first to connect wins. Addresses with a known connect RTT
+ * go first, fastest first, the others alternate between IPv6 and IPv4.
+ *
+ * Add the addresses of an answer for c->domain, before or during the race.
+ */
+void socks_race_addrs(struct socks_conn *c, const struct resolv_answer *ans);
+/**
+ * Start a connect to the next address, returns its fd, which is in c->race
+ * and the conn in SOCKS_CONNECTING, or -1 if none is left to start.
+ */
+int socks_race_next(struct socks_conn *c);
+/* whether socks_race_next has an address to start. */
+int socks_race_more(const struct socks_conn *c);
+/* ms to give the connect started last before starting the next. */
+uint32_t socks_race_delay(const struct socks_conn *c);
+/**
+ * The connect on fd became writable. Returns 0 if it succeeded, -1 if it
+ * failed, fd is closed and out of the race then.
+ */
+int socks_race_check(struct socks_conn *c, int fd);
+/* close fd and take it out of the race. */
+void socks_race_drop(struct socks_conn *c, int fd);
+/**
+ * fd connected first and becomes dstfd, the other connects are closed,
+ * unregister them before. The reply is sent and the conn is in SOCKS_SERVE.
+ */
+int socks_race_won(struct socks_conn *c, int fd);
+/* nothing is left to try, send the error reply of the last failure. */
+void socks_race_fail(struct socks_conn *c);
+/* the connect deadline expired, reply TTL expired. */
+void socks_connect_timeout(struct socks_conn *c);
+/**
+ * Set up the relay of a conn in SOCKS_UDP, the command was UDP ASSOCIATE,
+ * and send the reply naming its address. The caller waits for EV_READ on
+ * the fds of c->udp, see socks_udp_serve, and on srcfd.
+ */
+int socks_udp_associate(struct socks_conn *c, struct socks_udp_batch *b,
+                        socks_udp_lookup_t *lookup);
+/**
+ * srcfd of a conn in SOCKS_UDP became readable, the association ends with
+ * the control conn. Returns -1 once it is closed.
+ */
+int socks_udp_control(struct socks_conn *c);
+/* relay between srcfd and dstfd, fd became ready for flags. */
+int socks_serve(struct socks_conn *c, int fd, uint16_t flags);
+/* whether the relay holds bytes for direction dir (SOCKS_UP/SOCKS_DOWN). */
+int socks_pending(const struct socks_conn *c, uint8_t dir);
 
 #endif /* socks.h */
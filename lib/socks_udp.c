@@ -0,0 +1,594 @@
+/* socks_udp.c */
+
+#include "socks_udp.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#    include <netinet/udp.h>
+#endif
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "misc.h"
+
+#ifndef __linux__
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+#define SOCKS_UDP_OUT (SOCKS_UDP_BATCH * 2) /* datagrams queued to send */
+#define SOCKS_UDP_SEGS 64 /* most segments of a GRO or GSO train, Linux */
+#define SOCKS_UDP_GSO_MAX 65000 /* bytes of a GSO send, below the UDP max */
+
+/* a cmsg buffer, aligned like one. */
+union socks_udp_ctrl {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+struct socks_udp_batch {
+    /* the datagrams of a recvmmsg */
+    struct mmsghdr in[SOCKS_UDP_BATCH];
+    struct iovec in_iov[SOCKS_UDP_BATCH];
+    struct sockaddr_storage in_addr[SOCKS_UDP_BATCH];
+    union socks_udp_ctrl in_ctrl[SOCKS_UDP_BATCH];
+    /* queued for a sendmmsg on out_fd, the payload stays in buf */
+    struct mmsghdr out[SOCKS_UDP_OUT];
+    struct iovec out_iov[SOCKS_UDP_OUT][2];
+    struct sockaddr_storage out_addr[SOCKS_UDP_OUT];
+    uint8_t out_hdr[SOCKS_UDP_OUT][SOCKS_UDP_HDR_MAX];
+    int out_fd;
+    int nout;
+    int gso; /* UDP_SEGMENT works, until it fails once */
+    /* a GRO train with the header put before every segment, for GSO */
+    char train[SOCKS_UDP_GSO_MAX];
+    char buf[SOCKS_UDP_BATCH][SOCKS_UDP_BUF];
+};
+
+struct socks_udp_batch *socks_udp_batch_new(void)
+{
+    struct socks_udp_batch *b;
+
+    b = calloc(1, sizeof(struct socks_udp_batch));
+    if (!b) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+#ifdef UDP_SEGMENT
+    b->gso = 1;
+#endif
+
+    return b;
+}
+
+void socks_udp_batch_destroy(struct socks_udp_batch *b)
+{
+    free(b);
+}
+
+static int socks_udp_recv(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+#ifdef __linux__
+    return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+    unsigned int i;
+    ssize_t r;
+
+    for (i = 0; i < n; i++) {
+        r = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (r == -1)
+            return i ? (int)i : -1;
+        msgs[i].msg_len = r;
+    }
+    return n;
+#endif
+}
+
+static int socks_udp_send(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+#ifdef __linux__
+    return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+    unsigned int i;
+    ssize_t r;
+
+    for (i = 0; i < n; i++) {
+        r = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (r == -1)
+            return i ? (int)i : -1;
+        msgs[i].msg_len = r;
+    }
+    return n;
+#endif
+}
+
+/* a non-blocking UDP socket, receiving GRO trains where supported. */
+static int socks_udp_socket(int family)
+{
+    int fd, opt;
+
+    fd = socket(family, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return -1;
+
+    if (set_nonblocking(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (family == AF_INET6) {
+        /* v4-mapped addresses of a dual-stack listener */
+        opt = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    }
+
+#ifdef UDP_GRO
+    /* best effort, Linux 5.0 and newer */
+    opt = 1;
+    setsockopt(fd, IPPROTO_UDP, UDP_GRO, &opt, sizeof(opt));
+#else
+    (void)opt;
+#endif
+
+    return fd;
+}
+
+struct socks_udp *socks_udp_new(int ctlfd, const struct sockaddr_storage *peer,
+                                struct socks_udp_batch *b,
+                                socks_udp_lookup_t *lookup)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    struct socks_udp *u;
+
+    u = calloc(1, sizeof(struct socks_udp));
+    if (!u) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    u->fd = u->out4 = u->out6 = -1;
+    u->peer = *peer;
+    u->batch = b;
+    u->lookup = lookup;
+
+    /* where the client reached us, on a port of our choice */
+    if (getsockname(ctlfd, (struct sockaddr *)&local, &len) == -1) {
+        pw_error("getsockname");
+        goto err;
+    }
+    if (local.ss_family == AF_INET)
+        ((struct sockaddr_in *)&local)->sin_port = 0;
+    else
+        ((struct sockaddr_in6 *)&local)->sin6_port = 0;
+
+    u->fd = socks_udp_socket(local.ss_family);
+    if (u->fd == -1) {
+        pw_error("socket");
+        goto err;
+    }
+
+    if (bind(u->fd, (struct sockaddr *)&local, len) == -1) {
+        pw_error("bind");
+        goto err;
+    }
+
+    u->out4 = socks_udp_socket(AF_INET);
+    if (u->out4 == -1) {
+        pw_error("socket");
+        goto err;
+    }
+
+    /* without IPv6 its targets are dropped */
+    u->out6 = socks_udp_socket(AF_INET6);
+
+    return u;
+err:
+    socks_udp_close(u);
+    return NULL;
+}
+
+void socks_udp_close(struct socks_udp *u)
+{
+    if (u) {
+        if (u->fd != -1)
+            close(u->fd);
+        if (u->out4 != -1)
+            close(u->out4);
+        if (u->out6 != -1)
+            close(u->out6);
+        free(u);
+    }
+}
+
+static int socks_udp_addr_equal(const struct sockaddr_storage *a,
+                                const struct sockaddr_storage *b, int port)
+{
+    const struct sockaddr_in *a4 = (const void *)a, *b4 = (const void *)b;
+    const struct sockaddr_in6 *a6 = (const void *)a, *b6 = (const void *)b;
+
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    if (a->ss_family == AF_INET)
+        return a4->sin_addr.s_addr == b4->sin_addr.s_addr &&
+               (!port || a4->sin_port == b4->sin_port);
+
+    return memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) ==
+               0 &&
+           (!port || a6->sin6_port == b6->sin6_port);
+}
+
+/* only the host of the control conn, learning its port on the way. */
+static int socks_udp_from_client(struct socks_udp *u,
+                                 const struct sockaddr_storage *from,
+                                 socklen_t len)
+{
+    if (u->clientlen)
+        return socks_udp_addr_equal(from, &u->client, 1);
+
+    if (!socks_udp_addr_equal(from, &u->peer, 0))
+        return 0;
+
+    memcpy(&u->client, from, len);
+    u->clientlen = len;
+
+    return 1;
+}
+
+static void socks_udp_flush(struct socks_udp *u)
+{
+    struct socks_udp_batch *b = u->batch;
+    int i = 0, n;
+
+    while (i < b->nout) {
+        n = socks_udp_send(b->out_fd, b->out + i, b->nout - i);
+        if (n >= 0) {
+            i += n;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* the socket buffer is full, it is UDP */
+            u->dropped += b->nout - i;
+            break;
+        }
+        /* like an unreachable target, skip the datagram */
+        u->dropped++;
+        i++;
+    }
+
+    b->nout = 0;
+}
+
+/* queue hdr and data as a datagram to `to` on fd, data stays in place. */
+static void socks_udp_queue(struct socks_udp *u, int fd,
+                            const struct sockaddr_storage *to,
+                            socklen_t tolen, const uint8_t *hdr,
+                            size_t hdrlen, char *data, size_t len)
+{
+    struct socks_udp_batch *b = u->batch;
+    struct msghdr *msg;
+    int i;
+
+    if (b->nout && (b->out_fd != fd || b->nout == SOCKS_UDP_OUT))
+        socks_udp_flush(u);
+
+    i = b->nout++;
+    b->out_fd = fd;
+
+    memcpy(&b->out_addr[i], to, tolen);
+    if (hdrlen)
+        memcpy(b->out_hdr[i], hdr, hdrlen);
+    b->out_iov[i][0].iov_base = b->out_hdr[i];
+    b->out_iov[i][0].iov_len = hdrlen;
+    b->out_iov[i][1].iov_base = data;
+    b->out_iov[i][1].iov_len = len;
+
+    msg = &b->out[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &b->out_addr[i];
+    msg->msg_namelen = tolen;
+    msg->msg_iov = b->out_iov[i];
+    msg->msg_iovlen = 2;
+}
+
+/* the segment size of a GRO train, or len for a single datagram. */
+static size_t socks_udp_segment(struct msghdr *msg, size_t len)
+{
+#ifdef UDP_GRO
+    struct cmsghdr *cm;
+    int seg;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+            if (seg > 0 && (size_t)seg < len)
+                return seg;
+        }
+    }
+#endif
+    return len;
+}
+
+/**
+ * +----+------+------+----------+----------+----------+
+ * |RSV | FRAG | ATYP | DST.ADDR | DST.PORT |   DATA   |
+ * +----+------+------+----------+----------+----------+
+ * | 2  |  1   |  1   | Variable |    2     | Variable |
+ * +----+------+------+----------+----------+----------+
+ */
+static void socks_udp_forward_one(struct socks_udp *u, uint8_t *p,
+                                  size_t len, uint64_t *bytes)
+{
+    struct sockaddr_storage to = {};
+    struct sockaddr_in *si = (struct sockaddr_in *)&to;
+    struct sockaddr_in6 *si6 = (struct sockaddr_in6 *)&to;
+    struct resolv_addr addr;
+    size_t hdrlen;
+    char name[RESOLV_MAX_NAME + 1];
+    int fd;
+
+    /* fragments are not supported, section 7 allows dropping them */
+    if (len < 4 || p[0] != 0 || p[1] != 0 || p[2] != 0)
+        goto drop;
+
+    switch (p[3]) {
+    case 0x01: /* IPv4 */
+        hdrlen = 4 + 4 + 2;
+        if (len < hdrlen)
+            goto drop;
+        si->sin_family = AF_INET;
+        memcpy(&si->sin_addr, p + 4, 4);
+        memcpy(&si->sin_port, p + 8, 2);
+        break;
+    case 0x04: /* IPv6 */
+        hdrlen = 4 + 16 + 2;
+        if (len < hdrlen)
+            goto drop;
+        si6->sin6_family = AF_INET6;
+        memcpy(&si6->sin6_addr, p + 4, 16);
+        memcpy(&si6->sin6_port, p + 20, 2);
+        break;
+    case 0x03: /* DOMAINNAME */
+        if (len < 5 || p[4] == 0 || len < 5 + (size_t)p[4] + 2)
+            goto drop;
+        hdrlen = 5 + p[4] + 2;
+        memcpy(name, p + 5, p[4]);
+        name[p[4]] = '\0';
+        if (!u->lookup || u->lookup(name, &addr) == -1)
+            goto drop;
+        if (addr.family == AF_INET) {
+            si->sin_family = AF_INET;
+            si->sin_addr = addr.in.v4;
+            memcpy(&si->sin_port, p + 5 + p[4], 2);
+        } else {
+            si6->sin6_family = AF_INET6;
+            si6->sin6_addr = addr.in.v6;
+            memcpy(&si6->sin6_port, p + 5 + p[4], 2);
+        }
+        break;
+    default:
+        goto drop;
+    }
+
+    fd = (to.ss_family == AF_INET) ? u->out4 : u->out6;
+    if (fd == -1)
+        goto drop;
+
+    socks_udp_queue(u, fd, &to,
+                    (to.ss_family == AF_INET) ? sizeof(struct sockaddr_in)
+                                              : sizeof(struct sockaddr_in6),
+                    NULL, 0, (char *)p + hdrlen, len - hdrlen);
+    *bytes += len - hdrlen;
+    u->up_packets++;
+    return;
+drop:
+    u->dropped++;
+}
+
+/* a datagram, or a GRO train of them, from the client, each with a header. */
+static void socks_udp_forward(struct socks_udp *u, int i, uint64_t *bytes)
+{
+    struct socks_udp_batch *b = u->batch;
+    struct msghdr *msg = &b->in[i].msg_hdr;
+    size_t len = b->in[i].msg_len, seg, off, n;
+
+    if ((msg->msg_flags & MSG_TRUNC) ||
+        !socks_udp_from_client(u, &b->in_addr[i], msg->msg_namelen)) {
+        u->dropped++;
+        return;
+    }
+
+    seg = socks_udp_segment(msg, len);
+    for (off = 0; off < len; off += n) {
+        n = (len - off < seg) ? len - off : seg;
+        socks_udp_forward_one(u, (uint8_t *)b->buf[i] + off, n, bytes);
+    }
+}
+
+/* the SOCKS header naming the source of a datagram, its length. */
+static size_t socks_udp_header(uint8_t *hdr,
+                               const struct sockaddr_storage *from)
+{
+    const struct sockaddr_in *si = (const void *)from;
+    const struct sockaddr_in6 *si6 = (const void *)from;
+
+    hdr[0] = hdr[1] = hdr[2] = 0;
+
+    if (from->ss_family == AF_INET) {
+        hdr[3] = 0x01;
+        memcpy(hdr + 4, &si->sin_addr, 4);
+        memcpy(hdr + 8, &si->sin_port, 2);
+        return 4 + 4 + 2;
+    }
+
+    hdr[3] = 0x04;
+    memcpy(hdr + 4, &si6->sin6_addr, 16);
+    memcpy(hdr + 20, &si6->sin6_port, 2);
+    return 4 + 16 + 2;
+}
+
+#ifdef UDP_SEGMENT
+/**
+ * Send a GRO train to the client as one GSO train, a copy with the header
+ * before every segment, and count its datagrams as relayed or dropped.
+ * Returns 0 if it did not fit or the kernel refused, the caller sends the
+ * segments one by one.
+ */
+static int socks_udp_gso(struct socks_udp *u, const uint8_t *hdr,
+                         size_t hdrlen, const char *data, size_t len,
+                         size_t seg)
+{
+    struct socks_udp_batch *b = u->batch;
+    union socks_udp_ctrl ctrl = {};
+    struct msghdr msg = {};
+    struct cmsghdr *cm;
+    struct iovec iov;
+    size_t off, n, total = 0, segs = (len + seg - 1) / seg;
+    uint16_t gso = hdrlen + seg;
+
+    if (!b->gso || segs > SOCKS_UDP_SEGS)
+        return 0;
+
+    for (off = 0; off < len; off += n) {
+        n = (len - off < seg) ? len - off : seg;
+        if (total + hdrlen + n > sizeof(b->train))
+            return 0;
+        memcpy(b->train + total, hdr, hdrlen);
+        memcpy(b->train + total + hdrlen, data + off, n);
+        total += hdrlen + n;
+    }
+
+    iov.iov_base = b->train;
+    iov.iov_len = total;
+    msg.msg_name = &u->client;
+    msg.msg_namelen = u->clientlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(gso));
+
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(gso));
+    memcpy(CMSG_DATA(cm), &gso, sizeof(gso));
+
+    if (sendmsg(u->fd, &msg, MSG_DONTWAIT) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* the socket buffer is full, like socks_udp_flush */
+            u->dropped += segs;
+            return 1;
+        }
+        if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT) {
+            pw_debug("UDP_SEGMENT failed, sending segments one by one\n");
+            b->gso = 0;
+        }
+        return 0;
+    }
+
+    u->down_packets += segs;
+    return 1;
+}
+#endif
+
+/* a datagram, or a GRO train of them, from a target to the client. */
+static void socks_udp_back(struct socks_udp *u, int i, uint64_t *bytes)
+{
+    struct socks_udp_batch *b = u->batch;
+    struct msghdr *msg = &b->in[i].msg_hdr;
+    uint8_t hdr[SOCKS_UDP_HDR_MAX];
+    size_t len = b->in[i].msg_len, hdrlen, seg, off, n;
+
+    if (!u->clientlen || (msg->msg_flags & MSG_TRUNC)) {
+        u->dropped++;
+        return;
+    }
+
+    hdrlen = socks_udp_header(hdr, &b->in_addr[i]);
+    seg = socks_udp_segment(msg, len);
+
+    *bytes += len;
+
+#ifdef UDP_SEGMENT
+    if (seg < len) {
+        /* keep the order of what is queued already */
+        if (b->nout)
+            socks_udp_flush(u);
+        if (socks_udp_gso(u, hdr, hdrlen, b->buf[i], len, seg))
+            return;
+    }
+#endif
+
+    for (off = 0; off < len; off += n) {
+        n = (len - off < seg) ? len - off : seg;
+        socks_udp_queue(u, u->fd, &u->client, u->clientlen, hdr, hdrlen,
+                        b->buf[i] + off, n);
+        u->down_packets++;
+    }
+}
+
+int socks_udp_serve(struct socks_udp *u, int fd, uint64_t *up,
+                    uint64_t *down)
+{
+    struct socks_udp_batch *b = u->batch;
+    struct msghdr *msg;
+    int i, n, budget;
+
+    for (budget = SOCKS_UDP_BUDGET; budget > 0; budget--) {
+        for (i = 0; i < SOCKS_UDP_BATCH; i++) {
+            b->in_iov[i].iov_base = b->buf[i];
+            b->in_iov[i].iov_len = SOCKS_UDP_BUF;
+            msg = &b->in[i].msg_hdr;
+            msg->msg_name = &b->in_addr[i];
+            msg->msg_namelen = sizeof(b->in_addr[i]);
+            msg->msg_iov = &b->in_iov[i];
+            msg->msg_iovlen = 1;
+            msg->msg_control = b->in_ctrl[i].buf;
+            msg->msg_controllen = sizeof(b->in_ctrl[i].buf);
+            msg->msg_flags = 0;
+        }
+
+        n = socks_udp_recv(fd, b->in, SOCKS_UDP_BATCH);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            /* an ICMP error of an earlier datagram, nothing to do */
+            if (errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+                errno == ENETUNREACH)
+                continue;
+            pw_error("recvmmsg");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (fd == u->fd)
+                socks_udp_forward(u, i, up);
+            else
+                socks_udp_back(u, i, down);
+        }
+
+        /* the payloads are in the receive buffers, send before reusing */
+        if (b->nout)
+            socks_udp_flush(u);
+
+        if (n < SOCKS_UDP_BATCH)
+            return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,66 @@
+/* socks_udp.h */
+
+#ifndef _PW_SOCKS_UDP_H
+#define _PW_SOCKS_UDP_H
+
+#include <sys/socket.h>
+#include <stdint.h>
+
+#include "resolv.h"
+
+#define SOCKS_UDP_BATCH 32      /* datagrams per recvmmsg/sendmmsg */
+#define SOCKS_UDP_BUDGET 8      /* batches per wakeup, before other events */
+#define SOCKS_UDP_BUF 65536     /* a datagram, or a GRO train of them */
+#define SOCKS_UDP_HDR_MAX 22    /* RSV FRAG ATYP, IPv6 address and port */
+
+struct socks_udp_batch;
+
+/* resolve a DST.ADDR domain without waiting, -1 to drop the datagram. */
+typedef int socks_udp_lookup_t(const char *name, struct resolv_addr *addr);
+
+/**
+ * The relay of a UDP ASSOCIATE (RFC 1928 section 7). Datagrams of the
+ * client come in on fd with the SOCKS header, which is stripped, and go
+ * out to their target on out4 or out6. Datagrams coming back there get a
+ * header naming their source and are sent to the client. Only the host
+ * of the control conn may use it, from the first port it sends from.
+ */
+struct socks_udp {
+    int fd;   /* BND.ADDR, faces the client */
+    int out4; /* to IPv4 targets */
+    int out6; /* to IPv6 targets, -1 without IPv6 */
+    struct sockaddr_storage peer;   /* the client of the control conn */
+    struct sockaddr_storage client; /* where its datagrams come from */
+    socklen_t clientlen;            /* 0 until the first one */
+    struct socks_udp_batch *batch;
+    socks_udp_lookup_t *lookup;
+    uint64_t up_packets;   /* client -> targets */
+    uint64_t down_packets; /* targets -> client */
+    uint64_t dropped;
+};
+
+/**
+ * Buffers and message vectors of the batched relay, shared by all the
+ * associations of a worker. Not thread safe.
+ */
+struct socks_udp_batch *socks_udp_batch_new(void);
+void socks_udp_batch_destroy(struct socks_udp_batch *b);
+
+/**
+ * A relay for peer, the client of the control conn ctlfd, bound to the
+ * local address of ctlfd.
+ */
+struct socks_udp *socks_udp_new(int ctlfd, const struct sockaddr_storage *peer,
+                                struct socks_udp_batch *b,
+                                socks_udp_lookup_t *lookup);
+/**
+ * Relay what fd, one of the sockets of u, has to read until it would
+ * block, adding the payload bytes moved to *up and *down. Returns 1 when
+ * SOCKS_UDP_BUDGET full batches were relayed and more may be waiting, the
+ * caller has the edge triggered fd reported again.
+ */
+int socks_udp_serve(struct socks_udp *u, int fd, uint64_t *up,
+                    uint64_t *down);
+void socks_udp_close(struct socks_udp *u);
+
+#endif /* socks_udp.h */
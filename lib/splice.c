@@ -0,0 +1,82 @@
+/* splice.c */
+
+#include "splice.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "debug.h"
+
+struct pipe_pool *pipe_pool_new(uint32_t size)
+{
+    struct pipe_pool *pp;
+
+    pp = calloc(1, sizeof(struct pipe_pool));
+    if (!pp) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    pp->fds = calloc(size, sizeof(int) * 2);
+    if (!pp->fds) {
+        pw_error("calloc");
+        free(pp);
+        return NULL;
+    }
+
+    pp->size = size;
+
+    return pp;
+}
+
+int pipe_pool_get(struct pipe_pool *pp, int fds[2])
+{
+    if (pp->count > 0) {
+        pp->count--;
+        fds[0] = pp->fds[pp->count * 2];
+        fds[1] = pp->fds[pp->count * 2 + 1];
+        pp->hits++;
+        return 0;
+    }
+
+    pp->misses++;
+
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        pw_error("pipe2");
+        return -1;
+    }
+
+    return 0;
+}
+
+void pipe_pool_put(struct pipe_pool *pp, int fds[2], int empty)
+{
+    if (fds[0] == -1)
+        return;
+
+    if (empty && pp->count < pp->size) {
+        pp->fds[pp->count * 2] = fds[0];
+        pp->fds[pp->count * 2 + 1] = fds[1];
+        pp->count++;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    fds[0] = fds[1] = -1;
+}
+
+void pipe_pool_destroy(struct pipe_pool *pp)
+{
+    uint32_t i;
+
+    if (pp) {
+        for (i = 0; i < pp->count * 2; i++)
+            close(pp->fds[i]);
+        free(pp->fds);
+        free(pp);
+    }
+}
@@ -0,0 +1,28 @@
+/* splice.h */
+
+#ifndef _PW_SPLICE_H
+#define _PW_SPLICE_H
+
+#include <stdint.h>
+
+#define PIPE_POOL_PIPE_SIZE 65536 /* default Linux pipe capacity */
+
+/**
+ * Cache of empty pipes for the splice(2) relay, a pipe costs two fds and
+ * two syscalls to create. Not thread safe, every worker owns its own.
+ */
+struct pipe_pool {
+    int *fds;        /* read/write fd pairs of the cached pipes */
+    uint32_t count;  /* cached pipes */
+    uint32_t size;   /* max cached pipes */
+    uint64_t hits;   /* pipes served from the cache */
+    uint64_t misses; /* pipes that had to be created */
+};
+
+struct pipe_pool *pipe_pool_new(uint32_t size);
+int pipe_pool_get(struct pipe_pool *pp, int fds[2]);
+/* a pipe that still holds data is closed instead of cached. */
+void pipe_pool_put(struct pipe_pool *pp, int fds[2], int empty);
+void pipe_pool_destroy(struct pipe_pool *pp);
+
+#endif /* splice.h */
@@ -0,0 +1,241 @@
+/* stats.c */
+
+#include "stats.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "socks.h"
+
+static struct stats *stats_map(int fd, size_t size, int prot)
+{
+    struct stats *s;
+    void *p;
+
+    s = calloc(1, sizeof(struct stats));
+    if (!s) {
+        pw_error("calloc");
+        return NULL;
+    }
+
+    p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        pw_error("mmap");
+        free(s);
+        return NULL;
+    }
+
+    s->size = size;
+    s->hdr = p;
+    s->workers = (struct stats_worker *)(s->hdr + 1);
+
+    return s;
+}
+
+struct stats *stats_create(const char *name, uint32_t n)
+{
+    struct stats *s;
+    size_t size;
+    int fd;
+
+    size = sizeof(struct stats_header) + n * sizeof(struct stats_worker);
+
+    /**
+     * A new object, the workers of a master being upgraded keep counting in
+     * the old one they have mapped, not over the new workers' counters.
+     */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        pw_error("shm_open");
+        return NULL;
+    }
+
+    /* shrink to nothing first, the counters of a previous run are gone. */
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        pw_error("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    s = stats_map(fd, size, PROT_READ | PROT_WRITE);
+    close(fd);
+    if (!s)
+        return NULL;
+
+    s->hdr->workers = n;
+    s->hdr->master = getpid();
+    s->hdr->started = time(NULL);
+    __atomic_store_n(&s->hdr->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    return s;
+}
+
+struct stats *stats_open(const char *name)
+{
+    struct stats *s;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        pw_error("shm_open");
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        pw_error("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct stats_header)) {
+        pw_debug("%s is no stats region\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    s = stats_map(fd, st.st_size, PROT_READ);
+    close(fd);
+    if (!s)
+        return NULL;
+
+    if (__atomic_load_n(&s->hdr->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        s->size < sizeof(struct stats_header) +
+                      s->hdr->workers * sizeof(struct stats_worker)) {
+        pw_debug("%s is no stats region\n", name);
+        stats_destroy(s, NULL, 0);
+        return NULL;
+    }
+
+    return s;
+}
+
+/**
+ * Two buckets per power of two: the top bit picks the octave and the bit
+ * below it the half, a value is off by at most a third of itself.
+ */
+int stats_hist_bucket(uint64_t us)
+{
+    int msb;
+
+    if (us < 2)
+        return (int)us;
+
+    msb = 63 - __builtin_clzll(us);
+    if (msb >= STATS_HIST_BUCKETS / 2)
+        return STATS_HIST_BUCKETS - 1;
+
+    return 2 * msb + (int)((us >> (msb - 1)) & 1);
+}
+
+uint64_t stats_hist_upper(int i)
+{
+    int msb = i / 2;
+
+    if (i < 2)
+        return i;
+    if (i == STATS_HIST_BUCKETS - 1)
+        return UINT64_MAX;
+
+    return ((uint64_t)(2 + i % 2) << (msb - 1)) + (1ULL << (msb - 1)) - 1;
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t us)
+{
+    int i = stats_hist_bucket(us);
+
+    /* a single writer, the stores only have to be whole for readers. */
+    __atomic_store_n(&h->buckets[i], h->buckets[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + us, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+void stats_hist_merge(struct stats_hist *to, const struct stats_hist *from)
+{
+    int i;
+
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+        to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+void stats_worker_merge(struct stats_worker *to,
+                        const struct stats_worker *from)
+{
+    int i;
+
+#define STATS_LOAD(field) __atomic_load_n(&from->field, __ATOMIC_RELAXED)
+    to->accepts += STATS_LOAD(accepts);
+    to->handoff_sent += STATS_LOAD(handoff_sent);
+    to->handoff_received += STATS_LOAD(handoff_received);
+    to->queue += STATS_LOAD(queue);
+    for (i = 0; i < STATS_STATES; i++)
+        to->states[i] += STATS_LOAD(states[i]);
+    to->auth_failures += STATS_LOAD(auth_failures);
+    for (i = 0; i < STATS_REPLIES; i++)
+        to->replies[i] += STATS_LOAD(replies[i]);
+    to->bytes_in += STATS_LOAD(bytes_in);
+    to->bytes_out += STATS_LOAD(bytes_out);
+    to->active += STATS_LOAD(active);
+    to->fastopen_in += STATS_LOAD(fastopen_in);
+    to->fastopen_out += STATS_LOAD(fastopen_out);
+    to->fastopen_acked += STATS_LOAD(fastopen_acked);
+#undef STATS_LOAD
+
+    for (i = 0; i < STATS_HISTS; i++)
+        stats_hist_merge(&to->hists[i], &from->hists[i]);
+}
+
+const char *stats_state_name(int state)
+{
+    switch (state) {
+    case SOCKS_METHOD:
+        return "method";
+    case SOCKS_AUTH:
+        return "auth";
+    case SOCKS_CMD:
+        return "cmd";
+    case SOCKS_SERVE:
+        return "serve";
+    case SOCKS_CONNECTING:
+        return "connecting";
+    case SOCKS_RESOLVING:
+        return "resolving";
+    case SOCKS_UDP:
+        return "udp";
+    default:
+        return NULL;
+    }
+}
+
+struct stats_worker *stats_worker(struct stats *s, uint32_t i)
+{
+    return (i < s->hdr->workers) ? &s->workers[i] : NULL;
+}
+
+const char *stats_name(char *buf, size_t len, uint16_t port)
+{
+    snprintf(buf, len, "/socks5-%u", port);
+    return buf;
+}
+
+void stats_destroy(struct stats *s, const char *name, int unlink)
+{
+    if (!s)
+        return;
+
+    munmap(s->hdr, s->size);
+    free(s);
+
+    if (unlink && name)
+        shm_unlink(name);
+}
@@ -0,0 +1,110 @@
+/* stats.h */
+
+#ifndef _PW_STATS_H
+#define _PW_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STATS_MAGIC 0x534b5331 /* "SKS1" */
+#define STATS_STATES 8         /* indexed by SOCKS_* state */
+#define STATS_REPLIES 9        /* indexed by SOCKS reply code */
+#define STATS_HIST_BUCKETS 64  /* two per power of two, 1 us up to 71 min */
+
+/* histograms of a worker, 1 to 6 are the time spent in a SOCKS_* state. */
+enum {
+    STATS_HIST_FIRST_BYTE = 0, /* accept to the first byte from upstream */
+    STATS_HIST_DISPATCH = 7,   /* event loop wakeup spent in handlers */
+    STATS_HISTS = 8,
+};
+
+/* log-bucketed like HDR histograms, microseconds. */
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+/**
+ * Counters of one worker, written by it alone. A cache line apart from
+ * the next worker's, and only updated with plain stores: the readers see
+ * them through the shared mapping without any syscall or lock.
+ */
+struct stats_worker {
+    uint64_t accepts;                /* conns accepted or taken over */
+    uint64_t handoff_sent;           /* conns handed to another worker */
+    uint64_t handoff_received;       /* conns taken over from another */
+    uint64_t queue;                  /* events ready on the last wakeup */
+    uint64_t states[STATS_STATES];   /* conns that reached each state */
+    uint64_t auth_failures;          /* wrong user or password */
+    uint64_t replies[STATS_REPLIES]; /* failed commands by reply code */
+    uint64_t bytes_in;               /* relayed from the clients */
+    uint64_t bytes_out;              /* relayed to the clients */
+    uint64_t active;                 /* conns open right now */
+    uint64_t fastopen_in;            /* client SYNs with data accepted */
+    uint64_t fastopen_out;           /* upstream SYNs with client bytes */
+    uint64_t fastopen_acked;         /* of those, the target took the data */
+    struct stats_hist hists[STATS_HISTS];
+} __attribute__((aligned(64)));
+
+struct stats_header {
+    uint32_t magic;
+    uint32_t workers;
+    pid_t master;
+    uint64_t started; /* unix time, seconds */
+} __attribute__((aligned(64)));
+
+struct stats {
+    size_t size; /* of the mapping */
+    struct stats_header *hdr;
+    struct stats_worker *workers;
+};
+
+/* add n to a counter of the calling worker, w may be NULL. */
+#define STATS_ADD(w, field, n)                                            \
+    do {                                                                  \
+        if (w)                                                            \
+            __atomic_store_n(&(w)->field, (w)->field + (n),               \
+                             __ATOMIC_RELAXED);                           \
+    } while (0)
+
+/* set a gauge of the calling worker, w may be NULL. */
+#define STATS_SET(w, field, v)                                            \
+    do {                                                                  \
+        if (w)                                                            \
+            __atomic_store_n(&(w)->field, (v), __ATOMIC_RELAXED);         \
+    } while (0)
+
+/* record us in a histogram of the calling worker, w may be NULL. */
+#define STATS_HIST(w, i, us)                                              \
+    do {                                                                  \
+        if (w)                                                            \
+            stats_hist_add(&(w)->hists[i], us);                           \
+    } while (0)
+
+/**
+ * Create the region of n workers as the POSIX shared memory object name,
+ * before fork(2). Any previous region of that name is replaced, processes that
+ * mapped it keep the old one.
+ */
+struct stats *stats_create(const char *name, uint32_t n);
+/* map an existing region read only, for monitoring tools. */
+struct stats *stats_open(const char *name);
+struct stats_worker *stats_worker(struct stats *s, uint32_t i);
+void stats_hist_add(struct stats_hist *h, uint64_t us);
+/* the bucket of us, and the largest value bucket i holds. */
+int stats_hist_bucket(uint64_t us);
+uint64_t stats_hist_upper(int i);
+/* add the histogram from to to, e.g. to merge those of all workers. */
+void stats_hist_merge(struct stats_hist *to, const struct stats_hist *from);
+/* add the counters and histograms of from to to. */
+void stats_worker_merge(struct stats_worker *to,
+                        const struct stats_worker *from);
+/* name of a SOCKS_* state, NULL for none. */
+const char *stats_state_name(int state);
+/* the name of the region of the server on port, in buf. */
+const char *stats_name(char *buf, size_t len, uint16_t port);
+/* unmap, and remove the object too if unlink is set. */
+void stats_destroy(struct stats *s, const char *name, int unlink);
+
+#endif /* stats.h */
@@ -14,6 +14,23 @@
 struct g_option {
     uint32_t worker_processes;
     uint32_t worker_connections;
+    uint32_t worker_threads;    /* event loops per worker process */
+    int splice;                 /* relay established tunnels with splice(2) */
+    uint32_t handshake_timeout; /* seconds to send a command, 0 forever */
+    uint32_t connect_timeout;   /* seconds, 0 waits for the kernel */
+    uint32_t idle_timeout;      /* seconds without relay traffic, 0 forever */
+    int reuseport;              /* a SO_REUSEPORT listener per worker */
+    int reuseport_cpu;          /* steer connections by the receiving CPU */
+    int fastopen;               /* TCP Fast Open, accepted and connected */
+    uint32_t drain_timeout;     /* seconds a stopped worker serves, 0 forever */
+    uint32_t dns_cache;         /* cached answers, 0 disables the cache */
+    uint32_t dns_ttl_min;       /* seconds, bounds of a cached answer */
+    uint32_t dns_ttl_max;
+    int handoff;                /* pass new conns to less loaded workers */
+    const char *cpu_affinity;   /* CPU list to pin workers to, "" the mask */
+    const char *stats_name;     /* shm object of the counters, NULL default */
+    const char *admin_host;     /* metrics listener, served by worker 0 */
+    uint16_t admin_port;        /* 0 disables it */
     int is_daemon;
     const char *user;
     const char *passwd;
@@ -21,9 +38,34 @@ struct g_option {
     uint16_t port;
 };
 
-extern struct g_option g_opt; /* definition main.c */
+struct resolv_cache;
+struct handoff;
+struct cpu_list;
+struct stats;
+
+extern struct g_option g_opt;                /* definition main.c */
+extern struct resolv_cache *g_resolv_cache; /* definition main.c */
+extern struct handoff *g_handoff;           /* definition main.c */
+extern struct cpu_list *g_cpus;             /* definition main.c */
+extern struct stats *g_stats;               /* definition main.c */
 
 void worker_listen_add(int fd, uint16_t flags, event_handler_t *fn, void *data);
+/**
+ * worker i listens on fds[i] only, with data[i]. Workers are numbered over
+ * all threads, n is worker_processes * worker_threads.
+ */
+void worker_listen_add_group(const int *fds, void *const *data, int n,
+                             uint16_t flags, event_handler_t *fn);
+/* like worker_listen_add_group, taking effect when the workers (re)start. */
+void worker_listen_insert_group(const int *fds, void *const *data, int n,
+                                uint16_t flags, event_handler_t *fn);
 void worker_listen_delete(int fd);
+/* index of the calling worker, over all threads. */
+int worker_id(void);
+/**
+ * SIGQUIT the worker processes and wait until they exited, they stop
+ * accepting and drain their conns for at most --drain_timeout seconds.
+ */
+void worker_process_stop(void);
 
 #endif /* common.h */
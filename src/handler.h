@@ -9,5 +9,14 @@
 
 void handler_socks(struct event_base *base, int fd, u_int16_t flags,
                    void *data);
+/* takes over the conns other workers hand to this one, see handoff.h. */
+void handler_socks_handoff(struct event_base *base, int fd, u_int16_t flags,
+                           void *data);
+/* release what a worker thread resolves with, before its event_base goes. */
+void handler_socks_exit(void);
+
+/* GET /metrics of the admin listener, see --admin_port. */
+void handler_admin(struct event_base *base, int fd, u_int16_t flags,
+                   void *data);
 
 #endif /* socks_handler.h */
@@ -0,0 +1,355 @@
+/* handler_admin.c */
+
+#include "handler.h"
+
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "debug.h"
+#include "misc.h"
+#include "stats.h"
+
+/**
+ * A minimal HTTP/1.0 server for GET /metrics: the counters and histograms
+ * of all workers, merged from the shared stats region when scraped, in the
+ * Prometheus text format. One request per conn, then it is closed.
+ */
+
+#define ADMIN_TIMEOUT 5000 /* ms for a scrape, from accept to the last byte */
+
+struct admin_conn {
+    int fd;
+    struct event_timer timer;
+    uint32_t inlen;
+    char in[1024];
+    char *out; /* the response, once the request is complete */
+    size_t outlen;
+    size_t outoff;
+    size_t outcap;
+};
+
+static void handler_admin_conn(struct event_base *base, int fd,
+                               u_int16_t flags, void *data);
+
+static void handler_admin_close(struct event_base *base, struct admin_conn *a)
+{
+    event_base_timer_cancel(base, &a->timer);
+    event_base_delete(base, a->fd, EV_READ | EV_WRITE);
+    close(a->fd);
+    free(a->out);
+    free(a);
+}
+
+static void handler_admin_timeout(struct event_base *base, void *data)
+{
+    pw_debug("admin timeout\n");
+    handler_admin_close(base, data);
+}
+
+static void handler_admin_printf(struct admin_conn *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t cap;
+    char *out;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(a->out + a->outlen, a->outcap - a->outlen, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (a->outlen + n < a->outcap) {
+            a->outlen += n;
+            return;
+        }
+
+        cap = a->outcap ? a->outcap * 2 : 16384;
+        out = realloc(a->out, cap);
+        if (!out) {
+            pw_error("realloc");
+            return;
+        }
+        a->out = out;
+        a->outcap = cap;
+    }
+}
+
+static void handler_admin_counter(struct admin_conn *a, const char *name,
+                                  const char *help, uint64_t value)
+{
+    handler_admin_printf(a, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                         name, help, name, name, (unsigned long long)value);
+}
+
+static void handler_admin_hist(struct admin_conn *a, const char *name,
+                               const char *labels, const struct stats_hist *h)
+{
+    uint64_t cum = 0;
+    int i;
+
+    /* count as the sum of the buckets, so that it matches le="+Inf". */
+    for (i = 0; i < STATS_HIST_BUCKETS - 1; i++) {
+        cum += h->buckets[i];
+        handler_admin_printf(a, "%s_bucket{%s%sle=\"%g\"} %llu\n", name,
+                             labels, *labels ? "," : "",
+                             stats_hist_upper(i) / 1e6,
+                             (unsigned long long)cum);
+    }
+    cum += h->buckets[i];
+    handler_admin_printf(a, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+                         *labels ? "," : "", (unsigned long long)cum);
+    handler_admin_printf(a, "%s_sum%s%s%s %g\n", name, *labels ? "{" : "",
+                         labels, *labels ? "}" : "", h->sum / 1e6);
+    handler_admin_printf(a, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "",
+                         labels, *labels ? "}" : "", (unsigned long long)cum);
+}
+
+static void handler_admin_metrics(struct admin_conn *a)
+{
+    struct stats_worker total;
+    const struct stats_worker *w;
+    const char *state;
+    char labels[64];
+    uint32_t i;
+    int k;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < g_stats->hdr->workers; i++)
+        stats_worker_merge(&total, &g_stats->workers[i]);
+
+    handler_admin_counter(a, "socks_accepts_total",
+                          "Connections accepted or taken over.",
+                          total.accepts);
+    handler_admin_counter(a, "socks_auth_failures_total",
+                          "Clients that sent wrong credentials.",
+                          total.auth_failures);
+
+    handler_admin_printf(a, "# HELP socks_active_connections Connections "
+                            "open.\n# TYPE socks_active_connections gauge\n"
+                            "socks_active_connections %llu\n",
+                         (unsigned long long)total.active);
+
+    handler_admin_printf(a, "# HELP socks_relay_bytes_total Bytes relayed.\n"
+                            "# TYPE socks_relay_bytes_total counter\n");
+    handler_admin_printf(a, "socks_relay_bytes_total{dir=\"in\"} %llu\n",
+                         (unsigned long long)total.bytes_in);
+    handler_admin_printf(a, "socks_relay_bytes_total{dir=\"out\"} %llu\n",
+                         (unsigned long long)total.bytes_out);
+
+    handler_admin_printf(a, "# HELP socks_handoffs_total Connections handed "
+                            "to or taken over from another worker.\n"
+                            "# TYPE socks_handoffs_total counter\n");
+    for (i = 0; i < g_stats->hdr->workers; i++) {
+        w = &g_stats->workers[i];
+        handler_admin_printf(
+            a, "socks_handoffs_total{worker=\"%u\",dir=\"sent\"} %llu\n", i,
+            (unsigned long long)__atomic_load_n(&w->handoff_sent,
+                                                __ATOMIC_RELAXED));
+        handler_admin_printf(
+            a, "socks_handoffs_total{worker=\"%u\",dir=\"received\"} %llu\n",
+            i,
+            (unsigned long long)__atomic_load_n(&w->handoff_received,
+                                                __ATOMIC_RELAXED));
+    }
+
+    handler_admin_printf(a, "# HELP socks_worker_queue Events ready on the "
+                            "last wakeup of a worker.\n"
+                            "# TYPE socks_worker_queue gauge\n");
+    for (i = 0; i < g_stats->hdr->workers; i++)
+        handler_admin_printf(
+            a, "socks_worker_queue{worker=\"%u\"} %llu\n", i,
+            (unsigned long long)__atomic_load_n(&g_stats->workers[i].queue,
+                                                __ATOMIC_RELAXED));
+
+    handler_admin_printf(a, "# HELP socks_fastopen_total TCP Fast Open SYNs "
+                            "with data, accepted from clients or sent "
+                            "upstream.\n"
+                            "# TYPE socks_fastopen_total counter\n");
+    handler_admin_printf(a, "socks_fastopen_total{dir=\"in\"} %llu\n",
+                         (unsigned long long)total.fastopen_in);
+    handler_admin_printf(a, "socks_fastopen_total{dir=\"out\"} %llu\n",
+                         (unsigned long long)total.fastopen_out);
+    handler_admin_counter(a, "socks_fastopen_acked_total",
+                          "Upstream SYN data the target accepted with its "
+                          "cookie.",
+                          total.fastopen_acked);
+
+    handler_admin_printf(a, "# HELP socks_state_entered_total Connections "
+                            "that reached a state.\n"
+                            "# TYPE socks_state_entered_total counter\n");
+    for (k = 0; k < STATS_STATES; k++) {
+        if ((state = stats_state_name(k)))
+            handler_admin_printf(
+                a, "socks_state_entered_total{state=\"%s\"} %llu\n", state,
+                (unsigned long long)total.states[k]);
+    }
+
+    handler_admin_printf(a, "# HELP socks_replies_total Failed commands by "
+                            "SOCKS reply code.\n"
+                            "# TYPE socks_replies_total counter\n");
+    for (k = 1; k < STATS_REPLIES; k++)
+        handler_admin_printf(a, "socks_replies_total{code=\"%d\"} %llu\n", k,
+                             (unsigned long long)total.replies[k]);
+
+    handler_admin_printf(a, "# HELP socks_state_seconds Time spent in a "
+                            "state.\n# TYPE socks_state_seconds histogram\n");
+    for (k = 0; k < STATS_HIST_DISPATCH; k++) {
+        if (!(state = stats_state_name(k)))
+            continue;
+        snprintf(labels, sizeof(labels), "state=\"%s\"", state);
+        handler_admin_hist(a, "socks_state_seconds", labels, &total.hists[k]);
+    }
+
+    handler_admin_printf(a, "# HELP socks_first_byte_seconds From accept to "
+                            "the first byte from upstream.\n"
+                            "# TYPE socks_first_byte_seconds histogram\n");
+    handler_admin_hist(a, "socks_first_byte_seconds", "",
+                       &total.hists[STATS_HIST_FIRST_BYTE]);
+
+    handler_admin_printf(a, "# HELP socks_dispatch_seconds Event loop wakeup "
+                            "spent in handlers.\n"
+                            "# TYPE socks_dispatch_seconds histogram\n");
+    handler_admin_hist(a, "socks_dispatch_seconds", "",
+                       &total.hists[STATS_HIST_DISPATCH]);
+}
+
+/* the whole response into a->out, the headers are patched in front. */
+static void handler_admin_respond(struct admin_conn *a)
+{
+    char hdr[128];
+    int ok, n;
+
+    ok = strncmp(a->in, "GET /metrics ", 13) == 0 ||
+         strncmp(a->in, "GET /metrics?", 13) == 0;
+
+    if (ok && g_stats)
+        handler_admin_metrics(a);
+    else
+        handler_admin_printf(a, "not found\n");
+
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                 ok ? "200 OK" : "404 Not Found", a->outlen);
+
+    handler_admin_printf(a, "%s", hdr);
+    if (a->outlen < (size_t)n)
+        return; /* out of memory, close without a response */
+
+    /* move the body behind the headers just appended. */
+    memmove(a->out + n, a->out, a->outlen - n);
+    memcpy(a->out, hdr, n);
+}
+
+static int handler_admin_write(struct event_base *base, struct admin_conn *a)
+{
+    ssize_t n;
+
+    while (a->outoff < a->outlen) {
+        n = write(a->fd, a->out + a->outoff, a->outlen - a->outoff);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                pw_error("write");
+                return -1;
+            }
+            if (event_base_add(base, a->fd, EV_WRITE, handler_admin_conn, a) ==
+                -1)
+                return -1;
+            return 0;
+        }
+        a->outoff += n;
+    }
+
+    return -1; /* done, close */
+}
+
+static void handler_admin_conn(struct event_base *base, int fd,
+                               u_int16_t flags, void *data)
+{
+    struct admin_conn *a = data;
+    ssize_t n;
+
+    if (a->out)
+        goto write;
+
+    while (1) {
+        n = read(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen);
+        if (n == 0)
+            goto done;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            pw_error("read");
+            goto done;
+        }
+        a->inlen += n;
+        a->in[a->inlen] = '\0';
+        if (strstr(a->in, "\r\n\r\n") || strstr(a->in, "\n\n"))
+            break;
+        if (a->inlen == sizeof(a->in) - 1)
+            break; /* long headers, the request line is all we need */
+    }
+
+    event_base_delete(base, a->fd, EV_READ);
+    handler_admin_respond(a);
+    if (!a->outlen)
+        goto done;
+
+write:
+    if (handler_admin_write(base, a) == 0)
+        return;
+done:
+    handler_admin_close(base, a);
+}
+
+void handler_admin(struct event_base *base, int fd, u_int16_t flags, void *data)
+{
+    struct admin_conn *a;
+    int connfd;
+
+    /* scrapes are rare, no budget, just drain the backlog. */
+    while (1) {
+#ifdef __linux__
+        connfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        connfd = accept(fd, NULL, NULL);
+        if (connfd != -1)
+            set_nonblocking(connfd, 1);
+#endif
+        if (connfd == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                pw_error("accept");
+            return;
+        }
+
+        a = calloc(1, sizeof(struct admin_conn));
+        if (!a) {
+            pw_error("calloc");
+            close(connfd);
+            continue;
+        }
+        a->fd = connfd;
+
+        if (event_base_add(base, connfd, EV_READ, handler_admin_conn, a) ==
+            -1) {
+            close(connfd);
+            free(a);
+            continue;
+        }
+
+        event_base_timer_add(base, &a->timer, ADMIN_TIMEOUT,
+                             handler_admin_timeout, a);
+    }
+}
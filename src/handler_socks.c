@@ -2,76 +2,845 @@
 
 #include "handler.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
 #include "socks.h"
 #include "debug.h"
+#include "ev_timer.h"
+#include "handoff.h"
 #include "misc.h"
+#include "pool.h"
+#include "resolv.h"
+#include "resolv_cache.h"
+#include "rtt.h"
+#include "splice.h"
+#include "stats.h"
+
+/* per worker thread, like the event_base they are used with. */
+static __thread struct pool *conn_pool;      /* created on first accept. */
+static __thread struct pipe_pool *pipe_pool; /* for --splice. */
+static __thread struct resolv *resolver;     /* for domain CONNECTs. */
+static __thread struct stats_worker *stats;  /* counters of this worker. */
+static __thread struct rtt_table *rtts;      /* connect RTTs by address. */
+static __thread struct socks_udp_batch *udp_batch; /* for UDP ASSOCIATE. */
+
+/* background queries of a thread in flight, see handler_socks_prefetch. */
+#define HANDLER_PREFETCH_MAX 64
+
+/* addresses whose connect RTT a worker remembers. */
+#define HANDLER_RTT_SIZE 4096
+
+/* conns accepted per wakeup of the listen fd, before other events run. */
+#define HANDLER_ACCEPT_BUDGET 64
+/* ms a listen fd rests when the process ran out of fds or memory. */
+#define HANDLER_ACCEPT_BACKOFF 100
+
+/* a listen fd resting after accept failed for lack of resources. */
+struct handler_backoff {
+    struct handler_backoff *next;
+    struct event_timer timer;
+    int fd;
+};
+
+/* one per listen fd of the thread that ever rested, reused. */
+static __thread struct handler_backoff *backoffs;
+
+static void handler_socks_conn(struct event_base *base, int fd, u_int16_t flags,
+                               void *data);
+
+/* move the bytes relayed since the last call to the counters. */
+static void handler_socks_bytes(struct socks_conn *c)
+{
+    if (!c->first_byte && c->down_bytes && stats) {
+        c->first_byte = 1;
+        STATS_HIST(stats, STATS_HIST_FIRST_BYTE, ev_timer_now_us() - c->born);
+    }
+    STATS_ADD(stats, bytes_in, c->up_bytes);
+    STATS_ADD(stats, bytes_out, c->down_bytes);
+    c->up_bytes = c->down_bytes = 0;
+}
+
+/* record the time c spent in state, which it left or is closed in. */
+static void handler_socks_left(struct socks_conn *c, uint8_t state)
+{
+    uint64_t now;
+
+    /* the histograms above are not states, see stats.h */
+    if (!stats || state == 0 || state >= STATS_HIST_DISPATCH)
+        return;
+
+    now = ev_timer_now_us();
+    STATS_HIST(stats, state, now - c->since);
+    c->since = now;
+}
+
+/* count the state a step of the handshake left c in. */
+static void handler_socks_step(struct socks_conn *c, uint8_t state)
+{
+    if (c->state == state)
+        return;
+
+    handler_socks_left(c, state);
+    if (c->state < STATS_STATES)
+        STATS_ADD(stats, states[c->state], 1);
+}
+
+static void handler_socks_close(struct event_base *base, struct socks_conn *c)
+{
+    int i;
+
+    pw_debug("close connection: %d\n", c->srcfd);
+    handler_socks_bytes(c);
+    handler_socks_left(c, c->state);
+    if (c->auth_failed)
+        STATS_ADD(stats, auth_failures, 1);
+    if (c->reply && c->reply < STATS_REPLIES)
+        STATS_ADD(stats, replies[c->reply], 1);
+    if (c->fastopen & SOCKS_TFO_IN)
+        STATS_ADD(stats, fastopen_in, 1);
+    if (c->fastopen & SOCKS_TFO_OUT)
+        STATS_ADD(stats, fastopen_out, 1);
+    if (c->fastopen & SOCKS_TFO_ACKED)
+        STATS_ADD(stats, fastopen_acked, 1);
+    STATS_ADD(stats, active, -1);
+    event_base_timer_cancel(base, &c->timer);
+    event_base_timer_cancel(base, &c->race_timer);
+    if (c->query)
+        resolv_cancel(resolver, c->query);
+    if (c->query6)
+        resolv_cancel(resolver, c->query6);
+    for (i = 0; i < c->nrace; i++)
+        event_base_delete(base, c->race[i], EV_WRITE);
+    if (c->udp) {
+        event_base_delete(base, c->udp->fd, EV_READ);
+        event_base_delete(base, c->udp->out4, EV_READ);
+        event_base_delete(base, c->udp->out6, EV_READ);
+    }
+    event_base_delete(base, c->srcfd, c->src_events);
+    event_base_delete(base, c->dstfd, c->dst_events);
+    socks_close_conn(c);
+}
+
+static void handler_socks_timeout(struct event_base *base, void *data)
+{
+    struct socks_conn *c = data;
+
+    switch (c->state) {
+    case SOCKS_RESOLVING:
+    case SOCKS_CONNECTING:
+        pw_debug("connect timeout: %d\n", c->srcfd);
+        socks_connect_timeout(c);
+        break;
+    case SOCKS_SERVE:
+    case SOCKS_UDP:
+        pw_debug("idle timeout: %d\n", c->srcfd);
+        break;
+    default:
+        pw_debug("handshake timeout: %d\n", c->srcfd);
+        break;
+    }
+
+    handler_socks_close(base, c);
+}
+
+/* (re)start the deadline of the conn, sec == 0 disables it. */
+static void handler_socks_deadline(struct event_base *base,
+                                   struct socks_conn *c, uint32_t sec)
+{
+    if (sec == 0)
+        event_base_timer_cancel(base, &c->timer);
+    else
+        event_base_timer_add(base, &c->timer, sec * 1000,
+                             handler_socks_timeout, c);
+}
+
+static int handler_socks_race_on(struct event_base *base,
+                                 struct socks_conn *c);
+
+static void handler_socks_race_timer(struct event_base *base, void *data)
+{
+    struct socks_conn *c = data;
+    uint8_t state = c->state;
+
+    if (handler_socks_race_on(base, c) == -1) {
+        handler_socks_close(base, c);
+        return;
+    }
+
+    handler_socks_step(c, state);
+}
+
+/**
+ * Start the next connect of the race and wait for it, the one after is
+ * started by the timer unless this one fails first.
+ */
+static int handler_socks_race(struct event_base *base, struct socks_conn *c)
+{
+    int fd;
+
+    while ((fd = socks_race_next(c)) != -1) {
+        if (event_base_add(base, fd, EV_WRITE, handler_socks_conn, c) == -1) {
+            socks_race_drop(c, fd);
+            continue;
+        }
+
+        if (socks_race_more(c))
+            event_base_timer_add(base, &c->race_timer, socks_race_delay(c),
+                                 handler_socks_race_timer, c);
+        else
+            event_base_timer_cancel(base, &c->race_timer);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* go on with the race, fails once nothing is left to wait for. */
+static int handler_socks_race_on(struct event_base *base,
+                                 struct socks_conn *c)
+{
+    if (handler_socks_race(base, c) == 0 || c->nrace > 0 || c->query ||
+        c->query6)
+        return 0;
+
+    socks_race_fail(c);
+    return -1;
+}
+
+/* the first connect succeeded, end the race and the lookups. */
+static void handler_socks_race_end(struct event_base *base,
+                                   struct socks_conn *c, int fd)
+{
+    int i;
+
+    event_base_timer_cancel(base, &c->race_timer);
+    for (i = 0; i < c->nrace; i++) {
+        if (c->race[i] != fd)
+            event_base_delete(base, c->race[i], EV_WRITE);
+    }
+    if (c->query) {
+        resolv_cancel(resolver, c->query);
+        c->query = NULL;
+    }
+    if (c->query6) {
+        resolv_cancel(resolver, c->query6);
+        c->query6 = NULL;
+    }
+}
+
+/**
+ * Addresses of c->domain came in. Race as soon as the AAAA lookup is done,
+ * A records wait for it up to SOCKS_RESOLUTION_DELAY (RFC 8305 section 3).
+ * Addresses coming in during the race join it.
+ */
+static int handler_socks_lookup(struct event_base *base, struct socks_conn *c)
+{
+    if (c->state != SOCKS_RESOLVING)
+        return c->nrace ? 0 : handler_socks_race_on(base, c);
+
+    if (!c->query6 && (!c->query || c->naddrs))
+        return handler_socks_race_on(base, c);
+
+    if (!c->query && c->naddrs && !event_timer_pending(&c->race_timer))
+        event_base_timer_add(base, &c->race_timer, SOCKS_RESOLUTION_DELAY,
+                             handler_socks_race_timer, c);
+
+    return 0;
+}
+
+static void handler_socks_answer(struct event_base *base, struct socks_conn *c,
+                                 uint16_t type, int status,
+                                 const struct resolv_answer *ans)
+{
+    uint8_t state = c->state;
+
+    if (g_resolv_cache)
+        resolv_cache_put(g_resolv_cache, c->domain, type, status, ans);
+
+    if (status == RESOLV_OK)
+        socks_race_addrs(c, ans);
+
+    if (handler_socks_lookup(base, c) == -1) {
+        handler_socks_close(base, c);
+        return;
+    }
+
+    handler_socks_step(c, state);
+}
+
+static void handler_socks_resolved(struct event_base *base, int status,
+                                   const struct resolv_answer *ans, void *arg)
+{
+    struct socks_conn *c = arg;
+
+    c->query = NULL;
+    handler_socks_answer(base, c, RESOLV_A, status, ans);
+}
+
+static void handler_socks_resolved6(struct event_base *base, int status,
+                                    const struct resolv_answer *ans,
+                                    void *arg)
+{
+    struct socks_conn *c = arg;
+
+    c->query6 = NULL;
+    handler_socks_answer(base, c, RESOLV_AAAA, status, ans);
+}
+
+/* a background query filling or renewing a cache entry. */
+struct handler_prefetch {
+    struct handler_prefetch *next;
+    struct handler_prefetch **pprev;
+    struct resolv_query *query;
+    uint16_t type;
+    char name[];
+};
+
+/* in flight on this thread, one per name and type. */
+static __thread struct handler_prefetch *prefetches;
+static __thread uint32_t nprefetches;
+
+static void handler_socks_prefetch_free(struct handler_prefetch *p)
+{
+    if (p->next)
+        p->next->pprev = p->pprev;
+    *p->pprev = p->next;
+    nprefetches--;
+    free(p);
+}
+
+static void handler_socks_prefetched(struct event_base *base, int status,
+                                     const struct resolv_answer *ans,
+                                     void *arg)
+{
+    struct handler_prefetch *p = arg;
+
+    resolv_cache_put(g_resolv_cache, p->name, p->type, status, ans);
+    handler_socks_prefetch_free(p);
+}
+
+/**
+ * Resolve name into the cache, unless a query for it is in flight already.
+ * A burst of datagrams to an uncached name costs one upstream query, and
+ * all names together no more than HANDLER_PREFETCH_MAX at a time.
+ */
+static void handler_socks_prefetch(const char *name, uint16_t type)
+{
+    struct handler_prefetch *p;
+    size_t len = strlen(name);
+
+    if (nprefetches >= HANDLER_PREFETCH_MAX)
+        return;
+
+    for (p = prefetches; p; p = p->next) {
+        if (p->type == type && strcasecmp(p->name, name) == 0)
+            return;
+    }
+
+    p = malloc(sizeof(struct handler_prefetch) + len + 1);
+    if (!p)
+        return;
+    p->type = type;
+    memcpy(p->name, name, len + 1);
+
+    p->next = prefetches;
+    if (p->next)
+        p->next->pprev = &p->next;
+    p->pprev = &prefetches;
+    prefetches = p;
+    nprefetches++;
+
+    p->query = resolv_query(resolver, p->name, type, handler_socks_prefetched,
+                            p);
+    if (!p->query)
+        handler_socks_prefetch_free(p);
+}
+
+void handler_socks_exit(void)
+{
+    /* the queries still in flight would never free their prefetch. */
+    while (prefetches) {
+        resolv_cancel(resolver, prefetches->query);
+        handler_socks_prefetch_free(prefetches);
+    }
+
+    resolv_destroy(resolver);
+    resolver = NULL;
+}
+
+/* answer a lookup of c->domain from the cache, 0 if it has to be asked. */
+static int handler_socks_cached(struct socks_conn *c, uint16_t type)
+{
+    struct resolv_answer ans;
+    int status, ret;
+
+    if (!g_resolv_cache)
+        return 0;
+
+    ret = resolv_cache_get(g_resolv_cache, c->domain, type, &status, &ans);
+    if (ret == RESOLV_CACHE_MISS)
+        return 0;
+    if (ret == RESOLV_CACHE_REFRESH)
+        handler_socks_prefetch(c->domain, type);
+    if (status == RESOLV_OK)
+        socks_race_addrs(c, &ans);
+
+    return 1;
+}
+
+/* the resolver of this thread, created on its first lookup. */
+static int handler_socks_resolver(struct event_base *base)
+{
+    if (!resolver) {
+        resolver = resolv_new(base);
+        if (!resolver)
+            return -1;
+        resolv_load_conf(resolver, RESOLV_CONF);
+        resolv_load_hosts(resolver, RESOLV_HOSTS);
+    }
+    return 0;
+}
+
+/* resolve the domain of a CONNECT, A and AAAA at once. */
+static int handler_socks_resolve(struct event_base *base, struct socks_conn *c)
+{
+    struct resolv_answer ans;
+    int local = 0;
+
+    if (handler_socks_resolver(base) == -1)
+        return -1;
+
+    /* a hosts entry or literal answers for both families, like glibc. */
+    if (resolv_lookup_local(resolver, c->domain, RESOLV_AAAA, &ans) == 0) {
+        socks_race_addrs(c, &ans);
+        local = 1;
+    }
+    if (resolv_lookup_local(resolver, c->domain, RESOLV_A, &ans) == 0) {
+        socks_race_addrs(c, &ans);
+        local = 1;
+    }
+    if (local)
+        return handler_socks_lookup(base, c);
+
+    if (!handler_socks_cached(c, RESOLV_AAAA)) {
+        c->query6 = resolv_query(resolver, c->domain, RESOLV_AAAA,
+                                 handler_socks_resolved6, c);
+        if (!c->query6)
+            return -1;
+    }
+
+    if (!handler_socks_cached(c, RESOLV_A)) {
+        c->query = resolv_query(resolver, c->domain, RESOLV_A,
+                                handler_socks_resolved, c);
+        if (!c->query)
+            return -1;
+    }
+
+    return handler_socks_lookup(base, c);
+}
+
+/**
+ * A domain DST.ADDR of a datagram, answered from hosts or the cache only.
+ * A miss drops the datagram and fills the cache for the next one.
+ */
+static int handler_socks_udp_lookup(const char *name, struct resolv_addr *addr)
+{
+    struct resolv_answer ans;
+    int status, ret;
+
+    if (resolv_lookup_local(resolver, name, RESOLV_A, &ans) == 0 &&
+        ans.count) {
+        *addr = ans.addrs[0];
+        return 0;
+    }
+
+    if (!g_resolv_cache)
+        return -1;
+
+    /* a refresh, or a miss not asked for yet, see handler_socks_prefetch */
+    ret = resolv_cache_get(g_resolv_cache, name, RESOLV_A, &status, &ans);
+    if (ret != RESOLV_CACHE_HIT)
+        handler_socks_prefetch(name, RESOLV_A);
+    if (ret == RESOLV_CACHE_MISS || status != RESOLV_OK || ans.count == 0)
+        return -1;
+
+    *addr = ans.addrs[0];
+    return 0;
+}
+
+/* relay the datagrams of a UDP ASSOCIATE for as long as srcfd is open. */
+static int handler_socks_udp(struct event_base *base, struct socks_conn *c)
+{
+    if (handler_socks_resolver(base) == -1)
+        return -1;
+
+    if (!udp_batch) {
+        udp_batch = socks_udp_batch_new();
+        if (!udp_batch)
+            return -1;
+    }
+
+    if (socks_udp_associate(c, udp_batch, handler_socks_udp_lookup) == -1)
+        return -1;
+
+    if (event_base_add(base, c->udp->fd, EV_READ, handler_socks_conn, c) ==
+            -1 ||
+        event_base_add(base, c->udp->out4, EV_READ, handler_socks_conn, c) ==
+            -1 ||
+        (c->udp->out6 != -1 && event_base_add(base, c->udp->out6, EV_READ,
+                                              handler_socks_conn, c) == -1))
+        return -1;
+
+    handler_socks_deadline(base, c, g_opt.idle_timeout);
+
+    return 0;
+}
+
+static int handler_socks_want_write(struct event_base *base,
+                                    struct socks_conn *c, int fd,
+                                    uint8_t *events, int want)
+{
+    if (want && !(*events & EV_WRITE)) {
+        if (event_base_add(base, fd, EV_WRITE, handler_socks_conn, c) == -1)
+            return -1;
+        *events |= EV_WRITE;
+    } else if (!want && (*events & EV_WRITE)) {
+        if (event_base_delete(base, fd, EV_WRITE) == -1)
+            return -1;
+        *events &= ~EV_WRITE;
+    }
+    return 0;
+}
+
+/* wait for EV_WRITE on a fd only while its relay buffer holds bytes. */
+static int handler_socks_watch(struct event_base *base, struct socks_conn *c)
+{
+    if (handler_socks_want_write(base, c, c->srcfd, &c->src_events,
+                                 socks_pending(c, SOCKS_DOWN)) == -1)
+        return -1;
+
+    return handler_socks_want_write(base, c, c->dstfd, &c->dst_events,
+                                    socks_pending(c, SOCKS_UP));
+}
 
 static void handler_socks_conn(struct event_base *base, int fd, u_int16_t flags,
                                void *data)
 {
     struct socks_conn *c = data;
+    uint8_t state = c->state;
     int ret;
 
     switch (c->state) {
     case SOCKS_METHOD:
-        ret = socks_get_method(c);
-        if (ret == -1) {
-            pw_debug("socks get method failed\n");
-            goto done;
-        }
-        break;
     case SOCKS_AUTH:
-        ret = socks_authenticate(c);
+    case SOCKS_CMD:
+        /* take as much of the handshake as the client sent at once. */
+        while ((ret = socks_handshake(c)) == 1) {
+            handler_socks_step(c, state);
+            state = c->state;
+            if (state != SOCKS_AUTH && state != SOCKS_CMD)
+                break;
+        }
         if (ret == -1) {
-            pw_debug("socks authenticate failed\n");
+            pw_debug("socks handshake failed\n");
             goto done;
         }
-        break;
-    case SOCKS_CMD:
-        ret = socks_command(c);
-        if (ret == -1) {
-            pw_debug("socks handle command failed\n");
+        if (ret == 0)
+            break; /* wait for the rest */
+        if (c->state == SOCKS_UDP) {
+            if (handler_socks_udp(base, c) == -1)
+                goto done;
+            break;
+        }
+        /* the deadline covers the lookup and the connect. */
+        handler_socks_deadline(base, c, g_opt.connect_timeout);
+        if (c->state == SOCKS_RESOLVING)
+            ret = handler_socks_resolve(base, c);
+        else
+            ret = event_base_add(base, c->race[0], EV_WRITE,
+                                 handler_socks_conn, c);
+        if (ret == -1)
             goto done;
+        break;
+    case SOCKS_RESOLVING:
+        break; /* client bytes wait for SOCKS_SERVE */
+    case SOCKS_CONNECTING:
+        if (fd == c->srcfd)
+            break; /* client bytes wait for SOCKS_SERVE */
+
+        /* one of the connects of the race, closed if it failed. */
+        event_base_delete(base, fd, EV_WRITE);
+        if (socks_race_check(c, fd) == -1) {
+            if (handler_socks_race_on(base, c) == -1) {
+                pw_debug("socks connect failed\n");
+                goto done;
+            }
+            break;
         }
-        set_nonblocking(c->dstfd, 1);
+
+        handler_socks_race_end(base, c, fd);
+        if (socks_race_won(c, fd) == -1)
+            goto done;
+
+        handler_socks_deadline(base, c, g_opt.idle_timeout);
         ret = event_base_add(base, c->dstfd, EV_READ, handler_socks_conn, c);
         if (ret == -1)
             goto done;
+        c->dst_events = EV_READ;
+
+        /* the client may have sent data already, edges are not repeated. */
+        if (socks_serve(c, c->dstfd, EV_NONE) == -1)
+            goto done;
+        handler_socks_bytes(c);
+        if (handler_socks_watch(base, c) == -1)
+            goto done;
         break;
     case SOCKS_SERVE:
-        ret = socks_serve(c, fd);
+        handler_socks_deadline(base, c, g_opt.idle_timeout);
+        ret = socks_serve(c, fd, flags);
+        if (ret == -1)
+            goto done;
+        handler_socks_bytes(c);
+        if (handler_socks_watch(base, c) == -1)
+            goto done;
+        break;
+    case SOCKS_UDP:
+        handler_socks_deadline(base, c, g_opt.idle_timeout);
+        if (fd == c->srcfd)
+            ret = socks_udp_control(c);
+        else
+            ret = socks_udp_serve(c->udp, fd, &c->up_bytes, &c->down_bytes);
         if (ret == -1)
             goto done;
+        /* out of budget, the other conns of the loop go first */
+        if (ret == 1 && event_base_rearm(base, fd) == -1)
+            goto done;
+        handler_socks_bytes(c);
         break;
     default:
         goto done;
     }
 
+    handler_socks_step(c, state);
+
     return;
 done:
-    pw_debug("close connection: %d\n", fd);
-    event_base_delete(base, c->srcfd, EV_READ);
-    event_base_delete(base, c->dstfd, EV_READ);
-    socks_close_conn(c);
+    handler_socks_close(base, c);
 }
 
-void handler_socks(struct event_base *base, int fd, u_int16_t flags, void *data)
+/* the pools of this thread, created on its first conn. */
+static int handler_socks_init(void)
+{
+    if (!conn_pool) {
+        conn_pool = pool_new(sizeof(struct socks_conn),
+                             g_opt.worker_connections);
+        if (!conn_pool) {
+            pw_debug("create conn pool failed\n");
+            return -1;
+        }
+    }
+
+#ifdef __linux__
+    if (g_opt.splice && !pipe_pool) {
+        /* two pipes per conn in SOCKS_SERVE. */
+        pipe_pool = pipe_pool_new(g_opt.worker_connections);
+        if (!pipe_pool) {
+            pw_debug("create pipe pool failed\n");
+            return -1;
+        }
+    }
+#endif
+
+    if (!rtts) {
+        rtts = rtt_table_new(HANDLER_RTT_SIZE);
+        if (!rtts) {
+            pw_debug("create rtt table failed\n");
+            return -1;
+        }
+    }
+
+    if (g_stats && !stats)
+        stats = stats_worker(g_stats, worker_id());
+
+    return 0;
+}
+
+/* serve fd from the handshake on, accepted here or handed over. */
+static void handler_socks_start(struct event_base *base, struct socks *s,
+                                int fd, const struct sockaddr_storage *addr,
+                                socklen_t addrlen)
 {
     struct socks_conn *c;
 
-    c = socks_accept_conn(data);
-    if (!c) {
-        pw_debug("accept new socks conn failed\n");
+    c = socks_conn_new(s, conn_pool, fd, addr, addrlen);
+    if (!c)
         return;
-    }
 
-    pw_debug("new connection: %d\n", c->srcfd);
+    c->pipes = pipe_pool;
+    c->rtts = rtts;
 
-    set_nonblocking(c->srcfd, 1);
+    pw_debug("new connection: %d\n", c->srcfd);
 
     if (event_base_add(base, c->srcfd, EV_READ, handler_socks_conn, c) == -1) {
         pw_debug("event_base_add %d failed\n", c->srcfd);
         socks_close_conn(c);
         return;
     }
+    c->src_events = EV_READ;
+
+    if (stats)
+        c->born = c->since = ev_timer_now_us();
+
+    STATS_ADD(stats, accepts, 1);
+    STATS_ADD(stats, active, 1);
+    STATS_ADD(stats, states[SOCKS_METHOD], 1);
+
+    handler_socks_deadline(base, c, g_opt.handshake_timeout);
+}
+
+/* pass a conn nothing was read from yet to a less loaded worker. */
+static int handler_socks_handoff_out(int fd)
+{
+    int to;
+
+    to = handoff_pick(g_handoff, worker_id());
+    if (to == -1 || handoff_send(g_handoff, worker_id(), to, fd) == -1)
+        return -1;
+
+    pw_debug("handoff connection: %d to worker %d\n", fd, to);
+    STATS_ADD(stats, handoff_sent, 1);
+    close(fd);
+
+    return 0;
+}
+
+static void handler_socks_backoff_expired(struct event_base *base, void *data)
+{
+    struct handler_backoff *b = data;
+
+    /* not registered any more when the worker stopped listening. */
+    event_base_rearm(base, b->fd);
+}
+
+/**
+ * Out of fds or memory (or any error accept does not recover from), the
+ * backlog stays as it is. Rearming at once would report the fd ready again
+ * right away, rest it a while instead.
+ */
+static void handler_socks_backoff(struct event_base *base, int fd)
+{
+    struct handler_backoff *b;
+
+    for (b = backoffs; b; b = b->next) {
+        if (b->fd == fd)
+            break;
+    }
+
+    if (!b) {
+        b = calloc(1, sizeof(struct handler_backoff));
+        if (!b) {
+            pw_error("calloc");
+            return;
+        }
+        b->next = backoffs;
+        backoffs = b;
+    } else if (event_timer_pending(&b->timer)) {
+        return;
+    }
+
+    b->fd = fd;
+    event_base_timer_add(base, &b->timer, HANDLER_ACCEPT_BACKOFF,
+                         handler_socks_backoff_expired, b);
+}
+
+/* errors of a single conn (accept(2) reports the pending network errors). */
+static int handler_socks_accept_transient(int err)
+{
+    switch (err) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+    case EPERM:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ENOPROTOOPT:
+    case EOPNOTSUPP:
+#ifdef ENONET
+    case ENONET:
+#endif
+        return 1;
+    }
+
+    return 0;
+}
+
+void handler_socks(struct event_base *base, int fd, u_int16_t flags, void *data)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int budget, connfd;
+
+    if (handler_socks_init() == -1)
+        return;
+
+    /* the listen fd is edge triggered, drain the backlog. */
+    for (budget = HANDLER_ACCEPT_BUDGET; budget > 0; budget--) {
+        connfd = socks_accept(data, &addr, &addrlen);
+        if (connfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; /* the backlog is empty */
+            if (handler_socks_accept_transient(errno))
+                continue;
+            /* EMFILE, ENFILE, ENOBUFS..., logged by socks_accept */
+            handler_socks_backoff(base, fd);
+            return;
+        }
+
+        if (g_handoff && handler_socks_handoff_out(connfd) == 0)
+            continue;
+
+        handler_socks_start(base, data, connfd, &addr, addrlen);
+    }
+
+    /* out of budget with conns left to take, report fd again. */
+    event_base_rearm(base, fd);
+}
+
+void handler_socks_handoff(struct event_base *base, int fd, u_int16_t flags,
+                           void *data)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int budget, connfd;
+
+    if (handler_socks_init() == -1)
+        return;
+
+    for (budget = HANDLER_ACCEPT_BUDGET; budget > 0; budget--) {
+        connfd = handoff_recv(g_handoff, worker_id());
+        if (connfd == -1)
+            return;
+
+        addrlen = sizeof(addr);
+        if (getpeername(connfd, (struct sockaddr *)&addr, &addrlen) == -1) {
+            pw_error("getpeername");
+            close(connfd);
+            continue;
+        }
+
+        pw_debug("taken over connection: %d\n", connfd);
+        STATS_ADD(stats, handoff_received, 1);
+
+        handler_socks_start(base, data, connfd, &addr, addrlen);
+    }
+
+    event_base_rearm(base, fd);
 }
@@ -1,36 +1,95 @@
 /* node.c */
 
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "cpu.h"
 #include "debug.h"
+#include "handoff.h"
 #include "misc.h"
+#include "resolv_cache.h"
 #include "socks.h"
+#include "stats.h"
 #include "handler.h"
 
 static void usage(const char *name);
 static void read_options(int argc, char **argv);
 static void initializer(void);
 static void master_process(void);
+static void master_listen_reuseport(void);
+static void master_handoff(struct socks *const *socks, int n);
+static void master_cpus(void);
+static void master_admin(void);
+static void master_inherit(void);
+static void master_wait(void);
+
+/**
+ * A binary upgrade on SIGUSR2 execs the command line again, the listeners
+ * outlive the exec and their fds are passed in the environment.
+ */
+#define MASTER_ENV_LISTEN "SOCKS_LISTEN_FDS" /* fd,fd,... in worker order */
+#define MASTER_ENV_ADMIN "SOCKS_ADMIN_FD"
+#define MASTER_ENV_FROM "SOCKS_UPGRADE_FROM" /* pid of the old master */
 
 struct g_option g_opt = {
     .worker_processes = 1,
     .worker_connections = 1024,
+    .worker_threads = 1,
+    .handshake_timeout = 10,
+    .connect_timeout = 10,
+    .idle_timeout = 300,
+    .dns_cache = 4096,
+    .dns_ttl_min = 10,
+    .dns_ttl_max = 3600,
+    .drain_timeout = 30,
+    .admin_host = "127.0.0.1",
 };
 
+/* shared by the workers, mapped before they are forked. */
+struct resolv_cache *g_resolv_cache;
+struct handoff *g_handoff;
+struct stats *g_stats;
+
+/* CPUs the workers are pinned to, in worker order, NULL to not pin. */
+struct cpu_list *g_cpus;
+static struct cpu_list cpus;
+
+/* what an upgrade execs, the path resolved before daemonize changes dir. */
+static char **master_argv;
+static char master_exe[PATH_MAX];
+/* listeners of this master, in worker order, and the admin one or -1. */
+static int *master_fds;
+static int master_nfds;
+static int master_admin_fd = -1;
+/* those of the master this one upgrades, -1 once taken, see master_inherit */
+static int *inherited_fds;
+static int inherited_nfds;
+static int inherited_admin_fd = -1;
+static pid_t master_from; /* that master, 0 on a fresh start */
+static pid_t master_upgrade_pid; /* the new master while it starts */
+static volatile sig_atomic_t master_got_upgrade, master_got_quit;
+
 int main(int argc, char *argv[])
 {
+    master_argv = argv;
+    if (!strchr(argv[0], '/') || !realpath(argv[0], master_exe))
+        snprintf(master_exe, sizeof(master_exe), "%s", argv[0]);
+
     read_options(argc, argv);
+    master_inherit();
     initializer();
 
     master_process();
@@ -50,7 +109,24 @@ static void usage(const char *name)
         "  -u, --user\n"
         "  -p, --passwd\n"
         "  -C, --worker_connections\n"
-        "  -P, --worker_processes\n"
+        "      --splice\n"
+        "      --handshake_timeout\n"
+        "      --connect_timeout\n"
+        "      --idle_timeout\n"
+        "      --reuseport\n"
+        "      --reuseport_cpu\n"
+        "      --fastopen\n"
+        "      --drain_timeout (seconds, default 30, SIGQUIT or SIGUSR2)\n"
+        "      --dns_cache\n"
+        "      --dns_ttl_min\n"
+        "      --dns_ttl_max\n"
+        "      --handoff\n"
+        "  -P, --worker_processes (number or auto)\n"
+        "      --worker_threads\n"
+        "      --cpu_affinity[=0-3,8]\n"
+        "      --stats_name (default /socks5-PORT)\n"
+        "      --admin_host (default 127.0.0.1)\n"
+        "      --admin_port (Prometheus /metrics)\n"
         "  -h, --help\n"
         "  -v, --version\n",
         name);
@@ -66,7 +142,24 @@ static void read_options(int argc, char **argv)
         {"user", required_argument, NULL, 'u'},
         {"passwd", required_argument, NULL, 'p'},
         {"worker_connections", required_argument, NULL, 'C'},
+        {"splice", no_argument, NULL, 3},
+        {"connect_timeout", required_argument, NULL, 4},
+        {"dns_cache", required_argument, NULL, 5},
+        {"dns_ttl_min", required_argument, NULL, 6},
+        {"dns_ttl_max", required_argument, NULL, 7},
+        {"reuseport", no_argument, NULL, 8},
+        {"reuseport_cpu", no_argument, NULL, 9},
+        {"handshake_timeout", required_argument, NULL, 10},
+        {"idle_timeout", required_argument, NULL, 11},
         {"worker_processes", required_argument, NULL, 'P'},
+        {"worker_threads", required_argument, NULL, 12},
+        {"handoff", no_argument, NULL, 13},
+        {"cpu_affinity", optional_argument, NULL, 14},
+        {"stats_name", required_argument, NULL, 15},
+        {"admin_host", required_argument, NULL, 16},
+        {"admin_port", required_argument, NULL, 17},
+        {"fastopen", no_argument, NULL, 18},
+        {"drain_timeout", required_argument, NULL, 19},
         {"help", no_argument, NULL, 'h'},
         {"version", no_argument, NULL, 'v'},
         {},
@@ -93,8 +186,67 @@ static void read_options(int argc, char **argv)
         case 'C':
             g_opt.worker_connections = atoi(optarg);
             break;
+        case 3:
+#ifdef __linux__
+            g_opt.splice = 1;
+#else
+            fprintf(stderr, "--splice is only supported on Linux\n");
+#endif
+            break;
+        case 4:
+            g_opt.connect_timeout = atoi(optarg);
+            break;
+        case 5:
+            g_opt.dns_cache = atoi(optarg);
+            break;
+        case 6:
+            g_opt.dns_ttl_min = atoi(optarg);
+            break;
+        case 7:
+            g_opt.dns_ttl_max = atoi(optarg);
+            break;
+        case 9:
+            g_opt.reuseport_cpu = 1;
+            /* fall through */
+        case 8:
+            g_opt.reuseport = 1;
+            break;
+        case 10:
+            g_opt.handshake_timeout = atoi(optarg);
+            break;
+        case 11:
+            g_opt.idle_timeout = atoi(optarg);
+            break;
         case 'P':
-            g_opt.worker_processes = atoi(optarg);
+            /* 0 is derived from the CPUs below. */
+            g_opt.worker_processes =
+                strcmp(optarg, "auto") == 0 ? 0 : atoi(optarg);
+            break;
+        case 12:
+            g_opt.worker_threads = atoi(optarg);
+            if (g_opt.worker_threads == 0)
+                g_opt.worker_threads = 1;
+            break;
+        case 13:
+            g_opt.handoff = 1;
+            break;
+        case 14:
+            g_opt.cpu_affinity = optarg ? optarg : "";
+            break;
+        case 15:
+            g_opt.stats_name = optarg;
+            break;
+        case 16:
+            g_opt.admin_host = optarg;
+            break;
+        case 17:
+            g_opt.admin_port = atoi(optarg);
+            break;
+        case 18:
+            g_opt.fastopen = 1;
+            break;
+        case 19:
+            g_opt.drain_timeout = atoi(optarg);
             break;
         case 'v':
             fprintf(stdout, "%s version " NODE_VERSION "\n", basename(argv[0]));
@@ -112,38 +264,412 @@ static void read_options(int argc, char **argv)
 
     if (g_opt.host == NULL || g_opt.port == 0)
         usage(basename(argv[0]));
+
+    master_cpus();
+}
+
+/**
+ * With --cpu_affinity worker i is pinned to the ith CPU of the list, or of
+ * the affinity mask ordered by NUMA node so that the threads of a process
+ * share one; --reuseport_cpu then moves CPUs to the worker of their
+ * listener. With --worker_processes auto there is a worker per CPU of the
+ * list or of the affinity mask.
+ */
+static void master_cpus(void)
+{
+    uint32_t n;
+    int i, j, tmp;
+
+    if (cpu_list_get(&cpus, g_opt.cpu_affinity) == -1) {
+        if (g_opt.cpu_affinity)
+            fprintf(stderr, "--cpu_affinity is not usable, not pinning\n");
+        cpus.n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus.n < 1)
+            cpus.n = 1;
+    } else if (g_opt.cpu_affinity) {
+        g_cpus = &cpus;
+    }
+
+    if (g_opt.worker_processes == 0) {
+        g_opt.worker_processes = cpus.n / g_opt.worker_threads;
+        if (g_opt.worker_processes == 0)
+            g_opt.worker_processes = 1;
+    }
+
+    if (!g_cpus || !g_opt.reuseport_cpu)
+        return;
+
+    /**
+     * The steering program picks listener cpu % n for a conn the kernel
+     * received on cpu, give worker i a CPU that maps to its own listener.
+     */
+    n = g_opt.worker_processes * g_opt.worker_threads;
+    for (i = 0; i < cpus.n && (uint32_t)i < n; i++) {
+        for (j = i; j < cpus.n; j++) {
+            if ((uint32_t)cpus.cpu[j] % n == (uint32_t)i)
+                break;
+        }
+        if (j == cpus.n || j == i)
+            continue;
+        tmp = cpus.cpu[i];
+        cpus.cpu[i] = cpus.cpu[j];
+        cpus.cpu[j] = tmp;
+        tmp = cpus.node[i];
+        cpus.node[i] = cpus.node[j];
+        cpus.node[j] = tmp;
+    }
 }
 
 static void initializer(void)
 {
-    if (g_opt.is_daemon)
+    /* an upgrade runs detached already, like the master it replaces */
+    if (g_opt.is_daemon && !master_from)
         daemonize();
 }
 
-static void master_process(void)
+/**
+ * Take the listeners of the master that exec'd us from the environment,
+ * only from our parent: the variables are cleared for what we run next.
+ */
+static void master_inherit(void)
 {
-    struct socks *s;
+    const char *env, *from;
+    char *end;
+    long fd;
+    int n = 1;
+
+    from = getenv(MASTER_ENV_FROM);
+    env = getenv(MASTER_ENV_LISTEN);
+
+    if (from && env && atoi(from) == getppid()) {
+        for (end = (char *)env; *end; end++)
+            n += (*end == ',');
+        inherited_fds = calloc(n, sizeof(int));
+        if (!inherited_fds) {
+            pw_error("calloc");
+            abort();
+        }
+
+        while (inherited_nfds < n) {
+            fd = strtol(env, &end, 10);
+            if (end == env || fd < 0)
+                break;
+            inherited_fds[inherited_nfds++] = fd;
+            if (*end != ',')
+                break;
+            env = end + 1;
+        }
+
+        env = getenv(MASTER_ENV_ADMIN);
+        if (env)
+            inherited_admin_fd = atoi(env);
+
+        master_from = getppid();
+    }
+
+    unsetenv(MASTER_ENV_FROM);
+    unsetenv(MASTER_ENV_LISTEN);
+    unsetenv(MASTER_ENV_ADMIN);
+}
+
+/* listener i, the inherited one if it still suits, else a new one. */
+static struct socks *master_listener(int i, int flags)
+{
+    struct socks *s = NULL;
     int fd;
 
-    pw_debug("start master process %d\n", getpid());
+    if (i < inherited_nfds && inherited_fds[i] != -1) {
+        fd = inherited_fds[i];
+        inherited_fds[i] = -1;
+        s = socks_inherit(fd, g_opt.host, g_opt.port, g_opt.user,
+                          g_opt.passwd, flags);
+        if (s)
+            pw_debug("inherited listener %d\n", fd);
+    }
 
-    /* s = socks_create ("0.0.0.0", 1080, "admin", "123456"); */
-    s = socks_create(g_opt.host, g_opt.port, g_opt.user, g_opt.passwd);
+    if (!s)
+        s = socks_create(g_opt.host, g_opt.port, g_opt.user, g_opt.passwd,
+                         flags);
     if (!s) {
         pw_debug("%s:%d %s:%s\n", g_opt.host, g_opt.port, g_opt.user,
                  g_opt.passwd);
         abort();
     }
 
-    fd = s->fd;
+    master_fds[master_nfds++] = s->fd;
+
+    return s;
+}
+
+static void master_process(void)
+{
+    struct socks *s, **socks;
+    int fd, i, n = g_opt.worker_processes * g_opt.worker_threads;
+    static char name[64];
+
+    pw_debug("start master process %d\n", getpid());
+
+    /* counters of every worker, read by `socksctl stats`. */
+    if (!g_opt.stats_name)
+        g_opt.stats_name = stats_name(name, sizeof(name), g_opt.port);
+    g_stats = stats_create(g_opt.stats_name, n);
+    if (!g_stats)
+        pw_debug("create stats %s failed, counting nothing\n",
+                 g_opt.stats_name);
+
+    master_admin();
+
+    if (g_opt.dns_cache) {
+        g_resolv_cache = resolv_cache_new(g_opt.dns_cache, g_opt.dns_ttl_min,
+                                          g_opt.dns_ttl_max);
+        if (!g_resolv_cache)
+            pw_debug("create dns cache failed, resolving without\n");
+    }
+
+    master_fds = calloc(n, sizeof(int));
+    if (!master_fds) {
+        pw_error("calloc");
+        abort();
+    }
+
+    if (g_opt.reuseport) {
+        master_listen_reuseport();
+    } else {
+        /* s = socks_create ("0.0.0.0", 1080, "admin", "123456"); */
+        s = master_listener(0, g_opt.fastopen ? SOCKS_FASTOPEN : 0);
+
+        fd = s->fd;
+
+        /* every worker takes over conns for the one listener. */
+        socks = calloc(n, sizeof(struct socks *));
+        if (!socks) {
+            pw_error("calloc");
+            abort();
+        }
+        for (i = 0; i < n; i++)
+            socks[i] = s;
+        master_handoff(socks, n);
+        free(socks);
+
+        worker_listen_add(fd, EV_READ, handler_socks, s);
+    }
+
+    /* fewer listeners than before, their backlog is lost. */
+    for (i = 0; i < inherited_nfds; i++) {
+        if (inherited_fds[i] != -1)
+            close(inherited_fds[i]);
+    }
+    free(inherited_fds);
+    inherited_fds = NULL;
+
+    /* our workers accept on the listeners now, the old ones may drain. */
+    if (master_from) {
+        pw_debug("upgraded from master %d, stopping it\n", master_from);
+        kill(master_from, SIGQUIT);
+    }
+
+    master_wait();
+}
+
+static void master_signal(int signo)
+{
+    if (signo == SIGUSR2)
+        master_got_upgrade = 1;
+    else
+        master_got_quit = 1;
+}
+
+/**
+ * Exec the binary at master_exe with the listeners left open. The new master
+ * starts its workers on them and then sends us SIGQUIT, the backlog is never
+ * without an accepting process. If it fails to start, nothing changes.
+ */
+static void master_upgrade(void)
+{
+    char list[1024], num[16];
+    sigset_t none;
+    int i;
+
+    if (master_upgrade_pid > 0 && kill(master_upgrade_pid, 0) == 0) {
+        pw_debug("upgrade to %d in progress\n", master_upgrade_pid);
+        return;
+    }
+
+    list[0] = '\0';
+    for (i = 0; i < master_nfds; i++) {
+        snprintf(num, sizeof(num), "%s%d", i ? "," : "", master_fds[i]);
+        if (strlen(list) + strlen(num) >= sizeof(list)) {
+            pw_debug("too many listeners to pass\n");
+            return;
+        }
+        strcat(list, num);
+    }
+
+    master_upgrade_pid = fork();
+    if (master_upgrade_pid == -1) {
+        pw_error("fork");
+        return;
+    }
+    if (master_upgrade_pid > 0) {
+        pw_debug("upgrade, new master %d\n", master_upgrade_pid);
+        return;
+    }
+
+    /* the mask survives exec, the handlers do not. */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    snprintf(num, sizeof(num), "%d", getppid());
+    setenv(MASTER_ENV_FROM, num, 1);
+    setenv(MASTER_ENV_LISTEN, list, 1);
+    if (master_admin_fd != -1) {
+        snprintf(num, sizeof(num), "%d", master_admin_fd);
+        setenv(MASTER_ENV_ADMIN, num, 1);
+    }
+
+    execvp(master_exe, master_argv);
+    pw_error("execvp");
+    _exit(1);
+}
+
+/**
+ * SIGUSR2 upgrades the binary, SIGQUIT stops the workers gracefully, after
+ * they drained, and then the master.
+ */
+static void master_wait(void)
+{
+    struct sigaction action = {};
+    sigset_t sigs, old;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGQUIT);
+
+    /* blocked but while waiting, no signal slips in before sigsuspend */
+    if (sigprocmask(SIG_BLOCK, &sigs, &old) == -1) {
+        pw_error("sigprocmask");
+        abort();
+    }
+
+    action.sa_handler = master_signal;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR2, &action, NULL) == -1 ||
+        sigaction(SIGQUIT, &action, NULL) == -1) {
+        pw_error("sigaction");
+        abort();
+    }
+
+    while (!master_got_quit) {
+        sigsuspend(&old);
+        if (master_got_upgrade) {
+            master_got_upgrade = 0;
+            master_upgrade();
+        }
+    }
 
-    worker_listen_add(fd, EV_READ, handler_socks, s);
+    pw_debug("quit master %d, draining the workers\n", getpid());
+    worker_process_stop();
+    pw_debug("exit master %d\n", getpid());
+    exit(0);
+}
+
+/**
+ * A listener per worker instead of one shared by all, a connection only
+ * wakes the worker whose socket the kernel picked. The sockets are all
+ * created here, in worker order, so that the index the CPU steering program
+ * returns is the index of the worker.
+ */
+static void master_listen_reuseport(void)
+{
+    struct socks **socks;
+    int *fds, i, n = g_opt.worker_processes * g_opt.worker_threads;
+
+    socks = calloc(n, sizeof(struct socks *));
+    fds = calloc(n, sizeof(int));
+    if (!socks || !fds) {
+        pw_error("calloc");
+        abort();
+    }
+
+    for (i = 0; i < n; i++) {
+        socks[i] = master_listener(i, SOCKS_REUSEPORT |
+                                          (g_opt.fastopen ? SOCKS_FASTOPEN
+                                                          : 0));
+        fds[i] = socks[i]->fd;
+    }
+
+    if (g_opt.reuseport_cpu && socks_steer_cpu(socks[0], n) == -1)
+        pw_debug("steer connections by cpu failed, hashing them\n");
+
+    master_handoff(socks, n);
+
+    worker_listen_add_group(fds, (void *const *)socks, n, EV_READ,
+                            handler_socks);
+
+    free(fds);
+}
+
+/* the admin listener of worker 0, it reads the stats of all workers. */
+static void master_admin(void)
+{
+    void *data = NULL;
+    int fd;
+
+    fd = inherited_admin_fd;
+    inherited_admin_fd = -1;
+
+    /* the admin listener of the old master, if on the same address still */
+    if (fd != -1 &&
+        (!g_opt.admin_port ||
+         !tcp_bound(fd, g_opt.admin_host, g_opt.admin_port))) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (!g_opt.admin_port)
+        return;
+
+    if (fd == -1)
+        fd = tcp_listen(g_opt.admin_host, g_opt.admin_port);
+    if (fd == -1) {
+        pw_debug("admin listener %s:%d failed\n", g_opt.admin_host,
+                 g_opt.admin_port);
+        abort();
+    }
+
+    master_admin_fd = fd;
+    worker_listen_insert_group(&fd, &data, 1, EV_READ, handler_admin);
+}
+
+/**
+ * Shared load figures and a socket per worker, an overloaded worker passes
+ * the conns it just accepted to the least loaded one. Worker i serves the
+ * conns it is handed for socks[i].
+ */
+static void master_handoff(struct socks *const *socks, int n)
+{
+    int *fds, i;
+
+    if (!g_opt.handoff || n < 2)
+        return;
+
+    g_handoff = handoff_new(n);
+    if (!g_handoff) {
+        pw_debug("create handoff failed, workers keep their conns\n");
+        return;
+    }
+
+    fds = calloc(n, sizeof(int));
+    if (!fds) {
+        pw_error("calloc");
+        abort();
+    }
 
-    while (1)
-        sleep(10);
+    for (i = 0; i < n; i++)
+        fds[i] = handoff_fd(g_handoff, i);
 
-    pw_debug("kill session group all process.\n");
+    worker_listen_insert_group(fds, (void *const *)socks, n, EV_READ,
+                               handler_socks_handoff);
 
-    /* kill all child process. */
-    kill(0, SIGQUIT);
+    free(fds);
 }
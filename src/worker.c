@@ -3,12 +3,19 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 
 #include "common.h"
+#include "cpu.h"
 #include "debug.h"
 #include "ev.h"
+#include "handler.h"
+#include "handoff.h"
+#include "pool.h"
+#include "resolv_cache.h"
+#include "stats.h"
 
 struct fd_list {
     struct fd_list *next;
@@ -16,41 +23,86 @@ struct fd_list {
     event_handler_t *fn;
     void *data;
     uint16_t flags;
+    int worker; /* index of the only worker listening, -1 for all */
 };
 
 static void worker_process_quit(int signo);
-static void worker_process(void);
+static void worker_process(int index);
 static void worker_process_restart(void);
 static void worker_process_wait(int signo);
 
-static struct fd_list *fd_list;        /* listen fd list. */
-static int is_exit_worker = 0;         /* Exit the old worker process. */
-static pid_t *worker_pids;             /* worker process pid array. */
-static struct event_base *worker_base; /* woker process event_base. */
-
-void worker_listen_add(int fd, uint16_t flags, event_handler_t *fn, void *data)
+static struct fd_list *fd_list;                 /* listen fd list. */
+static pid_t *worker_pids;                      /* worker process pids. */
+static struct event_base **worker_bases;        /* bases of this process. */
+static uint32_t worker_nbases;                  /* threads of this process. */
+static int worker_first;                        /* index of thread 0. */
+static __thread struct event_base *worker_base; /* worker event_base. */
+static __thread int worker_index; /* index of this worker (thread). */
+static __thread int worker_stopped; /* listen fds deleted, drain and exit. */
+static __thread int worker_drained; /* the drain deadline passed, exit. */
+static __thread struct event_timer worker_drain_timer;
+
+static int worker_listen_insert(int fd, uint16_t flags, event_handler_t *fn,
+                                void *data, int worker)
 {
     struct fd_list *newfd;
 
     if (fd < 0 || flags == EV_NONE || !fn)
-        return;
+        return -1;
 
     newfd = calloc(1, sizeof(struct fd_list));
     if (!newfd) {
         pw_error("calloc");
-        return;
+        return -1;
     }
 
     newfd->fd = fd;
     newfd->fn = fn;
     newfd->data = data;
     newfd->flags = flags;
+    newfd->worker = worker;
     newfd->next = fd_list;
     fd_list = newfd;
 
+    return 0;
+}
+
+/* whether the worker process listens on curr. */
+static int worker_listen_own(const struct fd_list *curr)
+{
+    return curr->worker == -1 || curr->worker == worker_index;
+}
+
+void worker_listen_add(int fd, uint16_t flags, event_handler_t *fn, void *data)
+{
+    if (worker_listen_insert(fd, flags, fn, data, -1) == -1)
+        return;
+
+    worker_process_restart();
+}
+
+void worker_listen_insert_group(const int *fds, void *const *data, int n,
+                                uint16_t flags, event_handler_t *fn)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        worker_listen_insert(fds[i], flags, fn, data[i], i);
+}
+
+void worker_listen_add_group(const int *fds, void *const *data, int n,
+                             uint16_t flags, event_handler_t *fn)
+{
+    worker_listen_insert_group(fds, data, n, flags, fn);
+
     worker_process_restart();
 }
 
+int worker_id(void)
+{
+    return worker_index;
+}
+
 void worker_listen_delete(int fd)
 {
     struct fd_list *prev = NULL, *curr;
@@ -72,15 +124,15 @@ void worker_listen_delete(int fd)
     worker_process_restart();
 }
 
-static void worker_quit(int signo)
+static void worker_listen_stop(void)
 {
     struct fd_list *curr;
     int ret;
 
-    is_exit_worker = 1;
-
     /* delete listen fd for event. */
     for (curr = fd_list; curr; curr = curr->next) {
+        if (!worker_listen_own(curr))
+            continue;
         pw_debug("delete listen fd: %d\n", curr->fd);
         ret = event_base_delete(worker_base, curr->fd, curr->flags);
         if (ret == -1) {
@@ -89,32 +141,76 @@ static void worker_quit(int signo)
     }
 }
 
-static void worker_process(void)
+/* pin the calling thread to the CPU of worker index, see master_cpus. */
+static void worker_pin(int index)
+{
+    int i;
+
+    if (!g_cpus)
+        return;
+
+    i = index % g_cpus->n;
+    if (cpu_pin(g_cpus->cpu[i]) == 0)
+        pw_debug("worker %d on cpu %d, node %d\n", index, g_cpus->cpu[i],
+                 g_cpus->node[i]);
+}
+
+/* conns still open are cut when the worker exits. */
+static void worker_drain_expired(struct event_base *base, void *arg)
+{
+    pw_debug("drain timeout, %u events left\n", base->event_num);
+    worker_drained = 1;
+}
+
+/* posted to every thread of the process, runs in the thread's loop. */
+static void worker_stop(struct event_base *base, void *arg)
+{
+    if (worker_stopped)
+        return;
+    if (g_handoff)
+        handoff_alive(g_handoff, worker_index, 0);
+    worker_listen_stop();
+    worker_stopped = 1;
+
+    /* the timer ends the wait of the loop too, no polling for it. */
+    if (g_opt.drain_timeout)
+        event_base_timer_add(base, &worker_drain_timer,
+                             g_opt.drain_timeout * 1000, worker_drain_expired,
+                             NULL);
+}
+
+static void worker_quit(struct event_base *base, int signo, void *arg)
+{
+    uint32_t i;
+
+    for (i = 0; i < worker_nbases; i++) {
+        if (event_base_post(worker_bases[i], worker_stop, NULL) == -1)
+            pw_debug("event_base_post %u failed\n", i);
+    }
+}
+
+/* event loop of a worker, index counts the threads of all processes. */
+static void *worker_thread(void *arg)
 {
-    struct sigaction action = {};
     struct timeval tv = {};
     struct fd_list *curr;
+    struct stats_worker *stats = NULL;
+    uint64_t hits, misses;
     int ret;
 
-    pw_debug("start worker process %d\n", getpid());
+    worker_base = worker_bases[(intptr_t)arg];
+    worker_index = worker_first + (int)(intptr_t)arg;
 
-    action.sa_handler = worker_quit;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = 0;
-
-    if (sigaction(SIGQUIT, &action, NULL) == -1) {
-        pw_error("sigaction");
-        abort();
-    }
+    /* threads start with the affinity of the main thread, pin them again. */
+    if (worker_nbases > 1)
+        worker_pin(worker_index);
 
-    worker_base = event_base_new(g_opt.worker_connections);
-    if (!worker_base) {
-        pw_debug("event_base_new failed\n");
-        abort();
-    }
+    pw_debug("start worker %d (%d)\n", getpid(), worker_index);
 
     /* add listen fd to event. */
     for (curr = fd_list; curr; curr = curr->next) {
+        if (!worker_listen_own(curr))
+            continue;
         ret = event_base_add(worker_base, curr->fd, curr->flags, curr->fn,
                              curr->data);
         if (ret == -1) {
@@ -122,6 +218,12 @@ static void worker_process(void)
         }
     }
 
+    if (g_handoff)
+        handoff_alive(g_handoff, worker_index, 1);
+
+    if (g_stats)
+        stats = stats_worker(g_stats, worker_index);
+
     while (1) {
         tv.tv_sec = 5;
         tv.tv_usec = 0;
@@ -131,22 +233,148 @@ static void worker_process(void)
             pw_error("event_base_loop");
         }
 
+        /* the load siblings decide on, the ready events are the queue. */
+        if (g_handoff)
+            handoff_publish(g_handoff, worker_index, worker_base->event_num,
+                            ret > 0 ? ret : 0);
+        STATS_SET(stats, queue, ret > 0 ? ret : 0);
+
+        if (ret > 0)
+            STATS_HIST(stats, STATS_HIST_DISPATCH, worker_base->dispatch_us);
+
         if (ret == 0) /* timeout */
         {
             pw_debug("worker event timeout %d, %d\n", ret,
                      worker_base->event_num);
-            if (is_exit_worker && worker_base->event_num == 0)
-                break; /* exit woker process. */
+            pw_debug("event pool hits %llu, misses %llu, high %u\n",
+                     (unsigned long long)worker_base->pool->hits,
+                     (unsigned long long)worker_base->pool->misses,
+                     worker_base->pool->high);
+            if (g_resolv_cache) {
+                resolv_cache_stats(g_resolv_cache, &hits, &misses);
+                pw_debug("dns cache hits %llu, misses %llu\n",
+                         (unsigned long long)hits, (unsigned long long)misses);
+            }
+            if (g_handoff && stats) {
+                pw_debug("handoff sent %llu, received %llu\n",
+                         (unsigned long long)stats->handoff_sent,
+                         (unsigned long long)stats->handoff_received);
+            }
         }
+
+        if (worker_stopped && (worker_base->event_num == 0 || worker_drained))
+            break; /* exit woker. */
     }
 
+    handler_socks_exit();
     event_base_destroy(worker_base);
 
+    pw_debug("exit worker %d (%d)\n", getpid(), worker_index);
+
+    return NULL;
+}
+
+static void worker_process(int index)
+{
+    pthread_t *tids;
+    uint32_t i, n = g_opt.worker_threads ? g_opt.worker_threads : 1;
+
+    pw_debug("start worker process %d (%d)\n", getpid(), index);
+
+    /* created up front, any thread may post to the others from now on. */
+    worker_bases = calloc(n, sizeof(struct event_base *));
+    if (!worker_bases) {
+        pw_error("calloc");
+        abort();
+    }
+    worker_nbases = n;
+    worker_first = index * n;
+
+    for (i = 0; i < n; i++) {
+        /**
+         * On the CPU of the thread that will use it, the memory of the base
+         * is then first touched on the local node.
+         */
+        worker_pin(worker_first + i);
+        worker_bases[i] = event_base_new(g_opt.worker_connections);
+        if (!worker_bases[i]) {
+            pw_debug("event_base_new failed\n");
+            abort();
+        }
+    }
+
+    /**
+     * SIGQUIT is read from a signalfd of the first thread, it is blocked
+     * before the other threads start and they inherit the mask.
+     */
+    if (event_base_signal(worker_bases[0], SIGQUIT, worker_quit, NULL) == -1) {
+        pw_debug("event_base_signal failed\n");
+        abort();
+    }
+
+    if (n == 1) {
+        worker_thread((void *)(intptr_t)0);
+        exit(0);
+    }
+
+    /**
+     * A thread per event_base, the threads share the address space, read
+     * only options and the DNS cache. Handlers keep their state per thread.
+     */
+    tids = calloc(n, sizeof(pthread_t));
+    if (!tids) {
+        pw_error("calloc");
+        abort();
+    }
+
+    for (i = 0; i < n; i++) {
+        errno = pthread_create(&tids[i], NULL, worker_thread,
+                               (void *)(intptr_t)i);
+        if (errno != 0) {
+            pw_error("pthread_create");
+            abort();
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+
     pw_debug("exit worker process %d\n", getpid());
 
     exit(0);
 }
 
+void worker_process_stop(void)
+{
+    sigset_t sigs;
+    int i, status;
+
+    if (!worker_pids)
+        return;
+
+    /* reaped here, worker_process_wait must not take them first. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &sigs, NULL) == -1) {
+        pw_error("sigprocmask");
+        return;
+    }
+
+    for (i = 0; i < g_opt.worker_processes; i++) {
+        if (worker_pids[i] > 0)
+            kill(worker_pids[i], SIGQUIT);
+    }
+
+    /* ECHILD for those that exited before SIGCHLD was blocked. */
+    for (i = 0; i < g_opt.worker_processes; i++) {
+        if (worker_pids[i] <= 0)
+            continue;
+        while (waitpid(worker_pids[i], &status, 0) == -1 && errno == EINTR)
+            ;
+        pw_debug("%d child %d process exit\n", getpid(), worker_pids[i]);
+    }
+}
+
 static void worker_process_restart(void)
 {
     struct sigaction action = {};
@@ -179,7 +407,7 @@ static void worker_process_restart(void)
         if (pids[i] == 0) /* child process. */
         {
             /* close parent fds. */
-            worker_process();
+            worker_process(i);
         }
 
         /* parent process. */
@@ -0,0 +1,288 @@
+/* bench.c */
+
+/**
+ * Microbenchmarks of the lib primitives, with fixed iteration counts so
+ * that runs compare across commits. Every case prints one line in ns/op.
+ * Build with -DCMAKE_BUILD_TYPE=Release, pw_debug in the parsers otherwise
+ * dominates.
+ *
+ *   bench [filter]   only the cases whose name contains filter
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "ev.h"
+#include "ev_hash.h"
+#include "misc.h"
+#include "debug.h"
+#include "socks.h"
+
+#define CHURN_FDS 256
+#define CHURN_ITERS 1000000
+#define DISPATCH_FDS 512
+#define DISPATCH_ROUNDS 2000
+#define HASH_SIZE 4096
+#define HASH_ITERS 10000000
+#define PARSE_ITERS 200000
+
+static const char *filter;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t ns, uint64_t ops)
+{
+    putf("%-28s %10llu ops %10.1f ns/op\n", name, (unsigned long long)ops,
+         (double)ns / ops);
+}
+
+static int selected(const char *name)
+{
+    return !filter || strstr(name, filter);
+}
+
+static void pair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        pw_error("socketpair");
+        abort();
+    }
+    set_nonblocking(sv[0], 1);
+    set_nonblocking(sv[1], 1);
+}
+
+static void nop(struct event_base *base, int fd, uint16_t flags, void *data)
+{
+}
+
+/* event_base_add and event_base_delete of a registered fd, in pairs. */
+static void bench_churn(void)
+{
+    struct event_base *base;
+    int fds[CHURN_FDS][2], i;
+    uint64_t start;
+
+    base = event_base_new(CHURN_FDS);
+    for (i = 0; i < CHURN_FDS; i++)
+        pair(fds[i]);
+
+    start = now_ns();
+    for (i = 0; i < CHURN_ITERS; i++) {
+        event_base_add(base, fds[i % CHURN_FDS][0], EV_READ, nop, NULL);
+        event_base_delete(base, fds[i % CHURN_FDS][0], EV_READ);
+        /* the deleted events are freed after a dispatch */
+        if (i % CHURN_FDS == CHURN_FDS - 1)
+            event_base_loop(base, &(struct timeval){0, 0});
+    }
+    report("ev_add_delete", now_ns() - start, CHURN_ITERS * 2ULL);
+
+    /* adding EV_WRITE to an EV_READ fd and taking it off again */
+    for (i = 0; i < CHURN_FDS; i++)
+        event_base_add(base, fds[i][0], EV_READ, nop, NULL);
+    start = now_ns();
+    for (i = 0; i < CHURN_ITERS; i++) {
+        event_base_add(base, fds[i % CHURN_FDS][0], EV_WRITE, nop, NULL);
+        event_base_delete(base, fds[i % CHURN_FDS][0], EV_WRITE);
+    }
+    report("ev_modify", now_ns() - start, CHURN_ITERS * 2ULL);
+
+    event_base_destroy(base);
+    for (i = 0; i < CHURN_FDS; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+static uint64_t dispatched;
+
+static void drain(struct event_base *base, int fd, uint16_t flags, void *data)
+{
+    char c;
+
+    dispatched++;
+    if (read(fd, &c, 1) != 1)
+        abort();
+}
+
+/**
+ * event_base_loop with DISPATCH_FDS ready fds, the byte to read is written
+ * outside of the timed part. The handler's read(2) is part of the cost.
+ */
+static void bench_dispatch(void)
+{
+    struct event_base *base;
+    int fds[DISPATCH_FDS][2], i, r;
+    uint64_t ns = 0, start;
+
+    base = event_base_new(DISPATCH_FDS);
+    for (i = 0; i < DISPATCH_FDS; i++) {
+        pair(fds[i]);
+        event_base_add(base, fds[i][0], EV_READ, drain, NULL);
+    }
+
+    for (r = 0; r < DISPATCH_ROUNDS; r++) {
+        for (i = 0; i < DISPATCH_FDS; i++) {
+            if (write(fds[i][1], "x", 1) != 1)
+                abort();
+        }
+        start = now_ns();
+        while (dispatched < (uint64_t)(r + 1) * DISPATCH_FDS)
+            event_base_loop(base, NULL);
+        ns += now_ns() - start;
+    }
+    report("ev_dispatch", ns, dispatched);
+
+    event_base_destroy(base);
+    for (i = 0; i < DISPATCH_FDS; i++) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+/* ev_hash_get of present fds, n fds in a table of HASH_SIZE buckets. */
+static void bench_hash(const char *name, uint32_t n)
+{
+    struct event_base *base;
+    struct event *evs;
+    uint64_t start, sum = 0;
+    uint32_t i, x = 1;
+
+    base = event_base_new(HASH_SIZE);
+    evs = calloc(n, sizeof(struct event));
+    if (!base || !evs)
+        abort();
+    for (i = 0; i < n; i++) {
+        evs[i].fd = 1000 + i;
+        if (ev_hash_set(base, evs[i].fd, &evs[i]) == -1)
+            abort();
+    }
+
+    start = now_ns();
+    for (i = 0; i < HASH_ITERS; i++) {
+        x = x * 1103515245 + 12345; /* cheap LCG, fds in random order */
+        sum += (uintptr_t)ev_hash_get(base, 1000 + (x >> 8) % n);
+    }
+    report(name, now_ns() - start, HASH_ITERS);
+
+    if (sum == 0)
+        abort();
+    for (i = 0; i < n; i++)
+        ev_hash_delete(base, 1000 + i);
+    event_base_destroy(base);
+    free(evs);
+}
+
+/**
+ * socks_handshake from state to until on a conn whose srcfd is a
+ * socketpair: the request is written to the peer, parsed, and the replies
+ * read back. The syscalls are part of the cost, like in the proxy.
+ */
+static void bench_parse(const char *name, struct socks *s, uint8_t state,
+                        uint8_t until, const void *req, size_t len)
+{
+    struct socks_conn c;
+    char reply[64];
+    uint64_t start;
+    int sv[2], i;
+
+    pair(sv);
+
+    start = now_ns();
+    for (i = 0; i < PARSE_ITERS; i++) {
+        memset(&c, 0, offsetof(struct socks_conn, in));
+        c.socks = s;
+        c.srcfd = sv[0];
+        c.dstfd = -1;
+        c.state = state;
+
+        if (write(sv[1], req, len) != (ssize_t)len)
+            abort();
+        while (c.state != until) {
+            if (socks_handshake(&c) != 1)
+                abort();
+        }
+        /* a domain CONNECT replies only once connected */
+        if (state != SOCKS_CMD && read(sv[1], reply, sizeof(reply)) <= 0)
+            abort();
+    }
+    report(name, now_ns() - start, PARSE_ITERS);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void bench_parsers(void)
+{
+    static const uint8_t method[] = {5, 2, 0, 2};
+    static const uint8_t auth[] = {1, 5, 'a', 'd', 'm', 'i', 'n',
+                                   6, '1', '2', '3', '4', '5', '6'};
+    static const uint8_t cmd[] = {5,   1,   0,   3,   11,  'e', 'x', 'a',
+                                  'm', 'p', 'l', 'e', '.', 'c', 'o', 'm',
+                                  0,   80};
+    struct socks s = {};
+    uint8_t all[sizeof(method) + sizeof(auth) + sizeof(cmd)];
+
+    if (selected("socks_get_method"))
+        bench_parse("socks_get_method", &s, SOCKS_METHOD, SOCKS_CMD, method,
+                    sizeof(method));
+
+    strcpy(s.user, "admin");
+    strcpy(s.passwd, "123456");
+    s.use_auth = 1;
+    if (selected("socks_authenticate"))
+        bench_parse("socks_authenticate", &s, SOCKS_AUTH, SOCKS_CMD, auth,
+                    sizeof(auth));
+
+    if (selected("socks_command"))
+        bench_parse("socks_command", &s, SOCKS_CMD, SOCKS_RESOLVING, cmd,
+                    sizeof(cmd));
+
+    /* all three in one write, like curl sends them */
+    memcpy(all, method, sizeof(method));
+    memcpy(all + sizeof(method), auth, sizeof(auth));
+    memcpy(all + sizeof(method) + sizeof(auth), cmd, sizeof(cmd));
+    if (selected("socks_handshake_pipelined"))
+        bench_parse("socks_handshake_pipelined", &s, SOCKS_METHOD,
+                    SOCKS_RESOLVING, all, sizeof(all));
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+
+#ifndef NDEBUG
+    fprintf(stderr, "debug build, the numbers include pw_debug\n");
+#endif
+
+    if (selected("ev_add_delete") || selected("ev_modify"))
+        bench_churn();
+    if (selected("ev_dispatch"))
+        bench_dispatch();
+    if (selected("ev_hash_get_lf0.25"))
+        bench_hash("ev_hash_get_lf0.25", HASH_SIZE / 4);
+    if (selected("ev_hash_get_lf0.5"))
+        bench_hash("ev_hash_get_lf0.5", HASH_SIZE / 2);
+    if (selected("ev_hash_get_lf1"))
+        bench_hash("ev_hash_get_lf1", HASH_SIZE);
+    if (selected("ev_hash_get_lf2"))
+        bench_hash("ev_hash_get_lf2", HASH_SIZE * 2);
+    if (selected("ev_hash_get_lf4"))
+        bench_hash("ev_hash_get_lf4", HASH_SIZE * 4);
+    bench_parsers();
+
+    return 0;
+}
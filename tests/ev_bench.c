@@ -0,0 +1,89 @@
+/* ev_bench.c */
+
+/**
+ * Event backend benchmark: N socketpairs play ping-pong through one
+ * event_base, every dispatch reads one byte and writes it back. Build once
+ * with -DUSE_IO_URING=OFF and once with ON to compare the backends.
+ *
+ *   ev_bench [pairs] [dispatches]
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ev.h"
+#include "misc.h"
+#include "debug.h"
+
+static uint64_t dispatched;
+
+static void pingpong(struct event_base *base, int fd, uint16_t flags,
+                     void *data)
+{
+    char c;
+
+    while (read(fd, &c, 1) == 1) {
+        dispatched++;
+        if (write(fd, &c, 1) != 1)
+            abort();
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    struct event_base *base;
+    uint32_t pairs = 256, i;
+    uint64_t total = 2000000;
+    double start, elapsed;
+    int sv[2];
+
+    if (argc > 1)
+        pairs = atoi(argv[1]);
+    if (argc > 2)
+        total = strtoull(argv[2], NULL, 10);
+
+    base = event_base_new(pairs * 2);
+    if (!base)
+        abort();
+
+    for (i = 0; i < pairs; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            pw_error("socketpair");
+            abort();
+        }
+        set_nonblocking(sv[0], 1);
+        set_nonblocking(sv[1], 1);
+        event_base_add(base, sv[0], EV_READ, pingpong, NULL);
+        event_base_add(base, sv[1], EV_READ, pingpong, NULL);
+        if (write(sv[0], "x", 1) != 1)
+            abort();
+    }
+
+    start = now();
+    while (dispatched < total) {
+        if (event_base_loop(base, NULL) == -1)
+            abort();
+    }
+    elapsed = now() - start;
+
+    putf("pairs %u, dispatches %llu, %.3f s, %.1f ns/dispatch\n", pairs,
+         (unsigned long long)dispatched, elapsed, elapsed * 1e9 / dispatched);
+
+    event_base_destroy(base);
+
+    return 0;
+}
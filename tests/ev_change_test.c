@@ -0,0 +1,110 @@
+/* ev_change_test.c */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ev.h"
+#include "misc.h"
+
+/**
+ * Interest changes of a registered fd are queued until the next poll. The
+ * last state of a round is what the backend sees, changes that cancel out
+ * are dropped, and an fd deleted, closed and reused in between is safe.
+ */
+
+static uint16_t seen;
+static int calls;
+
+static void on_event(struct event_base *base, int fd, uint16_t flags,
+                     void *data)
+{
+    seen |= flags;
+    calls++;
+}
+
+static void poll_once(struct event_base *base)
+{
+    seen = EV_NONE;
+    calls = 0;
+    event_base_loop(base, &(struct timeval){0, 10000});
+}
+
+int main(int argc, char *argv[])
+{
+    struct event_base *base;
+    int sv[2], fd, ret;
+
+    base = event_base_new(16);
+    assert(base);
+    ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0);
+    set_nonblocking(sv[0], 1);
+
+    /* a writable socket, nothing to read */
+    ret = event_base_add(base, sv[0], EV_READ, on_event, NULL);
+    assert(ret == 0);
+    poll_once(base);
+    assert(calls == 0);
+
+    /* write interest on and off in one round never reaches the backend */
+    ret = event_base_add(base, sv[0], EV_WRITE, on_event, NULL);
+    assert(ret == 0);
+    ret = event_base_delete(base, sv[0], EV_WRITE);
+    assert(ret == 0);
+    assert(base->nchanges == 1);
+    poll_once(base);
+    assert(calls == 0 && base->nchanges == 0);
+
+    /* toggled many times, left on: reported once the round is over */
+    ret = event_base_add(base, sv[0], EV_WRITE, on_event, NULL);
+    assert(ret == 0);
+    ret = event_base_delete(base, sv[0], EV_WRITE);
+    assert(ret == 0);
+    ret = event_base_add(base, sv[0], EV_WRITE, on_event, NULL);
+    assert(ret == 0);
+    assert(base->nchanges == 1);
+    poll_once(base);
+    assert(seen == EV_WRITE);
+
+    /* edge triggered, not again until it is registered anew */
+    poll_once(base);
+    assert(calls == 0);
+
+    /* a rearm reports the still writable fd again, once */
+    ret = event_base_rearm(base, sv[0]);
+    assert(ret == 0);
+    poll_once(base);
+    assert(seen == EV_WRITE && calls == 1);
+    poll_once(base);
+    assert(calls == 0);
+
+    /* a queued change, then deleted, closed and the fd number reused */
+    ret = event_base_delete(base, sv[0], EV_WRITE);
+    assert(ret == 0);
+    ret = event_base_delete(base, sv[0], EV_READ);
+    assert(ret == 0);
+    fd = sv[0];
+    close(sv[0]);
+    ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(ret == 0 && sv[0] == fd);
+    set_nonblocking(sv[0], 1);
+    ret = event_base_add(base, sv[0], EV_READ, on_event, NULL);
+    assert(ret == 0);
+    ret = write(sv[1], "x", 1);
+    assert(ret == 1);
+    poll_once(base);
+    assert(seen == EV_READ && base->event_num == 1);
+    (void)ret;
+    (void)fd;
+
+    event_base_destroy(base);
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("ev_change_test passed\n");
+
+    return 0;
+}
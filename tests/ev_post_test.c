@@ -0,0 +1,88 @@
+/* ev_post_test.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "ev.h"
+
+/**
+ * Several threads post to one loop at once, every task runs exactly once
+ * and the tasks of a thread run in posting order. A signal then ends it.
+ */
+
+#define THREADS 4
+#define TASKS 100000
+
+static struct event_base *base;
+static long last[THREADS];
+static long done;
+static int quit;
+
+static void on_task(struct event_base *base, void *arg)
+{
+    long v = (long)arg, t = v / TASKS;
+
+    assert(v == last[t] + 1);
+    last[t] = v;
+    done++;
+}
+
+static void *producer(void *arg)
+{
+    long t = (long)arg, i;
+    int ret;
+
+    for (i = 0; i < TASKS; i++) {
+        ret = event_base_post(base, on_task, (void *)(t * TASKS + i));
+        assert(ret == 0);
+    }
+    (void)ret;
+    return NULL;
+}
+
+static void on_signal(struct event_base *base, int signo, void *arg)
+{
+    assert(signo == SIGUSR1);
+    quit = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t tids[THREADS];
+    long t;
+    int ret;
+
+    base = event_base_new(16);
+    assert(base);
+    ret = event_base_signal(base, SIGUSR1, on_signal, NULL);
+    assert(ret == 0);
+
+    for (t = 0; t < THREADS; t++) {
+        last[t] = t * TASKS - 1;
+        ret = pthread_create(&tids[t], NULL, producer, (void *)t);
+        assert(ret == 0);
+    }
+    (void)ret;
+
+    /* the wakeup and signal fds leave event_num at 0 */
+    assert(base->event_num == 0);
+
+    while (done < (long)THREADS * TASKS)
+        event_base_loop(base, NULL);
+
+    for (t = 0; t < THREADS; t++)
+        pthread_join(tids[t], NULL);
+
+    raise(SIGUSR1);
+    while (!quit)
+        event_base_loop(base, NULL);
+
+    event_base_destroy(base);
+
+    printf("ev_post_test passed, %ld tasks\n", done);
+
+    return 0;
+}
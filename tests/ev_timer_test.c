@@ -0,0 +1,97 @@
+/* ev_timer_test.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ev.h"
+#include "ev_timer.h"
+
+/**
+ * Drives the wheel with a simulated clock: sleeping for what ev_timer_next
+ * says, every timer has to fire exactly at its expiry, across all levels.
+ */
+
+#define TIMERS 2000
+
+static struct event_timer timers[TIMERS];
+static uint64_t now;
+static int exact; /* set after catching up with the real clock */
+static int fired;
+
+static void on_timer(struct event_base *base, void *data)
+{
+    struct event_timer *t = data;
+
+    assert(exact ? t->expire == now : t->expire <= now);
+    assert(!event_timer_pending(t));
+    fired++;
+
+    /* 0 and 1 cancel each other, from the same batch or a later one */
+    if (t == &timers[0])
+        event_base_timer_cancel(base, &timers[1]);
+    if (t == &timers[1])
+        event_base_timer_cancel(base, &timers[0]);
+}
+
+static void on_rearm(struct event_base *base, void *data)
+{
+    static int n;
+
+    if (++n < 5)
+        event_base_timer_add(base, data, 0, on_rearm, data);
+    fired++;
+}
+
+int main(int argc, char *argv[])
+{
+    struct event_base *base;
+    struct event_timer rearm = {};
+    int64_t next;
+    uint32_t ms;
+    int i, runs = 0;
+
+    base = event_base_new(16);
+    assert(base);
+
+    srand(1);
+    for (i = 0; i < TIMERS; i++) {
+        /* from 0 ms up to about 5 hours, spread over all levels */
+        ms = (uint32_t)rand() % (1u << (i % 25));
+        event_base_timer_add(base, &timers[i], ms, on_timer, &timers[i]);
+    }
+    /* only one of them fires */
+    event_base_timer_add(base, &timers[0], 3, on_timer, &timers[0]);
+    event_base_timer_add(base, &timers[1], 3, on_timer, &timers[1]);
+
+    /* a rescheduled timer only fires once, at the new time */
+    event_base_timer_add(base, &timers[2], 100, on_timer, &timers[2]);
+    event_base_timer_add(base, &timers[2], 7000, on_timer, &timers[2]);
+
+    now = ev_timer_now();
+    ev_timer_run(base, now);
+    exact = 1;
+
+    while ((next = ev_timer_next(base, now)) != -1) {
+        now += next;
+        ev_timer_run(base, now);
+        runs++;
+    }
+    assert(fired == TIMERS - 1);
+    printf("%d timers in %d runs\n", fired, runs);
+
+    /* a timer added for the current tick waits for the next run */
+    fired = 0;
+    event_base_timer_add(base, &rearm, 0, on_rearm, &rearm);
+    for (i = 0; i < 5; i++) {
+        now++;
+        assert(ev_timer_run(base, now) == 1);
+    }
+    assert(fired == 5 && !event_timer_pending(&rearm));
+
+    event_base_destroy(base);
+
+    printf("ev_timer_test passed\n");
+
+    return 0;
+}
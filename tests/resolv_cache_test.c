@@ -0,0 +1,101 @@
+/* resolv_cache_test.c */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "resolv_cache.h"
+
+int main(int argc, char *argv[])
+{
+    struct resolv_cache *rc;
+    struct resolv_answer ans = {}, out;
+    int status, wstatus, ret, i;
+    pid_t pid;
+
+    rc = resolv_cache_new(64, 1, 2);
+    assert(rc);
+
+    ret = resolv_cache_get(rc, "a.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_MISS);
+
+    /* TTL 3600 is capped at 2 s */
+    ans.ttl = 3600;
+    ans.count = 1;
+    ans.addrs[0].family = AF_INET;
+    ans.addrs[0].in.v4.s_addr = inet_addr("10.0.0.1");
+    resolv_cache_put(rc, "a.test", RESOLV_A, RESOLV_OK, &ans);
+
+    ret = resolv_cache_get(rc, "A.Test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_HIT);
+    assert(status == RESOLV_OK && out.count == 1 && out.ttl <= 2);
+    assert(out.addrs[0].in.v4.s_addr == inet_addr("10.0.0.1"));
+    ret = resolv_cache_get(rc, "a.test", RESOLV_AAAA, &status, &out);
+    assert(ret == RESOLV_CACHE_MISS);
+
+    /* negative answers are cached, failures are not */
+    resolv_cache_put(rc, "nx.test", RESOLV_A, RESOLV_NOTFOUND, NULL);
+    ret = resolv_cache_get(rc, "nx.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_HIT);
+    assert(status == RESOLV_NOTFOUND && out.count == 0);
+    resolv_cache_put(rc, "fail.test", RESOLV_A, RESOLV_TIMEOUT, NULL);
+    ret = resolv_cache_get(rc, "fail.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_MISS);
+
+    /* entries put by a child are seen by the parent */
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        ans.addrs[0].in.v4.s_addr = inet_addr("10.0.0.2");
+        resolv_cache_put(rc, "child.test", RESOLV_A, RESOLV_OK, &ans);
+        exit(0);
+    }
+    waitpid(pid, &wstatus, 0);
+    ret = resolv_cache_get(rc, "child.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_HIT);
+    assert(out.addrs[0].in.v4.s_addr == inet_addr("10.0.0.2"));
+
+    /* a hot entry near expiry asks for a refresh, once */
+    usleep(1850 * 1000);
+    ret = resolv_cache_get(rc, "a.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_REFRESH);
+    ret = resolv_cache_get(rc, "a.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_HIT);
+    resolv_cache_put(rc, "a.test", RESOLV_A, RESOLV_OK, &ans);
+
+    /* the refreshed entry outlives the original one */
+    usleep(400 * 1000);
+    ret = resolv_cache_get(rc, "a.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_HIT);
+    ret = resolv_cache_get(rc, "child.test", RESOLV_A, &status, &out);
+    assert(ret == RESOLV_CACHE_MISS);
+
+    /* a writer killed at any point, locked sets included, stalls no one */
+    for (i = 0; i < 20; i++) {
+        pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            while (1)
+                resolv_cache_put(rc, "a.test", RESOLV_A, RESOLV_OK, &ans);
+        }
+        usleep(2000);
+        kill(pid, SIGKILL);
+        waitpid(pid, &wstatus, 0);
+        resolv_cache_put(rc, "a.test", RESOLV_A, RESOLV_OK, &ans);
+        ret = resolv_cache_get(rc, "a.test", RESOLV_A, &status, &out);
+        assert(ret == RESOLV_CACHE_HIT);
+    }
+    (void)ret;
+
+    resolv_cache_destroy(rc);
+
+    printf("resolv_cache_test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+/* resolv_test.c */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "ev.h"
+#include "debug.h"
+#include "resolv.h"
+
+/**
+ * Runs the resolver against a stand-in nameserver on 127.0.0.1:
+ *   a.test     two A records
+ *   nx.test    NXDOMAIN
+ *   drop.test  the first query is dropped, answered on the retry
+ *   port.test  an A record of 10.0.PORT, the source port of the query
+ */
+
+#define TEST_PORT 15353
+
+static int done;
+
+static void dns_server(int fd)
+{
+    uint8_t buf[512];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    int n, qend, drops = 1;
+    char name[256];
+
+    while (1) {
+        fromlen = sizeof(from);
+        n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                     &fromlen);
+        if (n < 12)
+            continue;
+
+        /* flatten the question name */
+        name[0] = '\0';
+        for (qend = 12; qend < n && buf[qend]; qend += buf[qend] + 1) {
+            if (name[0])
+                strcat(name, ".");
+            strncat(name, (char *)buf + qend + 1, buf[qend]);
+        }
+        qend += 5; /* root label, QTYPE, QCLASS */
+
+        buf[2] = 0x81; /* QR, RD */
+        buf[3] = 0x80; /* RA */
+
+        if (strcmp(name, "a.test") == 0) {
+            uint8_t rr[] = {0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60,
+                            0,    4,  10, 0, 0, 1};
+            buf[7] = 2; /* ANCOUNT */
+            memcpy(buf + qend, rr, sizeof(rr));
+            rr[sizeof(rr) - 1] = 2;
+            rr[9] = 30; /* smaller TTL on the second record */
+            memcpy(buf + qend + sizeof(rr), rr, sizeof(rr));
+            n = qend + 2 * sizeof(rr);
+        } else if (strcmp(name, "port.test") == 0) {
+            uint8_t rr[] = {0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60,
+                            0,    4,  10, 0, 0, 0};
+            memcpy(rr + 14, &from.sin_port, 2);
+            buf[7] = 1;
+            memcpy(buf + qend, rr, sizeof(rr));
+            n = qend + sizeof(rr);
+        } else if (strcmp(name, "drop.test") == 0) {
+            if (drops-- > 0)
+                continue;
+            uint8_t rr[] = {0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60,
+                            0,    4,  10, 0, 0, 3};
+            buf[7] = 1;
+            memcpy(buf + qend, rr, sizeof(rr));
+            n = qend + sizeof(rr);
+        } else {
+            buf[3] |= 3; /* NXDOMAIN */
+            n = qend;
+        }
+
+        sendto(fd, buf, n, 0, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+static void on_a(struct event_base *base, int status,
+                 const struct resolv_answer *ans, void *arg)
+{
+    assert(status == RESOLV_OK);
+    assert(ans->count == 2);
+    assert(ans->ttl == 30);
+    assert(ans->addrs[0].family == AF_INET);
+    assert(ans->addrs[0].in.v4.s_addr == inet_addr("10.0.0.1"));
+    assert(ans->addrs[1].in.v4.s_addr == inet_addr("10.0.0.2"));
+    printf("a.test ok\n");
+    done++;
+}
+
+static void on_nx(struct event_base *base, int status,
+                  const struct resolv_answer *ans, void *arg)
+{
+    assert(status == RESOLV_NOTFOUND);
+    assert(ans == NULL);
+    printf("nx.test ok\n");
+    done++;
+}
+
+static void on_drop(struct event_base *base, int status,
+                    const struct resolv_answer *ans, void *arg)
+{
+    assert(status == RESOLV_OK);
+    assert(ans->count == 1);
+    assert(ans->addrs[0].in.v4.s_addr == inet_addr("10.0.0.3"));
+    printf("drop.test ok\n");
+    done++;
+}
+
+#define PORT_QUERIES (2 * RESOLV_ROTATE + 1)
+
+static uint16_t ports[PORT_QUERIES];
+static int nports;
+
+static void on_port(struct event_base *base, int status,
+                    const struct resolv_answer *ans, void *arg)
+{
+    assert(status == RESOLV_OK && ans->count == 1);
+    memcpy(&ports[nports++], (uint8_t *)&ans->addrs[0].in.v4 + 2, 2);
+}
+
+static void on_cancelled(struct event_base *base, int status,
+                         const struct resolv_answer *ans, void *arg)
+{
+    assert(0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in si = {};
+    struct event_base *base;
+    struct resolv *r;
+    struct resolv_answer ans;
+    struct timeval tv;
+    int fd, i, j, distinct, ret;
+    pid_t pid;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(fd != -1);
+    si.sin_family = AF_INET;
+    si.sin_addr.s_addr = inet_addr("127.0.0.1");
+    si.sin_port = htons(TEST_PORT);
+    ret = bind(fd, (struct sockaddr *)&si, sizeof(si));
+    assert(ret == 0);
+
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0)
+        dns_server(fd);
+    close(fd);
+
+    base = event_base_new(16);
+    assert(base);
+    r = resolv_new(base);
+    assert(r);
+    ret = resolv_add_nameserver(r, "127.0.0.1", TEST_PORT);
+    assert(ret == 0);
+
+    /* literals never leave the process */
+    ret = resolv_lookup_local(r, "192.0.2.7", RESOLV_A, &ans);
+    assert(ret == 0);
+    assert(ans.count == 1);
+    assert(ans.addrs[0].in.v4.s_addr == inet_addr("192.0.2.7"));
+    ret = resolv_lookup_local(r, "a.test", RESOLV_A, &ans);
+    assert(ret == -1);
+
+    ret = !!resolv_query(r, "a.test", RESOLV_A, on_a, NULL);
+    ret &= !!resolv_query(r, "nx.test", RESOLV_A, on_nx, NULL);
+    ret &= !!resolv_query(r, "drop.test", RESOLV_A, on_drop, NULL);
+    assert(ret);
+    resolv_cancel(r, resolv_query(r, "a.test", RESOLV_A, on_cancelled, NULL));
+
+    /* in flight at once, answered on the sockets retired meanwhile too */
+    for (i = 0; i < PORT_QUERIES; i++) {
+        ret = !!resolv_query(r, "port.test", RESOLV_A, on_port, NULL);
+        assert(ret);
+    }
+
+    /* the retry of drop.test comes after the 2 s default timeout */
+    for (i = 0; i < 50 && (done < 3 || nports < PORT_QUERIES); i++) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        event_base_loop(base, &tv);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    resolv_destroy(r);
+    event_base_destroy(base);
+
+    assert(done == 3 && nports == PORT_QUERIES);
+
+    /* a new source port every RESOLV_ROTATE queries */
+    for (i = 0, distinct = 0; i < nports; i++) {
+        for (j = 0; j < i && ports[j] != ports[i]; j++)
+            ;
+        distinct += (j == i);
+    }
+    assert(distinct >= PORT_QUERIES / RESOLV_ROTATE);
+    printf("resolv_test passed, %d source ports\n", distinct);
+    (void)ret;
+
+    return 0;
+}
@@ -25,6 +25,10 @@ static void accept_worker(struct event_base *base, int fd, uint16_t flags,
                           void *data);
 static void read_worker(struct event_base *base, int fd, uint16_t flags,
                         void *data);
+static void resolved(struct event_base *base, int status,
+                     const struct resolv_answer *ans, void *arg);
+
+static struct resolv *resolver;
 
 int main(int argc, char *argv[])
 {
@@ -33,13 +37,17 @@ int main(int argc, char *argv[])
     struct timeval tv = {};
     int ret;
 
-    s = socks_create("0.0.0.0", 1080, NULL, NULL);
+    s = socks_create("0.0.0.0", 1080, NULL, NULL, 0);
 
     set_nonblocking(s->fd, 1);
 
     base = event_base_new(4);
     event_base_add(base, s->fd, EV_READ, accept_worker, s);
 
+    resolver = resolv_new(base);
+    resolv_load_conf(resolver, RESOLV_CONF);
+    resolv_load_hosts(resolver, RESOLV_HOSTS);
+
     while (1) {
         tv.tv_sec = 10;
         tv.tv_usec = 0;
@@ -48,6 +56,7 @@ int main(int argc, char *argv[])
         pw_debug("event number: %d\n", base->event_num);
     }
     event_base_delete(base, s->fd, EV_READ);
+    resolv_destroy(resolver);
     event_base_destroy(base);
 
     return 0;
@@ -58,12 +67,11 @@ static void accept_worker(struct event_base *base, int fd, uint16_t flags,
 {
     struct socks_conn *c;
 
-    c = socks_accept_conn(data);
+    c = socks_accept_conn(data, NULL);
     if (!c)
         return;
 
-    pw_debug("new socks conn: %s:%d\n", inet_ntoa(c->addr.sin_addr),
-             ntohs(c->addr.sin_port));
+    pw_debug("new socks conn: %d\n", c->srcfd);
 
     set_nonblocking(c->srcfd, 1);
     event_base_add(base, c->srcfd, EV_READ, read_worker, c);
@@ -73,31 +81,57 @@ static void read_worker(struct event_base *base, int fd, uint16_t flags,
                         void *data)
 {
     struct socks_conn *c = data;
+    int ret;
 
     switch (c->state) {
     case SOCKS_METHOD:
-        if (socks_get_method(c) == -1) {
-            pw_debug("socks get method failed\n");
+    case SOCKS_AUTH:
+    case SOCKS_CMD:
+        while ((ret = socks_handshake(c)) == 1 &&
+               (c->state == SOCKS_AUTH || c->state == SOCKS_CMD))
+            ;
+        if (ret == -1) {
+            pw_debug("socks handshake failed\n");
             goto done;
         }
-        break;
-    case SOCKS_AUTH:
-        if (socks_authenticate(c) == -1) {
-            pw_debug("socks authenticate failed\n");
+        if (ret == 0)
+            break;
+        if (event_base_add(base, c->srcfd, EV_WRITE, read_worker, c) == -1)
             goto done;
+        if (c->state == SOCKS_RESOLVING) {
+            c->query = resolv_query(resolver, c->domain, RESOLV_A, resolved, c);
+            if (!c->query)
+                goto done;
+            break;
         }
-        break;
-    case SOCKS_CMD:
-        if (socks_command(c) == -1) {
-            pw_debug("socks handle command failed\n");
+        if (event_base_add(base, c->race[0], EV_WRITE, read_worker, c) == -1)
             goto done;
+        break;
+    case SOCKS_RESOLVING:
+        break;
+    case SOCKS_CONNECTING:
+        if (fd == c->srcfd)
+            break;
+        /* no racing here, the addresses are tried one after the other */
+        event_base_delete(base, fd, EV_WRITE);
+        if (socks_race_check(c, fd) == -1) {
+            fd = socks_race_next(c);
+            if (fd == -1) {
+                socks_race_fail(c);
+                goto done;
+            }
+            if (event_base_add(base, fd, EV_WRITE, read_worker, c) == -1)
+                goto done;
+            break;
         }
-        set_nonblocking(c->dstfd, 1);
-        if (event_base_add(base, c->dstfd, EV_READ, read_worker, c) == -1)
+        if (socks_race_won(c, fd) == -1)
+            goto done;
+        if (event_base_add(base, c->dstfd, EV_READ | EV_WRITE, read_worker,
+                           c) == -1)
             goto done;
         break;
     case SOCKS_SERVE:
-        if (socks_serve(c, fd) == -1)
+        if (socks_serve(c, fd, flags) == -1)
             goto done;
         break;
     default:
@@ -107,7 +141,35 @@ static void read_worker(struct event_base *base, int fd, uint16_t flags,
     return;
 done:
     pw_debug("close connection: %d\n", fd);
-    event_base_delete(base, c->srcfd, EV_READ);
-    event_base_delete(base, c->dstfd, EV_READ);
+    resolv_cancel(resolver, c->query);
+    for (ret = 0; ret < c->nrace; ret++)
+        event_base_delete(base, c->race[ret], EV_WRITE);
+    event_base_delete(base, c->srcfd, EV_READ | EV_WRITE);
+    event_base_delete(base, c->dstfd, EV_READ | EV_WRITE);
     socks_close_conn(c);
 }
+
+static void resolved(struct event_base *base, int status,
+                     const struct resolv_answer *ans, void *arg)
+{
+    struct socks_conn *c = arg;
+    int fd;
+
+    c->query = NULL;
+
+    if (status == RESOLV_OK)
+        socks_race_addrs(c, ans);
+
+    fd = socks_race_next(c);
+    if (fd == -1) {
+        socks_race_fail(c);
+        event_base_delete(base, c->srcfd, EV_READ | EV_WRITE);
+        socks_close_conn(c);
+        return;
+    }
+
+    if (event_base_add(base, fd, EV_WRITE, read_worker, c) == -1) {
+        event_base_delete(base, c->srcfd, EV_READ | EV_WRITE);
+        socks_close_conn(c);
+    }
+}
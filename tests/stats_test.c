@@ -0,0 +1,56 @@
+/* stats_test.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "stats.h"
+
+/**
+ * Every value lands in the bucket whose bounds hold it, the buckets are
+ * ordered and a third wide at most, and merging adds up.
+ */
+
+int main(int argc, char *argv[])
+{
+    struct stats_hist a = {}, b = {};
+    uint64_t v, upper, lower;
+    int i, shift;
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        upper = stats_hist_upper(i);
+        lower = i ? stats_hist_upper(i - 1) + 1 : 0;
+        assert(upper >= lower);
+        assert(stats_hist_bucket(lower) == i);
+        if (i < STATS_HIST_BUCKETS - 1) {
+            assert(stats_hist_bucket(upper) == i);
+            assert(upper - lower <= lower / 2 + 1);
+        }
+    }
+
+    for (shift = 0; shift < 64; shift++) {
+        v = 1ULL << shift;
+        for (i = -1; i <= 1; i++) {
+            if (shift == 0 && i < 0)
+                continue;
+            assert(stats_hist_bucket(v + i) < STATS_HIST_BUCKETS);
+            assert(v + i <= stats_hist_upper(stats_hist_bucket(v + i)));
+        }
+    }
+
+    for (v = 0; v < 100000; v += 7)
+        stats_hist_add(v & 1 ? &a : &b, v);
+    stats_hist_merge(&a, &b);
+    assert(a.count == (100000 + 6) / 7);
+    for (v = 0, i = 0; i < STATS_HIST_BUCKETS; i++)
+        v += a.buckets[i];
+    assert(v == a.count);
+
+    assert(strcmp(stats_state_name(1), "method") == 0);
+    assert(!stats_state_name(0));
+
+    printf("stats_test passed\n");
+
+    return 0;
+}
@@ -0,0 +1,790 @@
+/* socks_bench.c */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ev.h"
+#include "ev_timer.h"
+#include "misc.h"
+#include "stats.h"
+
+/**
+ * socks-bench keeps a number of SOCKS5 sessions busy against a proxy, each
+ * one connects, negotiates, CONNECTs to a target this process serves on
+ * loopback, relays a payload and starts over. The target runs its own
+ * event loop on a thread, echoing the payload back or sinking it.
+ *
+ * With --udp a session does a UDP ASSOCIATE instead and keeps a window of
+ * datagrams in flight through the relay to a UDP echo target, until the
+ * run ends. A window that went quiet, its datagrams lost, is sent again.
+ */
+
+#define BENCH_BUF 16384
+#define BENCH_UDP_WINDOW 16
+#define BENCH_UDP_STALL 200000 /* us without an echo before a resend */
+
+enum {
+    BENCH_CONNECT = 1, /* TCP connect to the proxy */
+    BENCH_METHOD,      /* greeting sent, waiting for the method */
+    BENCH_AUTH,        /* user/pass sent */
+    BENCH_REPLY,       /* CONNECT sent */
+    BENCH_RELAY,       /* payload through the tunnel */
+    BENCH_UDP,         /* datagrams through the relay */
+};
+
+struct bench_opt {
+    const char *proxy_host;
+    uint16_t proxy_port;
+    const char *user;
+    const char *passwd;
+    uint32_t concurrency;
+    uint32_t duration; /* seconds */
+    uint32_t bytes;    /* payload per session */
+    int domain;        /* CONNECT localhost with ATYP domain */
+    int sink;          /* the target discards instead of echoing */
+    int udp;           /* UDP ASSOCIATE, bytes is the datagram payload */
+    int json;
+};
+
+struct session {
+    int fd;
+    int udp;     /* datagram socket connected to the relay, or -1 */
+    uint64_t last; /* us, last echo or resend of the window */
+    uint8_t state;
+    uint16_t events; /* EV_* registered */
+    uint64_t start;  /* us, connect to the proxy */
+    uint32_t sent;
+    uint32_t received;
+    uint32_t inlen; /* handshake bytes buffered */
+    uint8_t in[64];
+};
+
+struct target_conn {
+    int fd;
+    uint32_t off; /* echo bytes left to write back start here */
+    uint32_t len;
+    char buf[BENCH_BUF];
+};
+
+static struct bench_opt opt = {
+    .proxy_host = "127.0.0.1",
+    .proxy_port = 1080,
+    .concurrency = 64,
+    .duration = 10,
+};
+
+static struct sockaddr_in proxy_addr;
+static uint16_t target_port; /* host byte order, TCP and UDP */
+static char payload[BENCH_BUF];
+static int running = 1; /* sessions start over when they end */
+
+/* results, only the main loop writes them */
+static struct stats_hist handshake_hist;
+static struct stats_hist session_hist;
+static uint64_t sessions, errors, relayed;
+static uint64_t datagrams_sent, datagrams_echoed;
+
+static void session_event(struct event_base *base, int fd, uint16_t flags,
+                          void *data);
+static void session_start(struct event_base *base, struct session *s);
+
+/* ---- target ---- */
+
+static void target_close(struct event_base *base, struct target_conn *t)
+{
+    event_base_delete(base, t->fd, EV_READ | EV_WRITE);
+    close(t->fd);
+    free(t);
+}
+
+static void target_event(struct event_base *base, int fd, uint16_t flags,
+                         void *data)
+{
+    struct target_conn *t = data;
+    ssize_t n;
+
+    while (1) {
+        /* write back what was read before reading more. */
+        while (t->off < t->len) {
+            n = write(fd, t->buf + t->off, t->len - t->off);
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    event_base_add(base, fd, EV_WRITE, target_event, t);
+                    return;
+                }
+                target_close(base, t);
+                return;
+            }
+            t->off += n;
+        }
+        event_base_delete(base, fd, EV_WRITE);
+
+        n = read(fd, t->buf, sizeof(t->buf));
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            target_close(base, t);
+            return;
+        }
+        if (n == -1)
+            return;
+
+        t->off = 0;
+        t->len = opt.sink ? 0 : n;
+    }
+}
+
+static void target_accept(struct event_base *base, int fd, uint16_t flags,
+                          void *data)
+{
+    struct target_conn *t;
+    int connfd;
+
+    while ((connfd = accept(fd, NULL, NULL)) != -1) {
+        set_nonblocking(connfd, 1);
+        t = calloc(1, sizeof(struct target_conn));
+        if (!t) {
+            close(connfd);
+            continue;
+        }
+        t->fd = connfd;
+        if (event_base_add(base, connfd, EV_READ, target_event, t) == -1) {
+            close(connfd);
+            free(t);
+        }
+    }
+}
+
+static void target_udp(struct event_base *base, int fd, uint16_t flags,
+                       void *data)
+{
+    struct sockaddr_storage ss;
+    socklen_t len;
+    char buf[65536];
+    ssize_t n;
+
+    while (1) {
+        len = sizeof(ss);
+        n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&ss, &len);
+        if (n == -1)
+            return;
+        if (!opt.sink)
+            sendto(fd, buf, n, 0, (struct sockaddr *)&ss, len);
+    }
+}
+
+/* runs until the process exits. */
+static void *target_thread(void *arg)
+{
+    struct event_base *base = arg;
+
+    while (1)
+        event_base_loop(base, NULL);
+
+    return NULL;
+}
+
+static struct event_base *target_start(void)
+{
+    struct sockaddr_in si;
+    socklen_t len = sizeof(si);
+    struct event_base *base;
+    pthread_t tid;
+    int fd, ufd;
+
+    fd = tcp_listen("127.0.0.1", 0);
+    if (fd == -1 || getsockname(fd, (struct sockaddr *)&si, &len) == -1)
+        return NULL;
+    target_port = ntohs(si.sin_port);
+
+    /* the same port for UDP, it is free as often as not. */
+    ufd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (ufd == -1 || bind(ufd, (struct sockaddr *)&si, len) == -1)
+        return NULL;
+    set_nonblocking(ufd, 1);
+
+    base = event_base_new(opt.concurrency * 2);
+    if (!base || event_base_add(base, fd, EV_READ, target_accept, NULL) == -1 ||
+        event_base_add(base, ufd, EV_READ, target_udp, NULL) == -1)
+        return NULL;
+
+    if (pthread_create(&tid, NULL, target_thread, base) != 0)
+        return NULL;
+    pthread_detach(tid);
+
+    return base;
+}
+
+/* ---- sessions ---- */
+
+static void session_watch(struct event_base *base, struct session *s,
+                          uint16_t events)
+{
+    if (s->events & ~events)
+        event_base_delete(base, s->fd, s->events & ~events);
+    if (events & ~s->events)
+        event_base_add(base, s->fd, events & ~s->events, session_event, s);
+    s->events = events;
+}
+
+static void session_end(struct event_base *base, struct session *s, int ok)
+{
+    event_base_delete(base, s->fd, s->events);
+    close(s->fd);
+    s->fd = -1;
+    s->events = EV_NONE;
+    if (s->udp != -1) {
+        event_base_delete(base, s->udp, EV_READ);
+        close(s->udp);
+        s->udp = -1;
+    }
+
+    if (ok) {
+        sessions++;
+        stats_hist_add(&session_hist, ev_timer_now_us() - s->start);
+    } else {
+        errors++;
+    }
+
+    if (running > 0)
+        session_start(base, s);
+}
+
+/* handshake messages are small, a fresh socket takes them at once. */
+static int session_send(struct session *s, const void *buf, size_t len)
+{
+    return write(s->fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static int session_request(struct session *s)
+{
+    uint8_t buf[300];
+    size_t len = 0, n;
+
+    buf[len++] = 5;
+    buf[len++] = opt.udp ? 3 : 1; /* UDP ASSOCIATE or CONNECT */
+    buf[len++] = 0;
+    if (opt.udp) {
+        /* the address datagrams come from is not known yet */
+        memset(buf + len, 0, 5);
+        buf[len] = 1;
+        len += 5;
+    } else if (opt.domain) {
+        n = strlen("localhost");
+        buf[len++] = 3;
+        buf[len++] = n;
+        memcpy(buf + len, "localhost", n);
+        len += n;
+    } else {
+        buf[len++] = 1;
+        buf[len++] = 127;
+        buf[len++] = 0;
+        buf[len++] = 0;
+        buf[len++] = 1;
+    }
+    if (opt.udp) {
+        buf[len++] = 0;
+        buf[len++] = 0;
+    } else {
+        buf[len++] = target_port >> 8;
+        buf[len++] = target_port & 0xff;
+    }
+
+    s->state = BENCH_REPLY;
+    s->inlen = 0;
+    return session_send(s, buf, len);
+}
+
+/* buffer handshake input until want bytes are there, 1 when they are. */
+static int session_input(struct session *s, uint32_t want)
+{
+    ssize_t n;
+
+    while (s->inlen < want) {
+        n = read(s->fd, s->in + s->inlen, want - s->inlen);
+        if (n == 0)
+            return -1;
+        if (n == -1)
+            return errno == EAGAIN ? 0 : -1;
+        s->inlen += n;
+    }
+    return 1;
+}
+
+static int session_relay(struct event_base *base, struct session *s)
+{
+    char buf[BENCH_BUF];
+    uint32_t chunk;
+    ssize_t n;
+
+    while (s->sent < opt.bytes) {
+        chunk = opt.bytes - s->sent;
+        if (chunk > sizeof(payload))
+            chunk = sizeof(payload);
+        n = write(s->fd, payload, chunk);
+        if (n == -1) {
+            if (errno != EAGAIN)
+                return -1;
+            break;
+        }
+        s->sent += n;
+        relayed += n;
+    }
+
+    while (!opt.sink && s->received < s->sent) {
+        n = read(s->fd, buf, sizeof(buf));
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno != EAGAIN)
+                return -1;
+            break;
+        }
+        s->received += n;
+        relayed += n;
+    }
+
+    if (s->sent == opt.bytes && (opt.sink || s->received == opt.bytes))
+        return 1;
+
+    session_watch(base, s, s->sent < opt.bytes ? EV_READ | EV_WRITE : EV_READ);
+    return 0;
+}
+
+/* datagrams of the window, each one a header for 127.0.0.1 and a payload. */
+static int session_udp_send(struct session *s, int count)
+{
+    uint8_t buf[10 + BENCH_BUF];
+    int i;
+
+    buf[0] = 0;
+    buf[1] = 0;
+    buf[2] = 0; /* FRAG */
+    buf[3] = 1;
+    buf[4] = 127;
+    buf[5] = 0;
+    buf[6] = 0;
+    buf[7] = 1;
+    buf[8] = target_port >> 8;
+    buf[9] = target_port & 0xff;
+    memcpy(buf + 10, payload, opt.bytes);
+
+    for (i = 0; i < count; i++) {
+        if (send(s->udp, buf, 10 + opt.bytes, 0) == -1)
+            return errno == EAGAIN || errno == ENOBUFS ? 0 : -1;
+        datagrams_sent++;
+    }
+    return 0;
+}
+
+static void session_udp_event(struct event_base *base, int fd, uint16_t flags,
+                              void *data)
+{
+    struct session *s = data;
+    uint8_t buf[10 + BENCH_BUF];
+    ssize_t n;
+    int echoed = 0;
+
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 10) {
+        datagrams_echoed++;
+        relayed += n - 10;
+        echoed++;
+    }
+    if (n == -1 && errno != EAGAIN && errno != ECONNREFUSED) {
+        session_end(base, s, 0);
+        return;
+    }
+
+    /* one new datagram for every one back keeps the window full. */
+    if (echoed) {
+        s->last = ev_timer_now_us();
+        if (session_udp_send(s, echoed) == -1)
+            session_end(base, s, 0);
+    }
+}
+
+/* the relay is where BND says, or the proxy address when that is 0.0.0.0 */
+static int session_associate(struct event_base *base, struct session *s)
+{
+    struct sockaddr_in relay = proxy_addr;
+
+    if (memcmp(s->in + 4, "\0\0\0\0", 4) != 0)
+        memcpy(&relay.sin_addr, s->in + 4, 4);
+    memcpy(&relay.sin_port, s->in + 8, 2);
+
+    s->udp = socket(PF_INET, SOCK_DGRAM, 0);
+    if (s->udp == -1)
+        return -1;
+    set_nonblocking(s->udp, 1);
+
+    if (connect(s->udp, (struct sockaddr *)&relay, sizeof(relay)) == -1 ||
+        event_base_add(base, s->udp, EV_READ, session_udp_event, s) == -1)
+        return -1;
+
+    /* still read on the control connection, only its close comes. */
+    s->state = BENCH_UDP;
+    sessions++;
+    s->last = ev_timer_now_us();
+    return session_udp_send(s, BENCH_UDP_WINDOW);
+}
+
+/* resend the window of sessions whose datagrams all got lost. */
+static void session_udp_check(struct session *ss, uint32_t count)
+{
+    uint64_t now = ev_timer_now_us();
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (ss[i].state != BENCH_UDP || now - ss[i].last < BENCH_UDP_STALL)
+            continue;
+        ss[i].last = now;
+        session_udp_send(&ss[i], BENCH_UDP_WINDOW);
+    }
+}
+
+static void session_event(struct event_base *base, int fd, uint16_t flags,
+                          void *data)
+{
+    struct session *s = data;
+    uint8_t greeting[3] = {5, 1, 0}, auth[515];
+    socklen_t len = sizeof(int);
+    size_t ulen, plen;
+    int err = 0, ret;
+
+    switch (s->state) {
+    case BENCH_CONNECT:
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+            goto fail;
+        if (opt.user)
+            greeting[2] = 2;
+        if (session_send(s, greeting, sizeof(greeting)) == -1)
+            goto fail;
+        s->state = BENCH_METHOD;
+        session_watch(base, s, EV_READ);
+        break;
+    case BENCH_METHOD:
+        ret = session_input(s, 2);
+        if (ret <= 0)
+            goto wait;
+        if (s->in[1] == 2 && opt.user) {
+            ulen = strlen(opt.user);
+            plen = strlen(opt.passwd);
+            auth[0] = 1;
+            auth[1] = ulen;
+            memcpy(auth + 2, opt.user, ulen);
+            auth[2 + ulen] = plen;
+            memcpy(auth + 3 + ulen, opt.passwd, plen);
+            s->state = BENCH_AUTH;
+            s->inlen = 0;
+            if (session_send(s, auth, 3 + ulen + plen) == -1)
+                goto fail;
+        } else if (s->in[1] != 0 || session_request(s) == -1) {
+            goto fail;
+        }
+        break;
+    case BENCH_AUTH:
+        ret = session_input(s, 2);
+        if (ret <= 0)
+            goto wait;
+        if (s->in[1] != 0 || session_request(s) == -1)
+            goto fail;
+        break;
+    case BENCH_REPLY:
+        ret = session_input(s, 10); /* BND.ADDR is IPv4 */
+        if (ret <= 0)
+            goto wait;
+        if (s->in[1] != 0)
+            goto fail;
+        stats_hist_add(&handshake_hist, ev_timer_now_us() - s->start);
+        if (opt.udp) {
+            if (session_associate(base, s) == -1)
+                goto fail;
+            break;
+        }
+        s->state = BENCH_RELAY;
+        /* fall through */
+    case BENCH_RELAY:
+        ret = session_relay(base, s);
+        if (ret == -1)
+            goto fail;
+        if (ret == 1)
+            session_end(base, s, 1);
+        break;
+    case BENCH_UDP:
+        /* the proxy closed the control connection, the association ended */
+        goto fail;
+    }
+    return;
+wait:
+    if (ret == 0)
+        return;
+fail:
+    session_end(base, s, 0);
+}
+
+static void session_start(struct event_base *base, struct session *s)
+{
+    int one = 1;
+
+    memset(s, 0, sizeof(*s));
+    s->udp = -1;
+    s->start = ev_timer_now_us();
+
+    s->fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (s->fd == -1) {
+        perror("socket");
+        errors++;
+        return;
+    }
+    set_nonblocking(s->fd, 1);
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(s->fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) ==
+            -1 &&
+        errno != EINPROGRESS) {
+        close(s->fd);
+        s->fd = -1;
+        errors++;
+        return;
+    }
+
+    s->state = BENCH_CONNECT;
+    session_watch(base, s, EV_WRITE);
+}
+
+/* ---- report ---- */
+
+/* upper bound of the bucket the pth percentile falls in, us. */
+static uint64_t percentile(const struct stats_hist *h, double p)
+{
+    uint64_t rank, cum = 0;
+    int i;
+
+    if (!h->count)
+        return 0;
+
+    rank = (uint64_t)(p / 100 * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        cum += h->buckets[i];
+        if (cum > rank)
+            return stats_hist_upper(i);
+    }
+    return stats_hist_upper(STATS_HIST_BUCKETS - 1);
+}
+
+static void report(double sec)
+{
+    static const double ps[] = {50, 90, 99, 99.9};
+    static const char *names[] = {"p50", "p90", "p99", "p999"};
+    double mean;
+    int i;
+
+    mean = handshake_hist.count ? (double)handshake_hist.sum /
+                                      handshake_hist.count
+                                : 0;
+
+    if (opt.udp && opt.json) {
+        printf("{\"proxy\":\"%s:%u\",\"concurrency\":%u,\"bytes\":%u,"
+               "\"auth\":%s,\"mode\":\"udp\",\"seconds\":%.3f,"
+               "\"associations\":%llu,\"errors\":%llu,"
+               "\"datagrams_sent\":%llu,\"datagrams_echoed\":%llu,"
+               "\"echoed_per_sec\":%.1f,\"throughput_mib_s\":%.2f}\n",
+               opt.proxy_host, opt.proxy_port, opt.concurrency, opt.bytes,
+               opt.user ? "true" : "false", sec, (unsigned long long)sessions,
+               (unsigned long long)errors, (unsigned long long)datagrams_sent,
+               (unsigned long long)datagrams_echoed, datagrams_echoed / sec,
+               relayed / sec / (1024 * 1024));
+        return;
+    }
+    if (opt.udp) {
+        printf("proxy %s:%u, %u associations at once, %u byte datagrams%s\n",
+               opt.proxy_host, opt.proxy_port, opt.concurrency, opt.bytes,
+               opt.user ? ", user/pass" : "");
+        printf("%llu associations, %llu errors in %.2f s\n",
+               (unsigned long long)sessions, (unsigned long long)errors, sec);
+        printf("%llu datagrams sent, %llu echoed, %.1f echoed/s, "
+               "%.2f MiB/s\n",
+               (unsigned long long)datagrams_sent,
+               (unsigned long long)datagrams_echoed, datagrams_echoed / sec,
+               relayed / sec / (1024 * 1024));
+        return;
+    }
+
+    if (opt.json) {
+        printf("{\"proxy\":\"%s:%u\",\"concurrency\":%u,\"bytes\":%u,"
+               "\"auth\":%s,\"atyp\":\"%s\",\"mode\":\"%s\",\"seconds\":%.3f,"
+               "\"sessions\":%llu,\"errors\":%llu,\"sessions_per_sec\":%.1f,"
+               "\"handshake_us\":{\"mean\":%.1f",
+               opt.proxy_host, opt.proxy_port, opt.concurrency, opt.bytes,
+               opt.user ? "true" : "false", opt.domain ? "domain" : "ipv4",
+               opt.sink ? "sink" : "echo", sec, (unsigned long long)sessions,
+               (unsigned long long)errors, sessions / sec, mean);
+        for (i = 0; i < 4; i++)
+            printf(",\"%s\":%llu", names[i],
+                   (unsigned long long)percentile(&handshake_hist, ps[i]));
+        printf("},\"session_us\":{\"p50\":%llu,\"p99\":%llu},"
+               "\"throughput_mib_s\":%.2f}\n",
+               (unsigned long long)percentile(&session_hist, 50),
+               (unsigned long long)percentile(&session_hist, 99),
+               relayed / sec / (1024 * 1024));
+        return;
+    }
+
+    printf("proxy %s:%u, %u sessions at once, %u bytes %s, %s%s\n",
+           opt.proxy_host, opt.proxy_port, opt.concurrency, opt.bytes,
+           opt.sink ? "sunk" : "echoed", opt.domain ? "domain" : "ipv4",
+           opt.user ? ", user/pass" : "");
+    printf("%llu sessions, %llu errors in %.2f s, %.1f sessions/s\n",
+           (unsigned long long)sessions, (unsigned long long)errors, sec,
+           sessions / sec);
+    printf("handshake mean %.1f us", mean);
+    for (i = 0; i < 4; i++)
+        printf(", %s %llu us", names[i],
+               (unsigned long long)percentile(&handshake_hist, ps[i]));
+    printf("\nrelay %.2f MiB/s\n", relayed / sec / (1024 * 1024));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "%s Usage: --proxy 127.0.0.1 --port 1080 -c 64 -d 10\n"
+            "Options:\n"
+            "      --proxy       proxy address, 127.0.0.1 by default\n"
+            "      --port        proxy port, 1080 by default\n"
+            "  -u, --user\n"
+            "  -p, --passwd\n"
+            "  -c, --concurrency sessions at once, 64 by default\n"
+            "  -d, --duration    seconds, 10 by default\n"
+            "  -b, --bytes       payload per session, 16384 by default,\n"
+            "                    per datagram with --udp, 512 by default\n"
+            "      --domain      CONNECT to localhost by name, not 127.0.0.1\n"
+            "      --sink        the target discards the payload\n"
+            "      --udp         relay datagrams over UDP ASSOCIATE, in pps\n"
+            "      --json        print the results as one JSON object\n"
+            "  -h, --help\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option options[] = {
+        {"proxy", required_argument, NULL, 1},
+        {"port", required_argument, NULL, 2},
+        {"user", required_argument, NULL, 'u'},
+        {"passwd", required_argument, NULL, 'p'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"bytes", required_argument, NULL, 'b'},
+        {"domain", no_argument, NULL, 3},
+        {"sink", no_argument, NULL, 4},
+        {"json", no_argument, NULL, 5},
+        {"udp", no_argument, NULL, 6},
+        {"help", no_argument, NULL, 'h'},
+        {},
+    };
+    struct event_base *base;
+    struct session *ss;
+    uint64_t start, end;
+    uint32_t i;
+    int o;
+
+    while ((o = getopt_long(argc, argv, "u:p:c:d:b:h", options, NULL)) != -1) {
+        switch (o) {
+        case 1:
+            opt.proxy_host = optarg;
+            break;
+        case 2:
+            opt.proxy_port = atoi(optarg);
+            break;
+        case 'u':
+            opt.user = optarg;
+            break;
+        case 'p':
+            opt.passwd = optarg;
+            break;
+        case 'c':
+            opt.concurrency = atoi(optarg);
+            break;
+        case 'd':
+            opt.duration = atoi(optarg);
+            break;
+        case 'b':
+            opt.bytes = atoi(optarg);
+            break;
+        case 3:
+            opt.domain = 1;
+            break;
+        case 4:
+            opt.sink = 1;
+            break;
+        case 5:
+            opt.json = 1;
+            break;
+        case 6:
+            opt.udp = 1;
+            break;
+        default:
+            usage(basename(argv[0]));
+        }
+    }
+
+    if (opt.bytes == 0)
+        opt.bytes = opt.udp ? 512 : 16384;
+
+    if (opt.concurrency == 0 || opt.duration == 0 ||
+        (opt.udp && (opt.sink || opt.bytes > BENCH_BUF)) ||
+        (opt.user && strlen(opt.user) > 255) ||
+        (!opt.user != !opt.passwd) ||
+        (opt.passwd && strlen(opt.passwd) > 255))
+        usage(basename(argv[0]));
+
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(opt.proxy_port);
+    if (inet_pton(AF_INET, opt.proxy_host, &proxy_addr.sin_addr) != 1)
+        usage(basename(argv[0]));
+
+    memset(payload, 'x', sizeof(payload));
+
+    if (!target_start()) {
+        fprintf(stderr, "starting the target failed\n");
+        return 1;
+    }
+
+    base = event_base_new(opt.concurrency);
+    ss = calloc(opt.concurrency, sizeof(struct session));
+    if (!base || !ss) {
+        perror("calloc");
+        return 1;
+    }
+
+    start = ev_timer_now_us();
+    end = start + (uint64_t)opt.duration * 1000000;
+
+    for (i = 0; i < opt.concurrency; i++)
+        session_start(base, &ss[i]);
+
+    while (ev_timer_now_us() < end) {
+        event_base_loop(base, &(struct timeval){0, 100000});
+        if (opt.udp)
+            session_udp_check(ss, opt.concurrency);
+    }
+
+    /* sessions still in flight are not counted. */
+    running = 0;
+    report((ev_timer_now_us() - start) / 1e6);
+
+    return errors && !sessions;
+}
@@ -0,0 +1,214 @@
+/* socksctl.c */
+
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/**
+ * socksctl stats reads the counters the workers keep in shared memory and
+ * prints their rates. A sample is a copy out of the mapping, no syscall.
+ */
+
+static const char *reply_names[STATS_REPLIES] = {
+    [1] = "failure",     [2] = "not_allowed", [3] = "net_unreach",
+    [4] = "host_unreach", [5] = "refused",    [6] = "ttl_expired",
+    [7] = "cmd_unsupp",  [8] = "atyp_unsupp",
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "%s Usage: %s stats [options]\n"
+            "Options:\n"
+            "  -p, --port      port of the server, 1080 by default\n"
+            "  -n, --name      shm name of the counters, see --stats_name\n"
+            "  -i, --interval  seconds between samples, 1 by default\n"
+            "  -c, --count     samples to print, 0 forever, 1 by default\n"
+            "  -w, --workers   a row per worker, not only the total\n"
+            "  -h, --help\n",
+            name, name);
+    exit(1);
+}
+
+/* copy the counters of all workers out of the mapping. */
+static void sample(const struct stats *s, struct stats_worker *out,
+                   struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    memcpy(out, s->workers, s->hdr->workers * sizeof(struct stats_worker));
+}
+
+static void sum(struct stats_worker *total, const struct stats_worker *w,
+                uint32_t n)
+{
+    uint32_t i;
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < n; i++)
+        stats_worker_merge(total, &w[i]);
+}
+
+static double rate(uint64_t now, uint64_t prev, double sec)
+{
+    return sec > 0 ? (double)(now - prev) / sec : 0;
+}
+
+static void print_row(const char *name, const struct stats_worker *now,
+                      const struct stats_worker *prev, double sec)
+{
+    printf("%-8s %8llu %6llu %10.1f %10.1f %10.1f %10.1f %12.1f %12.1f\n",
+           name, (unsigned long long)now->active,
+           (unsigned long long)now->queue,
+           rate(now->accepts, prev->accepts, sec),
+           rate(now->handoff_sent, prev->handoff_sent, sec),
+           rate(now->handoff_received, prev->handoff_received, sec),
+           rate(now->auth_failures, prev->auth_failures, sec),
+           rate(now->bytes_in, prev->bytes_in, sec) / 1024,
+           rate(now->bytes_out, prev->bytes_out, sec) / 1024);
+}
+
+static void print_totals(const struct stats_worker *t)
+{
+    int i;
+
+    printf("states  ");
+    for (i = 0; i < STATS_STATES; i++) {
+        if (stats_state_name(i))
+            printf(" %s %llu", stats_state_name(i),
+                   (unsigned long long)t->states[i]);
+    }
+    printf("\nreplies ");
+    for (i = 0; i < STATS_REPLIES; i++) {
+        if (reply_names[i])
+            printf(" %s %llu", reply_names[i],
+                   (unsigned long long)t->replies[i]);
+    }
+    printf("\nfastopen in %llu out %llu acked %llu\n",
+           (unsigned long long)t->fastopen_in,
+           (unsigned long long)t->fastopen_out,
+           (unsigned long long)t->fastopen_acked);
+}
+
+static int stats_command(const char *name, int interval, int count,
+                         int per_worker)
+{
+    struct stats_worker *prev, *now, *tmp, tprev, tnow;
+    struct timespec t0, t1;
+    struct stats *s;
+    uint32_t i, n;
+    double sec;
+    char row[16];
+    int k;
+
+    s = stats_open(name);
+    if (!s) {
+        fprintf(stderr, "no counters at %s, is the server running?\n", name);
+        return 1;
+    }
+
+    n = s->hdr->workers;
+    prev = calloc(n, sizeof(struct stats_worker));
+    now = calloc(n, sizeof(struct stats_worker));
+    if (!prev || !now) {
+        perror("calloc");
+        return 1;
+    }
+
+    printf("%s: master %d%s, %u workers, up %llu s\n", name,
+           (int)s->hdr->master,
+           (kill(s->hdr->master, 0) == -1 && errno == ESRCH) ? " (gone)" : "",
+           n, (unsigned long long)(time(NULL) - s->hdr->started));
+
+    sample(s, prev, &t0);
+
+    for (k = 0; count == 0 || k < count; k++) {
+        sleep(interval);
+        sample(s, now, &t1);
+        sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+        printf("%-8s %8s %6s %10s %10s %10s %10s %12s %12s\n", "worker",
+               "active", "queue", "accept/s", "handoff/s", "takeover/s",
+               "authfail/s", "in KiB/s", "out KiB/s");
+        if (per_worker) {
+            for (i = 0; i < n; i++) {
+                snprintf(row, sizeof(row), "%u", i);
+                print_row(row, &now[i], &prev[i], sec);
+            }
+        }
+        sum(&tprev, prev, n);
+        sum(&tnow, now, n);
+        print_row("total", &tnow, &tprev, sec);
+        print_totals(&tnow);
+        fflush(stdout);
+
+        tmp = prev;
+        prev = now;
+        now = tmp;
+        t0 = t1;
+    }
+
+    free(prev);
+    free(now);
+    stats_destroy(s, NULL, 0);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"name", required_argument, NULL, 'n'},
+        {"interval", required_argument, NULL, 'i'},
+        {"count", required_argument, NULL, 'c'},
+        {"workers", no_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {},
+    };
+    const char *prog = basename(argv[0]), *name = NULL;
+    int opt, port = 1080, interval = 1, count = 1, per_worker = 0;
+    char buf[64];
+
+    if (argc < 2 || strcmp(argv[1], "stats") != 0)
+        usage(prog);
+
+    /* options follow the command. */
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "p:n:i:c:wh", options, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            if (interval < 1)
+                interval = 1;
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            per_worker = 1;
+            break;
+        default:
+            usage(prog);
+        }
+    }
+
+    if (!name)
+        name = stats_name(buf, sizeof(buf), port);
+
+    return stats_command(name, interval, count, per_worker);
+}